@@ -0,0 +1,302 @@
+#include <sys/resource.h>
+#include "commands.h"
+#include "stats.h"
+
+// benchmark suite: builds synthetic namespaces of 10^3 nodes up to -n nodes (by powers of 10) in
+// each shape, through the same command functions the shell runs, and times mkdir, creat, cd, ls,
+// save, reload, rm and rmdir on them - throughput, and latency percentiles from a histogram of
+// every call. results are JSON lines (one per shape, size and operation) for tracking regressions
+#define BENCHMINNODES 1000
+#define BENCHMAXNODES 100000        // default largest size (-n raises it)
+#define BENCHCDS 10000              // cds timed per namespace
+#define BENCHLISTINGS 1000          // lss timed per namespace
+#define BENCHDEPTH 256              // directories per chain in the deep shape
+#define BENCHFANOUT 16              // children per directory in the balanced shape
+#define BENCHDIRECTORYEVERY 8       // one node in this many is a directory in the wide and skewed shapes
+#define BENCHBUDGET 60.0            // seconds a build may take before the larger sizes of its shape are skipped
+#define BENCHSAVEFILE "benchmark-save.txt"
+
+// the shapes
+//   wide      every node in root
+//   deep      chains of BENCHDEPTH directories under root
+//   balanced  BENCHFANOUT children per directory, filled level by level
+//   skewed    each node goes under a random directory, heavily biased towards the first ones
+//             (a few huge directories and many small ones)
+char *shapes[] = {"wide", "deep", "balanced", "skewed", 0};
+
+// a generated namespace: node i is named d<i> or f<i> and goes under node parent[i] (-1 for root)
+// parents always come before their children
+typedef struct namespace {
+    long count;
+    int *parent;
+    char *type;
+    int *depth;             // 1 for children of root
+    int maxDepth;
+    long *dirs;             // the directories' indices
+    long dirCount;
+} NAMESPACE;
+
+FILE *results;
+uint64_t random64 = 88172645463325252ULL;
+
+
+// xorshift64
+uint64_t nextRandom() {
+    random64 ^= random64 << 13;
+    random64 ^= random64 >> 7;
+    random64 ^= random64 << 17;
+    return random64;
+}
+
+// fills in namespace with count nodes in the given shape. returns -1 if allocation failed
+int generate(NAMESPACE *namespace, char *shape, long count) {
+    namespace->count = count;
+    namespace->parent = malloc(count * sizeof(int));
+    namespace->type = malloc(count);
+    namespace->depth = malloc(count * sizeof(int));
+    namespace->dirs = malloc(count * sizeof(long));
+    namespace->dirCount = 0;
+    namespace->maxDepth = 0;
+    if (namespace->parent == NULL || namespace->type == NULL || namespace->depth == NULL || namespace->dirs == NULL) return -1;
+
+    for (long i = 0; i < count; i++) {
+        int parent = -1;
+        char type = 'D';
+        if (strcmp(shape, "wide") == 0) {
+            if (i % BENCHDIRECTORYEVERY != 0) type = 'F';
+        }
+        else if (strcmp(shape, "deep") == 0) {
+            if (i % BENCHDEPTH != 0) parent = i - 1;
+        }
+        else if (strcmp(shape, "balanced") == 0) {
+            if (i >= BENCHFANOUT) parent = i / BENCHFANOUT - 1;
+            if (BENCHFANOUT * (i + 1) >= count) type = 'F'; // no children
+        }
+        else {
+            // root or a directory, picked with probability falling off like the cube of its rank
+            double u = (nextRandom() >> 11) * (1.0 / (1ULL << 53));
+            long rank = (long)((namespace->dirCount + 1) * u * u * u);
+            if (rank > 0) parent = namespace->dirs[rank - 1];
+            if (i % BENCHDIRECTORYEVERY != 0) type = 'F';
+        }
+        namespace->parent[i] = parent;
+        namespace->type[i] = type;
+        namespace->depth[i] = parent < 0 ? 1 : namespace->depth[parent] + 1;
+        if (namespace->depth[i] > namespace->maxDepth) namespace->maxDepth = namespace->depth[i];
+        if (type == 'D') namespace->dirs[namespace->dirCount++] = i;
+    }
+    return 0;
+}
+
+void freeNamespace(NAMESPACE *namespace) {
+    free(namespace->parent);
+    free(namespace->type);
+    free(namespace->depth);
+    free(namespace->dirs);
+}
+
+// writes the absolute path of node i into path (built backwards from the parents)
+char *pathOf(NAMESPACE *namespace, long i, char *path, size_t capacity) {
+    char *start = path + capacity - 1;
+    *start = 0;
+    for (long node = i; node >= 0; node = namespace->parent[node]) {
+        char name[24];
+        int length = sprintf(name, "%c%ld", namespace->type[node] == 'D' ? 'd' : 'f', node);
+        start -= length;
+        memcpy(start, name, length);
+        *--start = '/';
+    }
+    return start;
+}
+
+// current resident set size in KiB (0 if /proc isn't there)
+long currentRss() {
+    FILE *status = fopen("/proc/self/status", "r");
+    char line[MAXLINELENGTH];
+    long rss = 0;
+    while (status != NULL && fgets(line, sizeof(line), status) != NULL) {
+        if (strncmp(line, "VmRSS:", 6) == 0) rss = atol(line + 6);
+    }
+    if (status != NULL) fclose(status);
+    return rss;
+}
+
+// writes one result line. items is what the throughput counts (calls, or nodes for save/reload)
+void report(char *shape, long nodes, char *op, HISTOGRAM *latency, long items, uint64_t nanoseconds) {
+    double seconds = nanoseconds / 1e9;
+    fprintf(results, "{\"shape\":\"%s\",\"nodes\":%ld,\"op\":\"%s\",\"calls\":%lu,\"seconds\":%.6f,"
+        "\"per_second\":%.0f,\"p50_ns\":%lu,\"p99_ns\":%lu,\"max_ns\":%lu}\n", shape, nodes, op,
+        (unsigned long)latency->count, seconds, seconds > 0 ? items / seconds : 0.0,
+        (unsigned long)histogramPercentile(latency, 0.5), (unsigned long)histogramPercentile(latency, 0.99),
+        (unsigned long)latency->max);
+    fflush(results);
+}
+
+// runs every benchmark on one namespace. returns the seconds the build took
+double benchNamespace(char *shape, NAMESPACE *namespace) {
+    NODE *root = newRootNode(), *cwd;
+    size_t capacity = (size_t)namespace->maxDepth * 24 + 2;
+    char *path = malloc(capacity);
+    HISTOGRAM *latency = malloc(2 * sizeof(HISTOGRAM));
+    if (root == NULL || path == NULL || latency == NULL) {
+        fprintf(stderr, "Error: memory allocation failed!\n");
+        exit(1);
+    }
+    long count = namespace->count;
+    uint64_t start, end, elapsed[2];
+
+    // build: mkdir and creat every node by absolute path, parents first
+    memset(latency, 0, 2 * sizeof(HISTOGRAM));
+    memset(elapsed, 0, sizeof(elapsed));
+    for (long i = 0; i < count; i++) {
+        char *nodePath = pathOf(namespace, i, path, capacity);
+        int isFile = namespace->type[i] == 'F';
+        start = statsNow();
+        if (isFile) creat(root, nodePath);
+        else mkdir(root, nodePath);
+        end = statsNow();
+        histogramRecord(&latency[isFile], end - start);
+        elapsed[isFile] += end - start;
+    }
+    if (latency[0].count > 0) report(shape, count, "mkdir", &latency[0], latency[0].count, elapsed[0]);
+    if (latency[1].count > 0) report(shape, count, "creat", &latency[1], latency[1].count, elapsed[1]);
+    double buildSeconds = (elapsed[0] + elapsed[1]) / 1e9;
+
+    // memory once the tree is built
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(results, "{\"shape\":\"%s\",\"nodes\":%ld,\"op\":\"memory\",\"rss_kb\":%ld,\"peak_rss_kb\":%ld}\n",
+        shape, count, currentRss(), usage.ru_maxrss);
+
+    // cd into random directories
+    memset(latency, 0, sizeof(HISTOGRAM));
+    elapsed[0] = 0;
+    for (long i = 0; i < BENCHCDS && namespace->dirCount > 0; i++) {
+        char *nodePath = pathOf(namespace, namespace->dirs[nextRandom() % namespace->dirCount], path, capacity);
+        cwd = root;
+        start = statsNow();
+        cd(&cwd, nodePath);
+        end = statsNow();
+        histogramRecord(latency, end - start);
+        elapsed[0] += end - start;
+    }
+    if (latency->count > 0) report(shape, count, "cd", latency, latency->count, elapsed[0]);
+
+    // ls random directories (the listings go to stdout, which is /dev/null)
+    memset(latency, 0, sizeof(HISTOGRAM));
+    elapsed[0] = 0;
+    for (long i = 0; i < BENCHLISTINGS && namespace->dirCount > 0; i++) {
+        cwd = root;
+        cd(&cwd, pathOf(namespace, namespace->dirs[nextRandom() % namespace->dirCount], path, capacity));
+        start = statsNow();
+        ls(cwd, NULL);
+        end = statsNow();
+        histogramRecord(latency, end - start);
+        elapsed[0] += end - start;
+    }
+    if (latency->count > 0) report(shape, count, "ls", latency, latency->count, elapsed[0]);
+
+    // save, then reload into an empty tree
+    char fileName[] = BENCHSAVEFILE;
+    memset(latency, 0, sizeof(HISTOGRAM));
+    start = statsNow();
+    save(root, fileName);
+    end = statsNow();
+    histogramRecord(latency, end - start);
+    report(shape, count, "save", latency, count, end - start);
+
+    NODE *loaded = newRootNode();
+    if (loaded == NULL) {
+        fprintf(stderr, "Error: memory allocation failed!\n");
+        exit(1);
+    }
+    memset(latency, 0, sizeof(HISTOGRAM));
+    start = statsNow();
+    reload(loaded, fileName);
+    end = statsNow();
+    histogramRecord(latency, end - start);
+    report(shape, count, "reload", latency, count, end - start);
+    if (loaded->dirs + loaded->files != count) fprintf(stderr, "%s %ld: reload loaded %ld nodes!\n", shape, count, loaded->dirs + loaded->files);
+    freeFileTree(loaded->child);
+    freeNode(loaded);
+    remove(fileName);
+
+    // rm and rmdir every node by absolute path, children first
+    memset(latency, 0, 2 * sizeof(HISTOGRAM));
+    memset(elapsed, 0, sizeof(elapsed));
+    for (long i = count - 1; i >= 0; i--) {
+        char *nodePath = pathOf(namespace, i, path, capacity);
+        int isFile = namespace->type[i] == 'F';
+        start = statsNow();
+        if (isFile) rm(root, nodePath);
+        else rmdir(root, nodePath);
+        end = statsNow();
+        histogramRecord(&latency[isFile], end - start);
+        elapsed[isFile] += end - start;
+    }
+    if (latency[0].count > 0) report(shape, count, "rmdir", &latency[0], latency[0].count, elapsed[0]);
+    if (latency[1].count > 0) report(shape, count, "rm", &latency[1], latency[1].count, elapsed[1]);
+    if (root->child != NULL) fprintf(stderr, "%s %ld: rm left nodes behind!\n", shape, count);
+
+    freeFileTree(root->child);
+    freeNode(root);
+    free(path);
+    free(latency);
+    return buildSeconds;
+}
+
+
+/*
+    benchmark [-n maxnodes] [-s shape] [-o file]
+    Benchmark every shape (or just shape) at 10^3, 10^4, ... up to maxnodes nodes (default
+    BENCHMAXNODES), writing JSON lines to file (default stdout). Command output is discarded.
+    A shape whose build takes longer than BENCHBUDGET seconds skips its larger sizes (the wide
+    shape is quadratic - that is the limit it exists to show).
+*/
+int main(int argc, char *argv[]) {
+    long maxNodes = BENCHMAXNODES;
+    char *onlyShape = NULL, *outputName = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) maxNodes = atol(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) onlyShape = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) outputName = argv[++i];
+        else {
+            fprintf(stderr, "Usage: %s [-n maxnodes] [-s wide|deep|balanced|skewed] [-o file]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // results go to the file or stdout, and the commands' own output (ls listings) to /dev/null
+    results = outputName ? fopen(outputName, "w") : stdout;
+    FILE *devNull = fopen("/dev/null", "w");
+    if (results == NULL || devNull == NULL) {
+        fprintf(stderr, "Failed to open file: %s\n", results == NULL ? outputName : "/dev/null");
+        return 1;
+    }
+    stdout = devNull;
+
+    // every shape at every size, smallest first
+    int skip[sizeof(shapes) / sizeof(shapes[0])] = {0};
+    for (long count = BENCHMINNODES; count <= maxNodes; count *= 10) {
+        for (int shape = 0; shapes[shape]; shape++) {
+            if (onlyShape != NULL && strcmp(onlyShape, shapes[shape]) != 0) continue;
+            if (skip[shape]) continue;
+
+            NAMESPACE namespace;
+            if (generate(&namespace, shapes[shape], count) != 0) {
+                fprintf(stderr, "Error: memory allocation failed!\n");
+                return 1;
+            }
+            double seconds = benchNamespace(shapes[shape], &namespace);
+            freeNamespace(&namespace);
+            fprintf(stderr, "%s %ld nodes: built in %.3f s\n", shapes[shape], count, seconds);
+            if (seconds > BENCHBUDGET) {
+                fprintf(stderr, "%s: skipping larger sizes (build over %.0f s)\n", shapes[shape], BENCHBUDGET);
+                skip[shape] = 1;
+            }
+        }
+    }
+
+    if (results != devNull && outputName != NULL) fclose(results);
+    return 0;
+}
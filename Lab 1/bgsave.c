@@ -0,0 +1,90 @@
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bgsave.h"
+#include "snapshot.h"
+
+// the running background save (bgsavePid == 0 if none)
+static pid_t bgsavePid = 0;
+static char *bgsaveFileName = NULL;
+
+
+// collects a finished background save and reports how it went (never blocks unless wait is set)
+static void reapBgsave(int wait) {
+    int status;
+    if (bgsavePid == 0 || waitpid(bgsavePid, &status, wait ? 0 : WNOHANG) != bgsavePid) return;
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        printf("Background save done: %s\n", bgsaveFileName);
+    }
+    else {
+        printf("Background save failed: %s\n", bgsaveFileName);
+    }
+
+    bgsavePid = 0;
+    free(bgsaveFileName);
+    bgsaveFileName = NULL;
+}
+
+
+/*
+    bgsave [-b] [filename]
+    Save the current filesystem tree in the file filename without blocking the command loop.
+    A forked child writes its copy-on-write image of the tree while the parent keeps taking
+    commands. With -b the file is a binary snapshot (like bsave) instead of the save format.
+    The result is reported once the child has finished.
+*/
+void bgsave(NODE *root, char *args) {
+    int binary = 0;
+
+    // one background save at a time
+    reapBgsave(0);
+    if (bgsavePid != 0) {
+        printf("Background save already in progress: %s\n", bgsaveFileName);
+        return;
+    }
+
+    // parse the optional -b flag
+    char *fileName = args;
+    if (fileName != NULL && strncmp(fileName, "-b", 2) == 0 && (fileName[2] == ' ' || fileName[2] == 0)) {
+        binary = 1;
+        fileName += 2;
+        while (*fileName == ' ') fileName++;
+        if (*fileName == 0) fileName = NULL;
+    }
+
+    // if no file name was passed as an arg - give default file name
+    if (fileName == NULL) fileName = binary ? "ffsim-curdi.bin" : "ffsim-curdi.txt";
+
+    // the child would repeat anything still sitting in the parent's stdout buffer
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // child: write the file and exit without running the parent's exit handlers
+        int status = binary ? writeSnapshot(root, fileName, 0) : writeFileTree(root, fileName);
+        fflush(stdout);
+        _exit(status == 0 ? 0 : 1);
+    }
+    if (pid < 0) {
+        // fork failed - save in the foreground instead
+        printf("Background save unavailable, saving in the foreground\n");
+        if (binary) writeSnapshot(root, fileName, 0);
+        else writeFileTree(root, fileName);
+        return;
+    }
+
+    // parent: remember the child and carry on
+    bgsavePid = pid;
+    bgsaveFileName = strdup(fileName);
+    printf("Background save started: %s\n", fileName);
+}
+
+// called by the command loop between commands: reports a finished background save
+void bgsaveIdle() {
+    reapBgsave(0);
+}
+
+// blocks until a running background save has finished (and reports it)
+void bgsaveWait() {
+    reapBgsave(1);
+}
@@ -0,0 +1,14 @@
+#ifndef __BGSAVE_H__
+#define __BGSAVE_H__
+
+#include "node.h"
+
+// main command function
+void bgsave(NODE *root, char *args);
+
+// called by the command loop between commands: reports a finished background save
+void bgsaveIdle();
+// blocks until a running background save has finished (and reports it)
+void bgsaveWait();
+
+#endif /* __BGSAVE_H__ */
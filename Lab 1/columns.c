@@ -0,0 +1,406 @@
+#include <time.h>
+#include "columns.h"
+#include "lazy.h"
+
+static NODE *storeRoot = NULL;      // the tree the columns are for (NULL while they are off)
+static int built = 0;               // 0 until the next scan if the tree changed since the build
+static long rowCount = 0, rowCapacity = 0;
+static uint32_t maxDepth = 0;
+
+// the columns (row 0 is root)
+static NODE **rowNode = NULL;       // the node of each row
+static uint32_t *rowParent = NULL;  // row of the parent (0 for root)
+static uint32_t *rowEnd = NULL;     // row after the subtree
+static uint32_t *rowDepth = NULL;   // 0 for root
+static uint32_t *rowHash = NULL;    // FNV-1a of the name
+static uint32_t *rowName = NULL;    // offset of the name in names
+static char *rowType = NULL;
+static char *names = NULL;          // the names, null terminated
+static size_t nameBytes = 0, nameCapacity = 0;
+
+
+// the hash of a name in the name hash column
+static uint32_t hashName(char *name) {
+    uint32_t hash = COLUMNSHASHBASIS;
+    for (unsigned char *c = (unsigned char*)name; *c != 0; c++) hash = (hash ^ *c) * COLUMNSHASHPRIME;
+    return hash;
+}
+
+// reallocs *array to count elements of size bytes. returns 0 on success (*array is kept if not)
+static int resize(void **array, size_t count, size_t size) {
+    void *newArray = realloc(*array, count * size);
+    if (newArray == NULL) return -1;
+    *array = newArray;
+    return 0;
+}
+
+// grows every column to capacity rows. returns 0 on success
+static int growRows(long capacity) {
+    if (resize((void**)&rowNode, capacity, sizeof(NODE*)) < 0 || resize((void**)&rowParent, capacity, sizeof(uint32_t)) < 0
+            || resize((void**)&rowEnd, capacity, sizeof(uint32_t)) < 0 || resize((void**)&rowDepth, capacity, sizeof(uint32_t)) < 0
+            || resize((void**)&rowHash, capacity, sizeof(uint32_t)) < 0 || resize((void**)&rowName, capacity, sizeof(uint32_t)) < 0
+            || resize((void**)&rowType, capacity, 1) < 0) {
+        return -1;
+    }
+    rowCapacity = capacity;
+    return 0;
+}
+
+static void freeColumns() {
+    free(rowNode);
+    free(rowParent);
+    free(rowEnd);
+    free(rowDepth);
+    free(rowHash);
+    free(rowName);
+    free(rowType);
+    free(names);
+    rowNode = NULL;
+    rowParent = rowEnd = rowDepth = rowHash = rowName = NULL;
+    rowType = names = NULL;
+    rowCount = rowCapacity = 0;
+    nameBytes = nameCapacity = 0;
+    storeRoot = NULL;
+    built = 0;
+}
+
+// appends a row for node. returns its row, or -1 if allocation failed
+static long addRow(NODE *node, uint32_t parent, uint32_t depth) {
+    size_t length = strlen(node->name);
+    if (rowCount == rowCapacity && growRows(rowCapacity ? 2 * rowCapacity : 1024) < 0) return -1;
+    if (nameBytes + length + 1 > nameCapacity) {
+        size_t newCapacity = nameCapacity ? 2 * nameCapacity : 64 * 1024;
+        if (resize((void**)&names, newCapacity, 1) < 0) return -1;
+        nameCapacity = newCapacity;
+    }
+    if (rowCount == UINT32_MAX || nameBytes + length + 1 > UINT32_MAX) return -1;
+
+    long row = rowCount++;
+    rowNode[row] = node;
+    rowParent[row] = parent;
+    rowEnd[row] = row + 1; // (a directory's end is set when the walk climbs out of it)
+    rowDepth[row] = depth;
+    rowHash[row] = hashName(node->name);
+    rowName[row] = nameBytes;
+    rowType[row] = node->type;
+    memcpy(names + nameBytes, node->name, length + 1);
+    nameBytes += length + 1;
+    if (depth > maxDepth) maxDepth = depth;
+    return row;
+}
+
+// rebuilds the columns from the tree with one DFS walk. returns 0 on success
+static int buildColumns() {
+    // (reading the rest of a lazily loaded snapshot is up to the caller)
+    if (lazyNodes() > 0) return -1;
+
+    // the aggregates say how many rows there will be
+    long total = 1 + storeRoot->dirs + storeRoot->files;
+    if (total > rowCapacity && growRows(total) < 0) return -1;
+    rowCount = 0;
+    nameBytes = 0;
+    maxDepth = 0;
+    if (addRow(storeRoot, 0, 0) < 0) return -1;
+
+    long parentRow = 0;
+    NODE *pCur = storeRoot->child;
+    while (pCur != NULL) {
+        long row = addRow(pCur, parentRow, rowDepth[parentRow] + 1);
+        if (row < 0) return -1;
+
+        // go to child
+        if (pCur->child != NULL) {
+            parentRow = row;
+            pCur = pCur->child;
+            continue;
+        }
+
+        // climb until we find a node with a sibling left to visit - each directory climbed out
+        // of ends here
+        while (pCur->sibling == NULL && pCur->parent != storeRoot) {
+            pCur = pCur->parent;
+            rowEnd[parentRow] = rowCount;
+            parentRow = rowParent[parentRow];
+        }
+
+        // shift
+        pCur = pCur->sibling;
+    }
+    rowEnd[0] = rowCount;
+    return 0;
+}
+
+// the row of start, with the columns rebuilt first if the tree changed. returns -1 if the
+// columns are off or can't be built, or start isn't in the live tree
+static long startRow(NODE *start) {
+    if (storeRoot == NULL) return -1;
+
+    // the path from root down to start
+    long depth = 0;
+    NODE *top = start;
+    while (top->parent != top) {
+        top = top->parent;
+        depth++;
+    }
+    if (top != storeRoot) return -1;
+
+    if (!__atomic_load_n(&built, __ATOMIC_RELAXED)) {
+        if (buildColumns() < 0) return -1;
+        __atomic_store_n(&built, 1, __ATOMIC_RELAXED);
+    }
+    if (depth == 0) return 0;
+
+    // walk down the rows: the first child of row is row + 1, and the next sibling of a row is its end
+    NODE **path = malloc(depth * sizeof(NODE*));
+    if (path == NULL) return -1;
+    NODE *pCur = start;
+    for (long i = depth - 1; i >= 0; i--, pCur = pCur->parent) path[i] = pCur;
+    long row = 0;
+    for (long i = 0; i < depth && row >= 0; i++) {
+        long child = row + 1;
+        while (child < rowEnd[row] && rowNode[child] != path[i]) child = rowEnd[child];
+        row = child < rowEnd[row] ? child : -1;
+    }
+    free(path);
+    return row;
+}
+
+// the rows in [first, last) named name (with hash hash), in order - a block of COLUMNSBLOCK
+// hashes is compared without branching, and only a block with a hit is looked at row by row
+// calls found for each, and returns how many there were
+static long scanHashes(long first, long last, uint32_t hash, char *name, void (*found)(long row)) {
+    long matches = 0;
+    long row = first;
+    for (; row + COLUMNSBLOCK <= last; row += COLUMNSBLOCK) {
+        int hit = 0;
+        for (int i = 0; i < COLUMNSBLOCK; i++) hit |= rowHash[row + i] == hash;
+        if (!hit) continue;
+        for (int i = 0; i < COLUMNSBLOCK; i++) {
+            if (rowHash[row + i] == hash && strcmp(names + rowName[row + i], name) == 0) {
+                if (found) found(row + i);
+                matches++;
+            }
+        }
+    }
+    for (; row < last; row++) {
+        if (rowHash[row] == hash && strcmp(names + rowName[row], name) == 0) {
+            if (found) found(row);
+            matches++;
+        }
+    }
+    return matches;
+}
+
+// the directories in rows [first, last) (a branch-free sum over the type column)
+static long countDirs(long first, long last) {
+    long dirs = 0;
+    long row = first;
+    for (; row + COLUMNSBLOCK <= last; row += COLUMNSBLOCK) {
+        int blockDirs = 0;
+        for (int i = 0; i < COLUMNSBLOCK; i++) blockDirs += rowType[row + i] == 'D';
+        dirs += blockDirs;
+    }
+    for (; row < last; row++) dirs += rowType[row] == 'D';
+    return dirs;
+}
+
+static void printRowPath(long row) {
+    writeAbsolutePath(stdout, rowNode[row]);
+}
+
+
+// helper for find. prints the path of every node below start named pattern, if pattern is a
+// plain name (no *, ?, [ or \). returns 0 if it can't
+int columnsFind(NODE *start, char *pattern) {
+    if (storeRoot == NULL || pattern == NULL || strpbrk(pattern, "*?[\\") != NULL) return 0;
+    long first = startRow(start);
+    if (first < 0) return 0;
+    scanHashes(first + 1, rowEnd[first], hashName(pattern), pattern, printRowPath);
+    return 1;
+}
+
+// helper for tree. prints start's path, everything below it indented by depth, and the counts
+// returns 0 if it can't
+int columnsTree(NODE *start) {
+    long first = startRow(start);
+    if (first < 0) return 0;
+
+    // collect the lines in a buffer and write them in bulk (like ls)
+    char *buffer = malloc(LSBUFFERSIZE);
+    if (buffer == NULL) return 0;
+    size_t used = 0;
+    writeAbsolutePath(stdout, start);
+    for (long row = first + 1; row < rowEnd[first]; row++) {
+        char *name = names + rowName[row];
+        size_t indent = 2 * (rowDepth[row] - rowDepth[first]);
+        size_t length = indent + strlen(name) + 3;
+        if (used + length > LSBUFFERSIZE) {
+            fwrite(buffer, 1, used, stdout);
+            used = 0;
+        }
+        if (length > LSBUFFERSIZE) {
+            printf("%*s%c %s\n", (int)indent, "", rowType[row], name); // (only in a very deep tree)
+            continue;
+        }
+        memset(buffer + used, ' ', indent);
+        used += indent;
+        buffer[used++] = rowType[row];
+        buffer[used++] = ' ';
+        memcpy(buffer + used, name, length - indent - 3);
+        used += length - indent - 3;
+        buffer[used++] = '\n';
+    }
+    fwrite(buffer, 1, used, stdout);
+    free(buffer);
+
+    long dirs = countDirs(first + 1, rowEnd[first]);
+    printf("%ld directories, %ld files\n", dirs, rowEnd[first] - first - 1 - dirs);
+    return 1;
+}
+
+// helper for saveFileTree(). writes root's tree in the save format, in the same order. returns
+// the bytes written, or -1 if it can't
+// the path of each row's parent is a prefix of the path buffer, ending at the length recorded
+// for the parent's depth, so each line is one memcpy onto it
+long long columnsSave(NODE *root, FILE *outfile) {
+    if (root != storeRoot || startRow(root) < 0) return -1;
+    size_t *lengths = malloc((maxDepth + 1) * sizeof(size_t));
+    size_t pathCapacity = MAXLINELENGTH;
+    char *path = malloc(pathCapacity);
+    if (lengths == NULL || path == NULL) {
+        free(lengths);
+        free(path);
+        return -1;
+    }
+
+    fprintf(outfile, "%c /\n", rowType[0]);
+    long long bytes = 4;
+    lengths[0] = 0;
+    for (long row = 1; row < rowCount; row++) {
+        char *name = names + rowName[row];
+        size_t nameLength = strlen(name);
+        uint32_t depth = rowDepth[row];
+        size_t nodeLength = lengths[depth - 1] + 1 + nameLength;
+        if (nodeLength + 1 > pathCapacity) {
+            while (nodeLength + 1 > pathCapacity) pathCapacity *= 2;
+            char *newPath = realloc(path, pathCapacity);
+            if (newPath == NULL) {
+                // (some of the file is written already - report it like saveFileTree does)
+                printf("Error: memory allocation failed!\n");
+                break;
+            }
+            path = newPath;
+        }
+        path[lengths[depth - 1]] = '/';
+        memcpy(path + lengths[depth - 1] + 1, name, nameLength);
+        lengths[depth] = nodeLength;
+
+        putc(rowType[row], outfile);
+        putc(' ', outfile);
+        fwrite(path, 1, nodeLength, outfile);
+        putc('\n', outfile);
+        bytes += nodeLength + 3;
+    }
+    free(lengths);
+    free(path);
+    return bytes;
+}
+
+// call after any change to the links or names of the tree (safe to call from any thread)
+// only the first change after a build writes the flag, so sessions don't fight over its cache line
+void columnsInvalidate() {
+    if (__atomic_load_n(&built, __ATOMIC_RELAXED)) __atomic_store_n(&built, 0, __ATOMIC_RELAXED);
+}
+
+
+static double elapsedSeconds(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// times a scan of the whole tree for the directories and the nodes called name, walking the
+// NODEs and through the columns, and checks that both agree
+static void benchScan(NODE *root, char *name) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ok = startRow(root) == 0;
+    double build = elapsedSeconds(&start);
+    if (!ok) {
+        printf("Error: memory allocation failed!\n");
+        return;
+    }
+    if (name == NULL) name = names + rowName[rowCount / 2];
+
+    // walking
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long walkDirs = 0, walkMatches = 0;
+    NODE *pCur = root->child;
+    while (pCur != NULL) {
+        walkDirs += pCur->type == 'D';
+        walkMatches += strcmp(pCur->name, name) == 0;
+        if (pCur->child != NULL) {
+            pCur = pCur->child;
+            continue;
+        }
+        while (pCur->sibling == NULL && pCur->parent != root) pCur = pCur->parent;
+        pCur = pCur->sibling;
+    }
+    double walking = elapsedSeconds(&start);
+
+    // through the columns
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long dirs = countDirs(1, rowCount);
+    long matches = scanHashes(1, rowCount, hashName(name), name, NULL);
+    double scanning = elapsedSeconds(&start);
+
+    long nodes = rowCount - 1;
+    printf("%ld nodes, %ld directories, %ld named %s: %.2f ns each walking, %.2f ns each through the columns (built in %.1f ms)\n",
+        nodes, dirs, matches, name, nodes ? walking * 1e9 / nodes : 0.0, nodes ? scanning * 1e9 / nodes : 0.0, build * 1e3);
+    if (dirs != walkDirs || matches != walkMatches) printf("The columns disagree with the tree!\n");
+}
+
+
+/*
+    columns [on | off | bench [name]]
+    on keeps a struct-of-arrays copy of the tree that find -name with a plain name, tree and save
+    scan instead of walking the nodes. it is rebuilt by the first scan after a change. off frees it.
+    bench times a scan of the whole tree for directories and nodes called name (a name from the
+    middle of the tree by default), walking the nodes and through the columns.
+    with no argument, prints whether it is on.
+*/
+void columns(NODE *root, char *args) {
+    char *command = args ? strtok(args, " ") : NULL;
+    char *arg = command ? strtok(NULL, " ") : NULL;
+
+    if (command == NULL) {
+        if (storeRoot == NULL) printf("Columns off\n");
+        else if (!built) printf("Columns on: rebuilt by the next scan\n");
+        else printf("Columns on: %ld rows, %zu KiB\n", rowCount,
+            (rowCapacity * (sizeof(NODE*) + 5 * sizeof(uint32_t) + 1) + nameCapacity) / 1024);
+        return;
+    }
+
+    if (strcmp(command, "on") == 0) {
+        if (storeRoot != root) freeColumns();
+        storeRoot = root;
+        return;
+    }
+
+    if (strcmp(command, "off") == 0) {
+        freeColumns();
+        return;
+    }
+
+    if (strcmp(command, "bench") == 0) {
+        // the columns are only kept after the benchmark if they are on
+        int wasOn = (storeRoot != NULL);
+        lazyExpandAll(root);
+        storeRoot = root;
+        benchScan(root, arg);
+        if (!wasOn) freeColumns();
+        return;
+    }
+
+    printf("Usage: columns [on | off | bench [name]]\n");
+}
@@ -0,0 +1,35 @@
+#ifndef __COLUMNS_H__
+#define __COLUMNS_H__
+
+#include "node.h"
+
+// an optional struct-of-arrays copy of the live tree for the scans that touch every node
+// (find -name with a plain name, tree, save). each node is a row, and each field they read is
+// its own dense array: type, name hash, parent, subtree end, depth and name offset. rows are in
+// DFS pre-order, so a subtree is the rows from its root up to end[row] - walking it is a loop
+// over an index that reads only the columns it needs (1 byte of type and 4 of name hash per node
+// instead of a 160-byte NODE). the hash and type loops go over their arrays COLUMNSBLOCK rows at
+// a time with no branches inside a block, so an optimizing compiler turns them into vector
+// compares
+// the copy is not kept up to date: any change to the tree drops it (columnsInvalidate, from
+// updateAggregates and the bulk loaders), and the next scan rebuilds it with one walk of the
+// tree. so it pays off for read-mostly workloads, where many scans share one build
+#define COLUMNSBLOCK 16
+#define COLUMNSHASHBASIS 2166136261u   // FNV-1a (32 bit)
+#define COLUMNSHASHPRIME 16777619u
+
+
+// main command function. runs "columns [on | off | bench [name]]"
+void columns(NODE *root, char *args);
+
+// call after any change to the links or names of the tree (safe to call from any thread)
+void columnsInvalidate();
+// helpers for find, tree and save. each does the whole scan through the columns and returns 1,
+// or returns 0 without printing anything if it can't (columns off, a pattern that isn't a plain
+// name, a tree that isn't the live one) - the caller walks the tree instead
+int columnsFind(NODE *start, char *pattern);
+int columnsTree(NODE *start);
+// returns the bytes written, or -1 if it can't
+long long columnsSave(NODE *root, FILE *outfile);
+
+#endif /* __COLUMNS_H__ */
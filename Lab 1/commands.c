@@ -1,4 +1,16 @@
 #include "commands.h"
+#include "journal.h"
+#include "bgsave.h"
+#include "parallel.h"
+#include "merkle.h"
+#include "cow.h"
+#include "dirindex.h"
+#include "compact.h"
+#include "pathindex.h"
+#include "stats.h"
+#include "lazy.h"
+#include "columns.h"
+#include "trigram.h"
 
 
 /*
@@ -52,6 +64,15 @@ void cd(NODE **cwd, char *pathName) {
         return;
     }
 
+    // a path (absolute, or more than one name) - resolve it like any other command
+    if (strchr(pathName, '/') != NULL) {
+        NODE *node = findNode(*cwd, pathName);
+        if (node == NULL) printf("No such directory: %s\n", pathName);
+        else if (node->type == 'F') printf("%s is a file, not a directory.\n", pathName);
+        else *cwd = node;
+        return;
+    }
+
     // if the user wants to go back a level - go to parent of cwd
     if (strcmp(pathName, "..") == 0) {
         *cwd = (*cwd)->parent;
@@ -59,6 +80,7 @@ void cd(NODE **cwd, char *pathName) {
     }
 
     // go to child of cwd
+    lazyExpand(*cwd);
     NODE *pCur = (*cwd)->child; // we need to dereference the double pointer to access the value
     // iterate to correct sibling
     while (pCur != NULL) {
@@ -81,22 +103,98 @@ void cd(NODE **cwd, char *pathName) {
     printf("No such directory: %s\n", pathName);
 }
 
+// adds "type name\n" for node to the ls output buffer, writing the buffer out first if it is full
+static void listNode(char *buffer, size_t *used, NODE *node) {
+    size_t length = strlen(node->name);
+    if (*used + length + 3 > LSBUFFERSIZE) {
+        fwrite(buffer, 1, *used, stdout);
+        *used = 0;
+    }
+    buffer[(*used)++] = node->type;
+    buffer[(*used)++] = ' ';
+    memcpy(buffer + *used, node->name, length);
+    *used += length;
+    buffer[(*used)++] = '\n';
+}
+
 /*
-    ls [pathname]
+    ls [pathname] [--after name] [--limit N]
     List the directory contents of pathname or CWD (if pathname not specified).
     Display an error message (No such file or directory: pathname) for an invalid pathname.
+    With --after or --limit the contents are listed in name order, a page at a time: --limit N
+    lists at most N entries, and --after name starts after name (the last one on the previous page).
+    Pages come from the directory's sorted index (see dirindex.h), so each costs O(log n + N).
 */
-void ls(NODE *cwd) {
-    // go to child of cwd
-    NODE* pCur = cwd->child;
+void ls(NODE *cwd, char *args) {
+    char *pathName = NULL, *after = NULL, *limitText = NULL;
+    int sorted = 0;
+
+    // parse the arguments
+    char *word = args ? strtok(args, " ") : NULL;
+    while (word != NULL) {
+        if (strcmp(word, "--after") == 0 || strcmp(word, "--limit") == 0) {
+            char *value = strtok(NULL, " ");
+            if (value == NULL) {
+                printf("Too few arguments!\n");
+                return;
+            }
+            if (strcmp(word, "--after") == 0) after = value;
+            else limitText = value;
+            sorted = 1;
+        }
+        else pathName = word;
+        word = strtok(NULL, " ");
+    }
+    long limit = -1; // no limit
+    if (limitText != NULL) {
+        char *end;
+        limit = strtol(limitText, &end, 10);
+        if (*end != 0 || limit < 0) {
+            printf("Invalid limit: %s\n", limitText);
+            return;
+        }
+    }
 
-    // traverse each sibling
-    while (pCur != NULL) {
-        printf("%c %s\n", pCur->type, pCur->name);
-        pCur = pCur->sibling;
+    NODE *dir = cwd;
+    if (pathName != NULL) {
+        dir = findNode(cwd, pathName);
+        if (dir == NULL) {
+            printf("No such file or directory: %s\n", pathName);
+            return;
+        }
+    }
+    if (dir->type != 'D') {
+        printf("%c %s\n", dir->type, dir->name);
+        return;
+    }
+    lazyExpand(dir);
+
+    // collect the lines in a buffer and write them in bulk, instead of a printf per entry
+    char *buffer = malloc(LSBUFFERSIZE);
+    if (buffer == NULL) {
+        printf("Error: memory allocation failed!\n");
+        return;
+    }
+    size_t used = 0;
+
+    if (!sorted) {
+        // the children as they are linked
+        for (NODE *pCur = dir->child; pCur != NULL; pCur = pCur->sibling) listNode(buffer, &used, pCur);
+    }
+    else {
+        // a page of the sorted index
+        NAMEINDEX *index = dirIndex(dir);
+        if (index == NULL && dir->child != NULL) {
+            printf("Error: memory allocation failed!\n");
+            free(buffer);
+            return;
+        }
+        INDEXENTRY *entry = index ? indexAfter(index, after) : NULL;
+        for (; entry != NULL && limit != 0; entry = entry->next[0], limit--) listNode(buffer, &used, entry->node);
     }
 
-    // when pCur == NULL - there are no more siblings to print
+    fwrite(buffer, 1, used, stdout);
+    free(buffer);
 }
 
 /*
@@ -104,14 +202,8 @@ void ls(NODE *cwd) {
     Print the (absolute) pathname of CWD.
 */
 void pwd(NODE *cwd) {
-    // allocate space for a char *
-    char *absolutePath = (char*)malloc(MAXLINELENGTH);
-
-    // compute the absolute path (recieve the value as an output parameter)
-    getAbsolutePathRecursive(cwd, absolutePath);
-
-    // print the absolute path
-    printf("%s\n", absolutePath);
+    // print the absolute path (built up the parent links, so any depth fits)
+    writeAbsolutePath(stdout, cwd);
 }
 
 /*
@@ -131,11 +223,12 @@ void creat(NODE *cwd, char *pathName) {
 }
 
 /*
-    rm pathname
+    rm [-r] pathname
     Remove the FILE node specified by pathname.
     Display an error message (File pathname does not exist!) if there no such file exists.
     Display an error message (Cannot remove pathname (not a FILE)!) if pathname is not a
     FILE.
+    With -r, remove pathname and everything under it, file or directory (see removeTree).
 */
 void rm(NODE *cwd, char *pathName) {
     // if user didn't enter a pathname
@@ -144,51 +237,130 @@ void rm(NODE *cwd, char *pathName) {
         return;
     }
 
+    // recursive remove
+    if (strncmp(pathName, "-r", 2) == 0 && (pathName[2] == ' ' || pathName[2] == 0)) {
+        pathName += 2;
+        while (*pathName == ' ') pathName++;
+        if (*pathName == 0) printf("Too few arguments!\n");
+        else removeTree(cwd, pathName);
+        return;
+    }
+
     // call remove file with type directory
     removeFile(cwd, pathName, 'F');
 }
 
 /*
-    save filename
-    Save the current filesystem tree in the file filename.
+    mv source destination
+    Move the file or directory source (and everything under it) to destination: into it if it is
+    a directory, otherwise to that path (which renames it). The node is relinked, not copied, so a
+    move costs the same for any subtree size.
+    Display an error message (No such file or directory: source) if source doesn't exist.
 */
-void save(NODE *root, char* fileName) {
-    // if no file name was passed as an arg - give default file name
-    if (fileName == NULL) {
-        char *defaultFileName = "ffsim-curdi.txt";
-        fileName = malloc(strlen(defaultFileName) + 1);
-        strcpy(fileName, defaultFileName);
+void mv(NODE *cwd, char *args) {
+    // parse source and destination
+    char *source = args ? strtok(args, " ") : NULL;
+    char *destination = source ? strtok(NULL, " ") : NULL;
+    if (destination == NULL) {
+        printf("Too few arguments!\n");
+        return;
     }
 
-    // open a file stream
-    FILE *outfile = fopen(fileName, "w+");
+    moveFile(cwd, source, destination);
+}
 
-    // check for file open failure
-    if (outfile == NULL) {
-        printf("Failed to open file: %s\n", fileName);
+/*
+    du [pathname]
+    Print the number of directories and files below pathname (or CWD) and their total size.
+    Display an error message (No such file or directory: pathname) for an invalid pathname.
+    Reads the aggregates kept in the node, so it takes the same time for any subtree.
+*/
+void du(NODE *cwd, char *pathName) {
+    NODE *node = pathName ? findNode(cwd, pathName) : cwd;
+    if (node == NULL) {
+        printf("No such file or directory: %s\n", pathName);
+        return;
+    }
+    printf("%ld directories, %ld files, %llu bytes\n", node->dirs, node->files, node->size);
+}
+
+/*
+    truncate size pathname
+    Set the logical size of the FILE node specified by pathname (in bytes).
+    Display an error message (File pathname does not exist!) if there no such file exists.
+    Display an error message (pathname is not a file.) if pathname is not a FILE.
+    Sizes live in memory only - the save formats and the journal don't carry them.
+*/
+// (named truncateFile so it can't clash with truncate() in <unistd.h>)
+void truncateFile(NODE *cwd, char *args) {
+    // parse the size and the pathname
+    char *end;
+    long long size = args ? strtoll(args, &end, 10) : 0;
+    if (args == NULL || end == args || *end != ' ' || size < 0) {
+        printf("Usage: truncate size pathname\n");
+        return;
+    }
+    while (*end == ' ') end++;
+
+    NODE *file = findNode(cwd, end);
+    if (file == NULL) {
+        printf("File %s does not exist!\n", end);
+        return;
+    }
+    if (file->type != 'F') {
+        printf("%s is not a file.\n", end);
         return;
     }
 
-    // call helper to recursively traverse the tree and save all node data
-    saveFileTreeRecursive(root, outfile);
+    // the difference goes to every directory above it
+    updateAggregates(file->parent, 0, 0, size - (long long)file->size);
+    file->size = size;
+}
 
-    // close the file
-    fclose(outfile);
+/*
+    save [-i] filename
+    Save the current filesystem tree in the file filename.
+    With -i the save is incremental: subtrees that haven't changed since the last save -i to
+    the same file are copied from it instead of written out again (see merkle.h).
+*/
+void save(NODE *root, char* fileName) {
+    int incremental = 0;
+
+    // parse the optional -i flag
+    if (fileName != NULL && strncmp(fileName, "-i", 2) == 0 && (fileName[2] == ' ' || fileName[2] == 0)) {
+        incremental = 1;
+        fileName += 2;
+        while (*fileName == ' ') fileName++;
+        if (*fileName == 0) fileName = NULL;
+    }
+
+    // if no file name was passed as an arg - give default file name
+    if (fileName == NULL) fileName = "ffsim-curdi.txt";
+
+    // write the file (errors are printed by the helper)
+    if (incremental) saveIncremental(root, fileName);
+    else writeFileTree(root, fileName);
 }
 
 /*
-    reload filename
+    reload [-v] filename
     Re-initalize the filesystem tree from the file filename.
+    Lines are bulk loaded in the DFS order save() writes them. Duplicate checks are skipped when
+    loading into an empty tree; pass -v (or load into a non-empty tree) to validate every line.
 */
 void reload(NODE *root, char *fileName) {
-	char fileLine[MAXLINELENGTH];
+    int validate = 0;
+
+    // parse the optional -v flag
+    if (fileName != NULL && strncmp(fileName, "-v", 2) == 0 && (fileName[2] == ' ' || fileName[2] == 0)) {
+        validate = 1;
+        fileName += 2;
+        while (*fileName == ' ') fileName++;
+        if (*fileName == 0) fileName = NULL;
+    }
 
     // if no file name was passed as an arg - give default file name
-    if (fileName == NULL) {
-        char *defaultFileName = "ffsim-curdi.txt";
-        fileName = malloc(strlen(defaultFileName) + 1);
-        strcpy(fileName, defaultFileName);
-    }
+    if (fileName == NULL) fileName = "ffsim-curdi.txt";
 
     // open a file stream
     FILE *infile = fopen(fileName, "r");
@@ -199,31 +371,26 @@ void reload(NODE *root, char *fileName) {
         return;
     }
 
-    // burn the first line
-    fgets(fileLine, sizeof(fileLine), infile);
+    // read through a large buffer (if the allocation fails stdio keeps its default buffer)
+    char *inBuffer = (char*)malloc(SAVEBUFFERSIZE);
+    if (inBuffer != NULL) setvbuf(infile, inBuffer, _IOFBF, SAVEBUFFERSIZE);
 
-    // load in the file tree
-    while (fgets(fileLine, sizeof(fileLine), infile)) { // current line exists
-        // fileLine now holds the current line
-        // parse type and path ("D /path/to/file\n")
-        char *type = strtok(fileLine, " ");
-        char *path = strtok(NULL, "\n");
+    // nodes already in the tree could collide with the file, so only an empty tree is trusted
+    if (root->child != NULL) validate = 1;
 
-        // if type directory
-        if (strcmp(type, "D") == 0) {
-            // call mkdir
-            mkdir(root, path);
-        }
+    // load in the file tree
+    uint64_t start = statsNow();
+    loadFileTree(root, infile, validate);
+    uint64_t loaded = statsNow();
+    statsPhase(PHASERELOADLOAD, loaded - start);
 
-        // if type file
-        else if (strcmp(type, "F") == 0) {
-            // call creat
-            creat(root, path);
-        }
-    }
+    // the bulk load bypasses the journal, so checkpoint the result instead
+    journalCheckpoint(root, 1);
+    statsPhase(PHASERELOADCHECKPOINT, statsNow() - loaded);
 
-    // close the file
+    // close the file, then release the buffer
     fclose(infile);
+    free(inBuffer);
 }
 
 /*
@@ -232,6 +399,9 @@ void reload(NODE *root, char *fileName) {
     “lastname” is your surname.
 */
 void quit(NODE *root) {
+    // let a background save finish, and flush the journal
+    bgsaveWait();
+    journalClose();
     // save
     save(root, "ffsim-curdi.txt");
     // exit the program
@@ -247,55 +417,245 @@ NODE *navigateToAbsolutePath(NODE *cwd, char **pathName) {
         and return a pointer to the new file's parent
     */
 
+    // with the path index on, the parent is a lookup of everything before the last '/'
+    char *lastSlash = strrchr(*pathName, '/');
+    NODE *parent;
+    if (lastSlash[1] != 0 && pathIndexLookup(cwd, *pathName, lastSlash == *pathName ? 1 : lastSlash - *pathName, &parent)) {
+        if (parent == NULL || parent->type != 'D') return NULL;
+        *pathName = lastSlash + 1;
+        return parent;
+    }
+
     // start at the root node
     while (cwd->parent != cwd) { // root points to itself, so we can check for that
         cwd = cwd->parent;
     }
 
-    // skip the first '/' in the pathname
-    if ((*pathName)[0] == '/') (*pathName)++;
-
-    // parse the entire path into individual nodes
-    char *nodes[20] = {NULL}; // initialize with null pointers
-    char *token = strtok(*pathName, "/"); // parse the initial node
-    int i = 0;
-    while (token != NULL && i < 20) {
-        nodes[i] = strdup(token); // duplicate the node into the nodes array
-        token = strtok(NULL, "/"); // get the next node in the path
-        i++;
-    }
-
-    // traverse each part of the path
-    i = 0;
-    while (nodes[i] != NULL && i < 19) {
-        // if were at the second last node in the path: return this node as the cwd. the new file will be inserted as a child of this dir
-        if (nodes[i + 1] == NULL) {
-            // update pathName
-            strcpy(*pathName, nodes[i]); // return the actual file name
+    // walk the path one component at a time (the path is split in place, so there is no depth limit)
+    char *name = *pathName;
+    while (1) {
+        // skip the '/' in front of the component
+        while (*name == '/') name++;
+
+        // find the end of the component, and the start of the next one
+        char *end = strchr(name, '/');
+        char *next = end;
+        while (next != NULL && *next == '/') next++;
+
+        // if this is the last component in the path: return this node as the cwd. the new file will be inserted as a child of this dir
+        if (end == NULL || *next == 0) {
+            if (end != NULL) *end = 0; // drop trailing slashes
+            // update pathName (return the actual file name)
+            *pathName = name;
             // return updated cwd
             return cwd;
         }
+        *end = 0;
 
         // go to child of cwd
+        lazyExpand(cwd);
         cwd = cwd->child;
 
         // search siblings for next node
+        long scanned = 0;
         while (cwd != NULL) {
+            scanned++;
             // if found and type D
-            if (strcmp(cwd->name, nodes[i]) == 0 && cwd->type == 'D') break;
+            if (strcmp(cwd->name, name) == 0 && cwd->type == 'D') break;
 
             // shift
             cwd = cwd->sibling;
         }
+        statsScan(scanned);
 
         // cwd now points to current node in path or null. if null - bail
         if (cwd == NULL) return cwd;
 
-        i++;
-    } 
+        name = next;
+    }
+}
+
+// finds the node at pathName: absolute, or relative to cwd, with "." and ".." allowed
+// returns NULL if there is no such node. pathName is not modified
+NODE *findNode(NODE *cwd, char *pathName) {
+    // absolute paths come from the path index when it is on, or start at the root
+    NODE *node;
+    if (pathName[0] == '/' && pathIndexLookup(cwd, pathName, strlen(pathName), &node)) return node;
+    if (pathName[0] == '/') {
+        while (cwd->parent != cwd) cwd = cwd->parent;
+    }
+
+    char *name = pathName;
+    while (cwd != NULL) {
+        // skip to the next component
+        while (*name == '/') name++;
+        if (*name == 0) return cwd;
+        size_t length = strcspn(name, "/");
+
+        if (length == 1 && name[0] == '.') {
+            // stay here
+        }
+        else if (length == 2 && name[0] == '.' && name[1] == '.') cwd = cwd->parent;
+        else if (cwd->type != 'D') return NULL;
+        else {
+            // search the children for the component
+            lazyExpand(cwd);
+            NODE *pCur = cwd->child;
+            long scanned = 0;
+            while (pCur != NULL && (strncmp(pCur->name, name, length) != 0 || pCur->name[length] != 0)) {
+                pCur = pCur->sibling;
+                scanned++;
+            }
+            statsScan(scanned + (pCur != NULL));
+            cwd = pCur;
+        }
+        name += length;
+    }
+    return NULL;
+}
+
+// allocates and initializes an unlinked node. returns NULL if allocation failed
+NODE *newNode(NODE *parent, char *name, char type) {
+    NODE *node = (NODE*)malloc(sizeof(NODE));
+    if (node == NULL) return NULL;
+
+    strcpy(node->name, name); // set the file name
+    node->type = type;
+    node->flags = NODEHASHSTALE; // nothing hashed yet
+    node->dirs = 0;
+    node->files = 0;
+    node->size = 0;
+    node->epoch = liveEpoch;
+    node->lazyEntry = 0;
+    node->nameId = 0;
+    node->history = NULL;
+    node->index = NULL;
+    node->pathHash = parent ? extendPathHash(parent->pathHash, name) : PATHHASHBASIS;
+    node->parent = parent;
+    node->sibling = NULL;
+    node->child = NULL;
+    statsCount(COUNTNODESCREATED, 1);
+    return node;
+}
+
+// frees a node (and its directory index) that is already unlinked
+void freeNode(NODE *node) {
+    statsCount(COUNTNODESFREED, 1);
+    lazyRelease(node);
+    indexFree(node);
+    if (!compactRelease(node)) free(node); // nodes in the compacted array are only counted off
+}
+
+// allocates an empty root directory (its own parent). returns NULL if allocation failed
+NODE *newRootNode() {
+    NODE *root = newNode(NULL, "/", 'D');
+    if (root != NULL) root->parent = root;
+    return root;
+}
+
+// adds a change below dir to the aggregates of dir and every directory above it, and marks their
+// hashes stale. parent links only change in mv, which never runs alongside sessions, so concurrent
+// sessions can share this with atomic adds and no locks
+void updateAggregates(NODE *dir, long dirs, long files, long long size) {
+    columnsInvalidate();
+    while (1) {
+        __atomic_fetch_or(&dir->flags, NODEHASHSTALE, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&dir->dirs, dirs, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&dir->files, files, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&dir->size, size, __ATOMIC_RELAXED);
+        // root points to itself
+        if (dir->parent == dir) return;
+        dir = dir->parent;
+    }
+}
+
+// recomputes the aggregates of every directory under root (after a bulk load)
+// one iterative DFS: a directory is zeroed on the way down and adds its totals to its parent
+// on the way back up
+void computeAggregates(NODE *root) {
+    columnsInvalidate();
+    root->dirs = root->files = 0;
+    root->size = 0;
+    root->flags |= NODEHASHSTALE;
+    NODE *pCur = root->child;
+    while (pCur != NULL) {
+        // (a directory still to be read from a snapshot keeps the totals it was given)
+        if (pCur->type == 'D' && !(pCur->flags & NODELAZY)) {
+            pCur->dirs = pCur->files = 0;
+            pCur->size = 0;
+            pCur->flags |= NODEHASHSTALE;
+            // go to child
+            if (pCur->child != NULL) {
+                pCur = pCur->child;
+                continue;
+            }
+        }
+
+        // pCur's subtree is done - add it to its parent, and to each directory climbed out of
+        while (1) {
+            NODE *parent = pCur->parent;
+            parent->dirs += pCur->dirs + (pCur->type == 'D');
+            parent->files += pCur->files + (pCur->type == 'F');
+            parent->size += pCur->size;
+            if (pCur->sibling != NULL || parent == root) break;
+            pCur = parent;
+        }
+        pCur = pCur->sibling;
+    }
+}
+
+// frees first, its siblings and all of their descendants
+// the child/sibling links form a binary tree - rotating each child up into the sibling chain
+// flattens it while freeing, so no recursion or stack is needed
+void freeFileTree(NODE *first) {
+    NODE *pCur = first;
+    while (pCur != NULL) {
+        if (pCur->child != NULL) {
+            // rotate: the first child takes pCur's place and pCur becomes its sibling
+            NODE *child = pCur->child;
+            pCur->child = child->sibling;
+            child->sibling = pCur;
+            pCur = child;
+        }
+        else {
+            // no children left - free and shift
+            NODE *next = pCur->sibling;
+            freeNode(pCur);
+            pCur = next;
+        }
+    }
+}
+
+// replaces the contents of root with the contents of newRoot, then frees newRoot
+void replaceFileTree(NODE *root, NODE *newRoot) {
+    // drop the old tree (keeping what snapshots still see)
+    NODE *next;
+    for (NODE *pCur = root->child; pCur != NULL; pCur = next) {
+        next = pCur->sibling;
+        releaseSubtree(pCur);
+    }
+
+    // move the new top level under root
+    columnsInvalidate();
+    indexFree(root);
+    preserveLinks(root);
+    root->child = newRoot->child;
+    for (NODE *pCur = root->child; pCur != NULL; pCur = pCur->sibling) pCur->parent = root;
+    root->dirs = newRoot->dirs;
+    root->files = newRoot->files;
+    root->size = newRoot->size;
+    root->flags |= NODEHASHSTALE;
+    free(newRoot);
+    pathIndexRebuild(root);
+    trigramRebuild(root);
+}
 
-    // return the updated cwd
-    return cwd;
+// returns the last child of a directory (NULL if it is empty)
+NODE *lastChildOf(NODE *dir) {
+    lazyExpand(dir);
+    NODE *pCur = dir->child;
+    while (pCur != NULL && pCur->sibling != NULL) pCur = pCur->sibling;
+    return pCur;
 }
 
 // helper for mkdir() and creat()
@@ -316,33 +676,42 @@ void createFile(NODE *cwd, char *fileName, char type) {
         }
     }
 
+    // names are stored inline in the node
+    if (strlen(fileName) >= sizeof(cwd->name)) {
+        printf("Name too long: %s\n", fileName);
+        return;
+    }
+
     NODE *pCur = cwd;
     NODE *newFile;
+    lazyExpand(cwd);
 
     // case: there are no files in the cwd - insert here
     if (pCur->child == NULL) {
-        // allocate space for new node
-        newFile = (NODE*)malloc(sizeof(NODE)); 
+        // allocate the new node
+        newFile = newNode(cwd, fileName, type);
         // if memory allocation failed - bail on the function
         if (newFile == NULL) {
             printf("Error: memory allocation failed!\n");
             return;
         }
         // link the new node to it's parent
+        preserveLinks(cwd);
         cwd->child = newFile;
-        newFile->parent = cwd;
     }
 
     // case: there are files in the cwd
     else {
         // go to cwd->child
         pCur = pCur->child;
+        long scanned = 1;
 
         // iterate through siblings
         while (pCur->sibling != NULL) {
 
             // if name already exists - print error
             if (strcmp(pCur->name, fileName) == 0) {
+                statsScan(scanned);
                 if (type == 'D') printf("DIR %s already exists!\n", fileName);
                 if (type == 'F') printf("File %s already exists!\n", fileName);
                 return;
@@ -350,7 +719,9 @@ void createFile(NODE *cwd, char *fileName, char type) {
 
             // shift to next sibling
             pCur = pCur->sibling;
+            scanned++;
         }
+        statsScan(scanned);
 
         // check the last sibling manually
         if (strcmp(pCur->name, fileName) == 0) {
@@ -360,41 +731,59 @@ void createFile(NODE *cwd, char *fileName, char type) {
         }
 
         // pCur->sibling == NULL - so insert here
-        // allocate space for new node
-        newFile = (NODE*)malloc(sizeof(NODE)); 
+        // allocate the new node (parent of the n-th sibling will point to the actual parent (cwd))
+        newFile = newNode(cwd, fileName, type);
         // if memory allocation failed - bail on the function
         if (newFile == NULL) {
             printf("Error: memory allocation failed!\n");
             return;
         }
         // link the new node to it's sibling
+        preserveLinks(pCur);
         pCur->sibling = newFile;
-        newFile->parent = cwd; // lparent of the n-th sibling will point to the actual parent (cwd)
     }
+    indexInsert(cwd, newFile);
+    if (pathIndexCovers(cwd)) pathIndexAdd(newFile);
+    if (trigramCovers(cwd)) trigramAdd(newFile);
 
-    // regardless of which case executed above, update rest of new node
-    strcpy(newFile->name, fileName); // set the file name
-    newFile->type = type;
-    newFile->sibling = NULL;
-    newFile->child = NULL;
+    // count it in every directory above it
+    updateAggregates(cwd, type == 'D', type == 'F', 0);
+
+    // log the mutation
+    journalRecord(type, newFile);
 }
 
 // helper for rmdir() and rm()
 void removeFile(NODE *cwd, char *fileName, char type) {
     NODE *pPrev, *pCur;
 
+    // if path is absolute - get the parent of the file to remove (like createFile)
+    if (fileName[0] == '/') {
+        cwd = navigateToAbsolutePath(cwd, &fileName);
+
+        // if function returned null - path doesn't exist
+        if (cwd == NULL) {
+            printf("Path does not exist!\n");
+            return;
+        }
+    }
+
     // first, go to cwd->child
+    lazyExpand(cwd);
     pPrev = cwd;
     pCur = cwd->child;
+    long scanned = 0;
 
     // iterate through all siblings to find the file
     while (pCur != NULL) {
+        scanned++;
         // if found
         if (strcmp(pCur->name, fileName) == 0) {
+            statsScan(scanned);
             // error messages for type D 
             if (type == 'D') {
-                // if not empty
-                if (pCur->child != NULL) {
+                // if not empty (a directory not read from its snapshot yet has children)
+                if (pCur->child != NULL || (pCur->flags & NODELAZY)) {
                     printf("Cannot remove DIR %s (not empty)!\n", fileName);
                     return;
                 }
@@ -417,6 +806,9 @@ void removeFile(NODE *cwd, char *fileName, char type) {
 
             // remove the file (both types can be treated the same here)
             // modify links
+            if (pathIndexCovers(cwd)) pathIndexDelete(pCur);
+            if (trigramCovers(cwd)) trigramDelete(pCur);
+            preserveLinks(pPrev);
             if (pPrev == cwd) {
                 // if removing leftmost sibling in level
                 pPrev->child = pCur->sibling;
@@ -425,8 +817,15 @@ void removeFile(NODE *cwd, char *fileName, char type) {
                 // if not leftmost sibling
                 pPrev->sibling = pCur->sibling;
             }
-            // free memory
-            free(pCur);
+            indexRemove(cwd, pCur);
+            // uncount it (an empty directory or a file, so only itself)
+            updateAggregates(cwd, -(type == 'D'), -(type == 'F'), -(long long)pCur->size);
+
+            // log the mutation (before the node, which the path is built from, is freed)
+            journalRecord(type == 'D' ? 'd' : 'f', pCur);
+
+            // free memory (unless a snapshot still sees it)
+            releaseNode(pCur);
 
             // end of function
             return;
@@ -439,46 +838,429 @@ void removeFile(NODE *cwd, char *fileName, char type) {
 
     // pCur->sibling == NULL, so there are no more files to search through
     // fileName does not exist - print error message
+    statsScan(scanned);
     if (type == 'D') printf("DIR %s does not exist!\n", fileName);
     if (type == 'F') printf("File %s does not exist!\n", fileName);
 }
 
-// recursively builds a char * containing the absolute path to cwd. returns via output parameter
-void getAbsolutePathRecursive(NODE *cwd, char *absolutePath) {
-    // base case: cwd is head
-    if (cwd->parent == cwd) {
-        // add "/" to the path
-        strcpy(absolutePath, "/");
+// helper for mv() and journal replay. moves source to destination (into it if it is a directory)
+// only the two sibling chains change: the node is unlinked from its parent and appended to the new
+// one, the subtree's totals are moved between the two ancestor chains, and the indexes are told -
+// nothing under the node is visited (except by the path index when it is on, see pathindex.h)
+void moveFile(NODE *cwd, char *source, char *destination) {
+    // snapshots rely on parent links and names never changing (see cow.h)
+    if (snapshotsExist()) {
+        printf("Cannot mv while snapshots exist!\n");
+        return;
+    }
+
+    NODE *node = findNode(cwd, source);
+    if (node == NULL) {
+        printf("No such file or directory: %s\n", source);
+        return;
+    }
+    if (node->parent == node) {
+        printf("Cannot move /!\n");
+        return;
+    }
+
+    // the new parent and name: into destination if it is a directory, otherwise to its path
+    NODE *newParent = findNode(cwd, destination);
+    char *newName = node->name;
+    if (newParent != NULL && newParent->type != 'D') {
+        printf("File %s already exists!\n", destination);
+        return;
+    }
+    if (newParent == NULL) {
+        // split off the last name (trailing slashes dropped, like navigateToAbsolutePath)
+        size_t length = strlen(destination);
+        while (length > 1 && destination[length - 1] == '/') destination[--length] = 0;
+        char *lastSlash = strrchr(destination, '/');
+        newName = lastSlash ? lastSlash + 1 : destination;
+        if (lastSlash == NULL) newParent = cwd;
+        else if (lastSlash == destination) newParent = findNode(cwd, "/");
+        else {
+            *lastSlash = 0;
+            newParent = findNode(cwd, destination);
+            *lastSlash = '/';
+        }
+        if (newParent == NULL || newParent->type != 'D') {
+            printf("Path does not exist!\n");
+            return;
+        }
+        if (strlen(newName) >= sizeof(node->name)) {
+            printf("Name too long: %s\n", newName);
+            return;
+        }
+    }
+
+    // the name must be free in the new parent (moving a node onto itself does nothing)
+    lazyExpand(newParent);
+    for (NODE *pCur = newParent->child; pCur != NULL; pCur = pCur->sibling) {
+        if (strcmp(pCur->name, newName) == 0) {
+            if (pCur == node) return;
+            if (pCur->type == 'D') printf("DIR %s already exists!\n", newName);
+            if (pCur->type == 'F') printf("File %s already exists!\n", newName);
+            return;
+        }
+    }
+
+    // a directory can't go under itself
+    for (NODE *pCur = newParent; ; pCur = pCur->parent) {
+        if (pCur == node) {
+            printf("Cannot move %s into itself!\n", source);
+            return;
+        }
+        if (pCur->parent == pCur) break;
+    }
+
+    // log the mutation (before the move, while the node still has its old path)
+    journalMove(node, newParent, newName);
+
+    // unlink it
+    NODE *oldParent = node->parent;
+    if (pathIndexCovers(oldParent)) pathIndexDeleteSubtree(node);
+    NODE *pPrev = oldParent;
+    for (NODE *pCur = oldParent->child; pCur != node; pCur = pCur->sibling) pPrev = pCur;
+    preserveLinks(pPrev);
+    if (pPrev == oldParent) oldParent->child = node->sibling;
+    else pPrev->sibling = node->sibling;
+    node->sibling = NULL;
+    indexRemove(oldParent, node);
+
+    // its totals leave every directory above it
+    long dirs = node->dirs + (node->type == 'D'), files = node->files + (node->type == 'F');
+    long long size = node->size;
+    updateAggregates(oldParent, -dirs, -files, -size);
+
+    // rename it (a new name has new trigrams) and link it as the new parent's last child
+    int renamed = (newName != node->name);
+    if (renamed && trigramCovers(oldParent)) trigramDelete(node);
+    if (renamed) strcpy(node->name, newName);
+    node->parent = newParent;
+    NODE *last = lastChildOf(newParent);
+    preserveLinks(last ? last : newParent);
+    if (last == NULL) newParent->child = node;
+    else last->sibling = node;
+    indexInsert(newParent, node);
+    updateAggregates(newParent, dirs, files, size);
+    pathIndexMove(node);
+    if (renamed && trigramCovers(newParent)) trigramAdd(node);
+}
+
+// the length of node's absolute path (1 for root)
+size_t absolutePathLength(NODE *node) {
+    size_t length = 0;
+    for (NODE *pCur = node; pCur->parent != pCur; pCur = pCur->parent) length += strlen(pCur->name) + 1;
+    return length ? length : 1;
+}
+
+// writes node's absolute path into the absolutePathLength(node) bytes at path (no terminator),
+// built backwards from the parent links, so there is no recursion
+void buildAbsolutePath(NODE *node, char *path, size_t length) {
+    char *start = path + length;
+    for (NODE *pCur = node; pCur->parent != pCur; pCur = pCur->parent) {
+        size_t nameLength = strlen(pCur->name);
+        start -= nameLength;
+        memcpy(start, pCur->name, nameLength);
+        *--start = '/';
+    }
+    if (start != path) *path = '/'; // root
+}
+
+// writes the absolute path of node and a newline to out
+// (paths that don't fit on the stack are built on the heap, so any depth prints in full)
+void writeAbsolutePath(FILE *out, NODE *node) {
+    char stackPath[MAXLINELENGTH * 4];
+    size_t length = absolutePathLength(node);
+    char *path = (length + 1 <= sizeof(stackPath)) ? stackPath : malloc(length + 1);
+    if (path == NULL) {
+        fprintf(out, "Error: memory allocation failed!\n");
+        return;
+    }
+    buildAbsolutePath(node, path, length);
+    path[length] = '\n';
+    fwrite(path, 1, length + 1, out);
+    if (path != stackPath) free(path);
+}
+
+
+// helper for save() and bgsave. writes the tree to "<fileName>.tmp" and renames it over fileName,
+// so a failed or interrupted save never leaves a truncated file behind
+// returns 0 on success, -1 on failure (message printed)
+int writeFileTree(NODE *root, char *fileName) {
+    char *tempFileName = (char*)malloc(strlen(fileName) + 5);
+    if (tempFileName == NULL) {
+        printf("Error: memory allocation failed!\n");
+        return -1;
+    }
+    sprintf(tempFileName, "%s.tmp", fileName);
+
+    // open a file stream
+    FILE *outfile = fopen(tempFileName, "w+");
+
+    // check for file open failure
+    if (outfile == NULL) {
+        printf("Failed to open file: %s\n", tempFileName);
+        free(tempFileName);
+        return -1;
+    }
+
+    // give the stream a large buffer so lines are batched into a few big writes
+    // (if the allocation fails stdio just keeps its default buffer)
+    char *outBuffer = (char*)malloc(SAVEBUFFERSIZE);
+    if (outBuffer != NULL) setvbuf(outfile, outBuffer, _IOFBF, SAVEBUFFERSIZE);
+
+    // call helper to traverse the tree and save all node data
+    uint64_t start = statsNow();
+    saveFileTree(root, outfile);
+    uint64_t written = statsNow();
+    statsPhase(PHASESAVEWRITE, written - start);
+
+    // close the file (flushes the buffer), then release the buffer
+    // report a failed write (disk full, etc) instead of installing a truncated save
+    int status = 0;
+    if (ferror(outfile) | fclose(outfile)) {
+        printf("Failed to write file: %s\n", tempFileName);
+        status = -1;
+    }
+    else if (rename(tempFileName, fileName) != 0) {
+        printf("Failed to write file: %s\n", fileName);
+        status = -1;
+    }
+    if (status != 0) remove(tempFileName);
+    statsPhase(PHASESAVESYNC, statsNow() - written);
+    free(outBuffer);
+    free(tempFileName);
+    return status;
+}
+
+// helper for save(). traverses the file tree (DFS, pre-order) and saves all node data
+// the walk is iterative: it follows child links down and climbs back up through parent links,
+// so it needs no recursion or per-node allocations. a single path buffer holds the path of the
+// current node's parent - it is extended by one name when descending and truncated when climbing
+void saveFileTree(NODE *root, FILE *outfile) {
+    lazyExpandAll(root);
+
+    // with the column store on, the save is a scan of its arrays
+    long long columnBytes = columnsSave(root, outfile);
+    if (columnBytes >= 0) {
+        statsCount(COUNTBYTESSAVED, columnBytes);
         return;
     }
 
-    // build the path recursively: </path/to/parent> + </cwd>
-    // build path to parent
-    getAbsolutePathRecursive(cwd->parent, absolutePath);
+    // path buffer (grows with the depth of the tree, not the number of nodes)
+    size_t pathCapacity = MAXLINELENGTH;
+    char *path = (char*)malloc(pathCapacity);
+    if (path == NULL) {
+        printf("Error: memory allocation failed!\n");
+        return;
+    }
+    size_t pathLength = 0; // length of the path to pCur's parent ("" for root)
 
-    // append the cwd
-    // only add a / before the current dir if its parent is not root
-    if (strcmp(absolutePath, "/") != 0) {
-        strcat(absolutePath, "/");
+    // print the root node
+    fprintf(outfile, "%c /\n", root->type);
+    uint64_t bytes = 4;
+
+    NODE *pCur = root->child;
+    while (pCur != NULL) {
+        // extend the path with the current node's name ("<parent path>/<name>")
+        size_t nameLength = strlen(pCur->name);
+        size_t nodeLength = pathLength + 1 + nameLength;
+        if (nodeLength + 1 > pathCapacity) {
+            // grow the buffer
+            while (nodeLength + 1 > pathCapacity) pathCapacity *= 2;
+            char *newPath = (char*)realloc(path, pathCapacity);
+            if (newPath == NULL) {
+                printf("Error: memory allocation failed!\n");
+                free(path);
+                return;
+            }
+            path = newPath;
+        }
+        path[pathLength] = '/';
+        memcpy(path + pathLength + 1, pCur->name, nameLength);
+
+        // print the line to the file ("D /path/to/node\n")
+        putc(pCur->type, outfile);
+        putc(' ', outfile);
+        fwrite(path, 1, nodeLength, outfile);
+        putc('\n', outfile);
+        bytes += nodeLength + 3;
+
+        // descend into the subtree first - the node's path becomes the parent path
+        if (pCur->child != NULL) {
+            pathLength = nodeLength;
+            pCur = pCur->child;
+            continue;
+        }
+
+        // no subtree: climb until we find a node with a sibling left to visit
+        // every climb strips the parent's name off the path
+        while (pCur->sibling == NULL && pCur->parent != root) {
+            pCur = pCur->parent;
+            pathLength -= strlen(pCur->name) + 1;
+        }
+
+        // shift (NULL once the last child of root is done)
+        pCur = pCur->sibling;
     }
-    strcat(absolutePath, cwd->name);
+
+    statsCount(COUNTBYTESSAVED, bytes);
+    free(path);
 }
 
-// helper for save(). recursively traverses the file tree (DFS) and saves all node data
-void saveFileTreeRecursive(NODE *pCur, FILE *outfile) {
-    // base case: pCur is NULL node
-    if (pCur == NULL) return;
+// helper for reload(). bulk loads lines written by save() ("D /path/to/node\n")
+// save() writes the tree in DFS pre-order, so every node's parent is one of the directories on
+// the path to the previous node. those directories are kept on a stack together with their last
+// child, which lets each line be appended in O(1) without navigating from root.
+// with validate == 0 the input is trusted and duplicate names are not checked
+// lines that don't follow DFS order fall back to the regular createFile() path
+void loadFileTree(NODE *root, FILE *infile, int validate) {
+    // stack of open directories. the path of the top directory is held in dirPath
+    // (the paths of the lower entries are prefixes of it)
+    struct openDir {
+        NODE *dir;          // the directory
+        NODE *lastChild;    // its last child (where the next child is appended)
+        size_t pathLength;  // length of its path ("" for root)
+    } *stack;
+    int stackCapacity = 64;
+    int top = 0;
+    char *dirPath = NULL;
+    size_t dirPathCapacity = 0;
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t lineLength;
+    uint64_t bytes = 0;
+
+    stack = malloc(stackCapacity * sizeof(*stack));
+    if (stack == NULL) {
+        printf("Error: memory allocation failed!\n");
+        return;
+    }
+
+    // the root is always open at the bottom of the stack
+    stack[0].dir = root;
+    stack[0].lastChild = lastChildOf(root);
+    stack[0].pathLength = 0;
 
-    // print the current node
-    // get path
-    char *absolutePath = (char*)malloc(MAXLINELENGTH); // allocate space for a char *
-    getAbsolutePathRecursive(pCur, absolutePath); // compute the absolute path (recieve the value as an output parameter)
-    // print the line to the file
-    fprintf(outfile, "%c %s\n", pCur->type, absolutePath);
+    // load in the file tree
+    while ((lineLength = getline(&line, &lineCapacity, infile)) != -1) { // current line exists
+        bytes += lineLength;
+
+        // parse type and path ("D /path/to/file\n")
+        if (lineLength > 0 && line[lineLength - 1] == '\n') line[--lineLength] = 0;
+        if (lineLength < 3 || line[1] != ' ' || line[2] != '/') continue; // blank or malformed line
+        char type = line[0];
+        char *path = line + 2;
+        size_t pathLength = lineLength - 2;
+        if (type != 'D' && type != 'F') continue;
+
+        // the root line ("D /") is already loaded
+        if (pathLength == 1) continue;
+
+        // pop directories until the top one is a prefix of the path
+        while (top > 0 && (stack[top].pathLength >= pathLength || path[stack[top].pathLength] != '/'
+                || memcmp(path, dirPath, stack[top].pathLength) != 0)) {
+            top--;
+        }
+
+        // the rest of the path must be a single name, otherwise the parent is not open
+        // (out of order or hand edited input) - take the slow path from root
+        char *name = path + stack[top].pathLength + 1;
+        if (strchr(name, '/') != NULL) {
+            createFile(root, path, type);
+            // it may have appended to an open directory ("/a//x", "..") - move their last children on
+            for (int i = 0; i <= top; i++) {
+                if (stack[i].lastChild == NULL) stack[i].lastChild = stack[i].dir->child;
+                while (stack[i].lastChild != NULL && stack[i].lastChild->sibling != NULL) {
+                    stack[i].lastChild = stack[i].lastChild->sibling;
+                }
+            }
+            continue;
+        }
 
-    // print subtree
-    saveFileTreeRecursive(pCur->child, outfile);
+        // names are stored inline in the node
+        if (strlen(name) >= sizeof(root->name)) {
+            printf("Name too long: %s\n", name);
+            continue;
+        }
+
+        NODE *parent = stack[top].dir;
+        NODE *node = NULL;
+
+        // untrusted input: look for an existing node with the same name
+        if (validate) {
+            for (NODE *pCur = parent->child; pCur != NULL; pCur = pCur->sibling) {
+                if (strcmp(pCur->name, name) == 0) {
+                    node = pCur;
+                    break;
+                }
+            }
+            if (node != NULL) {
+                if (type == 'D') printf("DIR %s already exists!\n", name);
+                if (type == 'F') printf("File %s already exists!\n", name);
+                // an existing directory is still opened so its children in the file get merged into it
+                if (node->type != 'D' || type != 'D') continue;
+            }
+        }
 
-    // print sibling tree
-    saveFileTreeRecursive(pCur->sibling, outfile);
-}
\ No newline at end of file
+        // append the new node after the parent's last child
+        if (node == NULL) {
+            node = newNode(parent, name, type);
+            if (node == NULL) {
+                printf("Error: memory allocation failed!\n");
+                break;
+            }
+            NODE *linked = stack[top].lastChild ? stack[top].lastChild : parent;
+            preserveLinks(linked);
+            if (stack[top].lastChild == NULL) parent->child = node;
+            else stack[top].lastChild->sibling = node;
+            stack[top].lastChild = node;
+            indexInsert(parent, node);
+        }
+
+        // a directory is opened for the lines that follow
+        if (type == 'D') {
+            // grow the stack and the path buffer
+            if (top + 1 == stackCapacity) {
+                struct openDir *newStack = realloc(stack, 2 * stackCapacity * sizeof(*stack));
+                if (newStack == NULL) {
+                    printf("Error: memory allocation failed!\n");
+                    break;
+                }
+                stack = newStack;
+                stackCapacity *= 2;
+            }
+            if (pathLength + 1 > dirPathCapacity) {
+                size_t newCapacity = dirPathCapacity ? dirPathCapacity : MAXLINELENGTH;
+                while (pathLength + 1 > newCapacity) newCapacity *= 2;
+                char *newPath = realloc(dirPath, newCapacity);
+                if (newPath == NULL) {
+                    printf("Error: memory allocation failed!\n");
+                    break;
+                }
+                dirPath = newPath;
+                dirPathCapacity = newCapacity;
+            }
+
+            // the parent's path is already in the buffer - only the new name needs copying
+            memcpy(dirPath + stack[top].pathLength, path + stack[top].pathLength, pathLength - stack[top].pathLength);
+
+            top++;
+            stack[top].dir = node;
+            stack[top].lastChild = lastChildOf(node); // NULL unless the directory already existed
+            stack[top].pathLength = pathLength;
+        }
+    }
+
+    statsCount(COUNTBYTESLOADED, bytes);
+    free(line);
+    free(dirPath);
+    free(stack);
+
+    // the bulk appends skip the per-node aggregate updates - total them up in one pass
+    computeAggregates(root);
+    pathIndexRebuild(root);
+    trigramRebuild(root);
+}
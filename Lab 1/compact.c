@@ -0,0 +1,195 @@
+#include <time.h>
+#include "compact.h"
+#include "cow.h"
+#include "dirindex.h"
+#include "pathindex.h"
+#include "lazy.h"
+#include "columns.h"
+#include "trigram.h"
+
+// a compacted array
+typedef struct arena {
+    NODE *nodes;
+    long count;             // nodes in it
+    long live;              // of those, the ones not freed yet
+} ARENA;
+
+// every array with a node still alive, oldest first (the last holds the tree as of the last
+// compaction - an older one only outlives it if some of its nodes were kept outside the tree)
+static ARENA *arenas = NULL;
+static int arenaCount = 0, arenaCapacity = 0;
+static int autoCompact = 0;     // compact between commands
+
+
+static double elapsedSeconds(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// visits every node below root in DFS order (the traversal compaction speeds up, timed by
+// compact). returns how many there are
+static long countNodes(NODE *root, unsigned long long *checksum) {
+    long count = 0;
+    NODE *pCur = root->child;
+    while (pCur != NULL) {
+        count++;
+        *checksum += pCur->size + pCur->name[0];
+        // go to child
+        if (pCur->child != NULL) {
+            pCur = pCur->child;
+            continue;
+        }
+        // go to the next sibling, or climb until there is one
+        while (pCur->sibling == NULL && pCur->parent != root) pCur = pCur->parent;
+        pCur = pCur->sibling;
+    }
+    return count;
+}
+
+// frees the arrays whose nodes have all been freed
+static void freeEmptyArenas() {
+    int kept = 0;
+    for (int i = 0; i < arenaCount; i++) {
+        if (arenas[i].live == 0) free(arenas[i].nodes);
+        else arenas[kept++] = arenas[i];
+    }
+    arenaCount = kept;
+}
+
+// copies the count nodes below root into a new array in DFS order and frees the originals
+// *cwd is moved to its copy. returns -1 if allocation failed (the tree is left as it was)
+static int compactTree(NODE *root, NODE **cwd, long count) {
+    if (count == 0) return 0;
+    if (arenaCount == arenaCapacity) {
+        int newCapacity = arenaCapacity ? 2 * arenaCapacity : 4;
+        ARENA *newArenas = realloc(arenas, newCapacity * sizeof(ARENA));
+        if (newArenas == NULL) return -1;
+        arenas = newArenas;
+        arenaCapacity = newCapacity;
+    }
+    NODE *nodes = malloc(count * sizeof(NODE));
+    if (nodes == NULL) return -1;
+
+    // walk the old tree, appending a copy of each node to the array and linking it under the copy
+    // of its parent. the copies' parent links are already final, so climbing out of an old
+    // directory climbs out of its copy the same way
+    NODE *first = root->child;
+    NODE *newParent = root, *newPrev = NULL, *newCwd = *cwd;
+    NODE *pCur = first;
+    long slot = 0;
+    while (pCur != NULL) {
+        NODE *copy = &nodes[slot++];
+        *copy = *pCur;
+        copy->parent = newParent;
+        copy->child = NULL;
+        copy->sibling = NULL;
+        copy->index = NULL; // the index holds the old nodes - the next sorted ls builds a new one
+        if (newPrev == NULL) newParent->child = copy;
+        else newPrev->sibling = copy;
+        if (pCur == *cwd) newCwd = copy;
+
+        // go to child
+        if (pCur->child != NULL) {
+            newParent = copy;
+            newPrev = NULL;
+            pCur = pCur->child;
+            continue;
+        }
+
+        // go to the next sibling, or climb until there is one
+        newPrev = copy;
+        while (pCur->sibling == NULL && pCur->parent != root) {
+            pCur = pCur->parent;
+            newPrev = newParent;
+            newParent = newParent->parent;
+        }
+        pCur = pCur->sibling;
+    }
+    indexFree(root);
+    columnsInvalidate(); // the rows point at the old nodes
+
+    // free the old nodes, then every array that leaves empty (one with nodes still alive outside
+    // the tree stays, so freeNode keeps counting them off it)
+    freeFileTree(first);
+    freeEmptyArenas();
+    arenas[arenaCount].nodes = nodes;
+    arenas[arenaCount].count = arenas[arenaCount].live = slot;
+    arenaCount++;
+    *cwd = newCwd;
+    pathIndexRebuild(root);
+    trigramRebuild(root);
+    return 0;
+}
+
+
+/*
+    compact [on | off]
+    Copy the tree into one array in DFS order, so traversals walk memory in order, and report
+    how long a full traversal took before and after.
+    on compacts automatically between commands once enough of the tree has been created since
+    the last compaction, and off stops it.
+*/
+void compact(NODE *root, NODE **cwd, char *args) {
+    char *command = args ? strtok(args, " ") : NULL;
+    if (command != NULL) {
+        if (strcmp(command, "on") == 0) autoCompact = 1;
+        else if (strcmp(command, "off") == 0) autoCompact = 0;
+        else printf("Usage: compact [on | off]\n");
+        return;
+    }
+
+    // snapshot histories point at the nodes where they are
+    if (snapshotsExist()) {
+        printf("Cannot compact while snapshots exist!\n");
+        return;
+    }
+
+    // the array holds the whole tree
+    lazyExpandAll(root);
+
+    unsigned long long checksum = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long count = countNodes(root, &checksum);
+    double before = elapsedSeconds(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (compactTree(root, cwd, count) < 0) {
+        printf("Error: memory allocation failed!\n");
+        return;
+    }
+    double seconds = elapsedSeconds(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    countNodes(root, &checksum);
+    double after = elapsedSeconds(&start);
+
+    printf("Compacted %ld nodes in %.3f s (traversal %.1f ns/node before, %.1f ns/node after)\n", count, seconds,
+        count ? before * 1e9 / count : 0.0, count ? after * 1e9 / count : 0.0);
+}
+
+// called by the command loop between commands: compacts if compact is on and the tree has drifted
+void compactIdle(NODE *root, NODE **cwd) {
+    freeEmptyArenas();
+
+    // (a lazily loaded snapshot isn't read in just to compact it)
+    if (!autoCompact || snapshotsExist() || lazyNodes() > 0) return;
+    long total = root->dirs + root->files;
+    long outside = total - (arenaCount > 0 ? arenas[arenaCount - 1].live : 0);
+    if (outside < COMPACTMINNODES || 4 * outside < total) return;
+    unsigned long long checksum = 0;
+    compactTree(root, cwd, countNodes(root, &checksum));
+}
+
+// helper for freeNode(). counts off a node in a compacted array. returns 0 if node isn't in one
+// (called by the rm -r pool and sessions from any thread - the arrays only change between commands)
+int compactRelease(NODE *node) {
+    for (int i = arenaCount - 1; i >= 0; i--) {
+        ARENA *arena = &arenas[i];
+        if ((uintptr_t)node < (uintptr_t)arena->nodes || (uintptr_t)node >= (uintptr_t)(arena->nodes + arena->count)) continue;
+        __atomic_sub_fetch(&arena->live, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
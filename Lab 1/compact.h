@@ -0,0 +1,25 @@
+#ifndef __COMPACT_H__
+#define __COMPACT_H__
+
+#include "node.h"
+
+// nodes are malloced one at a time, so after enough creates and removes a directory's children
+// are scattered across the heap and every traversal misses the cache at each step. compaction
+// copies every node below root into one array in DFS order (a directory, then its subtree, then
+// its next sibling), relinks the copies and frees the originals. root itself never moves
+// nodes in an array are freed by counting them off (freeNode), and the array goes once all of
+// them have been (each array keeps its own count, so one outliving the next compaction is fine)
+// with compact on, the command loop compacts by itself between commands once at least
+// COMPACTMINNODES nodes and a quarter of the tree live outside the array
+#define COMPACTMINNODES 4096
+
+
+// main command function. runs "compact [on | off]"
+void compact(NODE *root, NODE **cwd, char *args);
+
+// called by the command loop between commands: compacts if compact is on and the tree has drifted
+void compactIdle(NODE *root, NODE **cwd);
+// helper for freeNode(). counts off a node in the compacted array. returns 0 if node isn't in it
+int compactRelease(NODE *node);
+
+#endif /* __COMPACT_H__ */
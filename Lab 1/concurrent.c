@@ -0,0 +1,523 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include "concurrent.h"
+#include "journal.h"
+#include "cow.h"
+#include "dirindex.h"
+#include "pathindex.h"
+#include "lazy.h"
+#include "trigram.h"
+
+// a seqlock guarding the directories that hash to it (on its own cache line)
+typedef struct stripe {
+    pthread_mutex_t writer;
+    atomic_uint sequence;   // odd while a writer is changing one of the stripe's directories
+} __attribute__((aligned(64))) STRIPE;
+
+static STRIPE stripes[LOCKSTRIPES];
+static pthread_once_t stripesOnce = PTHREAD_ONCE_INIT;
+
+// the journal is not thread safe - records go through this lock
+static pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+
+// nodes removed while sessions are open (freed when the last session closes)
+static pthread_mutex_t retiredLock = PTHREAD_MUTEX_INITIALIZER;
+static NODE **retired = NULL;
+static size_t retiredCount = 0, retiredCapacity = 0;
+static int openSessions = 0;
+
+
+static void initStripes() {
+    for (int i = 0; i < LOCKSTRIPES; i++) {
+        pthread_mutex_init(&stripes[i].writer, NULL);
+        atomic_init(&stripes[i].sequence, 0);
+    }
+}
+
+// the stripe guarding dir
+static STRIPE *stripeOf(NODE *dir) {
+    // multiplicative hash of the address (the low bits are always 0 for malloc'd nodes)
+    uintptr_t hash = ((uintptr_t)dir >> 4) * 0x9E3779B97F4A7C15ull;
+    return &stripes[(hash >> 32) & (LOCKSTRIPES - 1)];
+}
+
+// writer side: lock the stripe and mark it as changing
+static void writeLock(STRIPE *stripe) {
+    pthread_mutex_lock(&stripe->writer);
+    atomic_store_explicit(&stripe->sequence, atomic_load_explicit(&stripe->sequence, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void writeUnlock(STRIPE *stripe) {
+    atomic_store_explicit(&stripe->sequence, atomic_load_explicit(&stripe->sequence, memory_order_relaxed) + 1, memory_order_release);
+    pthread_mutex_unlock(&stripe->writer);
+}
+
+// write locks two stripes in table order (so two writers, or a writer and lockTree, can't deadlock)
+static void writeLockPair(STRIPE *first, STRIPE *second) {
+    if (first == second) {
+        writeLock(first);
+        return;
+    }
+    if (second < first) {
+        STRIPE *swap = first;
+        first = second;
+        second = swap;
+    }
+    writeLock(first);
+    writeLock(second);
+}
+
+static void writeUnlockPair(STRIPE *first, STRIPE *second) {
+    writeUnlock(first);
+    if (second != first) writeUnlock(second);
+}
+
+// reader side: wait out a writer and return the sequence to validate against
+static unsigned readBegin(STRIPE *stripe) {
+    unsigned sequence;
+    while ((sequence = atomic_load_explicit(&stripe->sequence, memory_order_acquire)) & 1) sched_yield();
+    return sequence;
+}
+
+// returns 1 if nothing changed in the stripe since readBegin
+static int readValidate(STRIPE *stripe, unsigned sequence) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&stripe->sequence, memory_order_relaxed) == sequence;
+}
+
+// the links a session reads: the live ones, or its snapshot's if it is pinned
+// (a writer saves the old links under the same stripe before changing them, so the seqlock
+// covers a pinned reader too. a directory's child and its sibling change under different
+// stripes, so saving its history is serialized by preserveLinks itself)
+static NODE *firstChild(SESSION *session, NODE *dir) {
+    return session->pinned ? childAt(dir, session->epoch) : dir->child;
+}
+
+static NODE *nextSibling(SESSION *session, NODE *node) {
+    return session->pinned ? siblingAt(node, session->epoch) : node->sibling;
+}
+
+// finds a child of dir by name without taking a lock. returns NULL if there is none
+static NODE *findChild(SESSION *session, NODE *dir, char *name) {
+    lazyExpand(dir);
+    STRIPE *stripe = stripeOf(dir);
+    while (1) {
+        unsigned sequence = readBegin(stripe);
+        NODE *pCur = firstChild(session, dir);
+        while (pCur != NULL && strcmp(pCur->name, name) != 0) pCur = nextSibling(session, pCur);
+        if (readValidate(stripe, sequence)) return pCur;
+    }
+}
+
+// resolves a path (absolute, or relative to the session's cwd). returns NULL if it doesn't exist
+// path is split in place. every component but the last has to be a directory
+static NODE *resolvePath(SESSION *session, char *path) {
+    NODE *node = (path[0] == '/') ? session->root : session->cwd;
+    char *save;
+    for (char *name = strtok_r(path, "/", &save); name != NULL; name = strtok_r(NULL, "/", &save)) {
+        if (node->type != 'D') return NULL;
+        if (strcmp(name, ".") == 0) continue;
+        if (strcmp(name, "..") == 0) node = node->parent;
+        else node = findChild(session, node, name);
+        if (node == NULL) return NULL;
+    }
+    return node;
+}
+
+// splits path into its parent directory and final name (path is modified, *name points into it)
+// returns the parent, or NULL if it doesn't exist or isn't a directory
+static NODE *resolveParent(SESSION *session, char *path, char **name) {
+    // strip trailing slashes
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') path[--length] = 0;
+
+    char *slash = strrchr(path, '/');
+    NODE *parent;
+    if (slash == NULL) {
+        // a plain name lives in the cwd
+        *name = path;
+        parent = session->cwd;
+    }
+    else {
+        *name = slash + 1;
+        if (slash == path) parent = session->root; // "/name"
+        else {
+            *slash = 0;
+            parent = resolvePath(session, path);
+        }
+    }
+    if (parent == NULL || parent->type != 'D') return NULL;
+    return parent;
+}
+
+// logs a mutation. called before the change becomes visible, so dependent changes made by other
+// sessions can't be logged ahead of it
+static void recordMutation(char op, NODE *node) {
+    pthread_mutex_lock(&journalLock);
+    journalRecord(op, node);
+    pthread_mutex_unlock(&journalLock);
+}
+
+// keeps a removed node alive until no session can be looking at it
+static void retireNode(NODE *node) {
+    pthread_mutex_lock(&retiredLock);
+    if (retiredCount == retiredCapacity) {
+        size_t newCapacity = retiredCapacity ? 2 * retiredCapacity : 1024;
+        NODE **newRetired = realloc(retired, newCapacity * sizeof(NODE*));
+        if (newRetired == NULL) {
+            // can't track it - leaking one node beats freeing it under a reader
+            pthread_mutex_unlock(&retiredLock);
+            return;
+        }
+        retired = newRetired;
+        retiredCapacity = newCapacity;
+    }
+    retired[retiredCount++] = node;
+    pthread_mutex_unlock(&retiredLock);
+}
+
+// mkdir/creat in a session
+static void sessionCreate(SESSION *session, char *path, char type) {
+    char *name;
+    NODE *parent = resolveParent(session, path, &name);
+    if (parent == NULL) {
+        fprintf(session->out, "Path does not exist!\n");
+        return;
+    }
+    if (name[0] == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        fprintf(session->out, "Invalid name: %s\n", name);
+        return;
+    }
+    if (strlen(name) >= sizeof(parent->name)) {
+        fprintf(session->out, "Name too long: %s\n", name);
+        return;
+    }
+
+    // set the node up before taking the lock
+    NODE *newFile = newNode(parent, name, type);
+    if (newFile == NULL) {
+        fprintf(session->out, "Error: memory allocation failed!\n");
+        return;
+    }
+
+    lazyExpand(parent);
+    STRIPE *stripe = stripeOf(parent);
+    writeLock(stripe);
+
+    // the parent may have been removed since it was resolved
+    // (and a session may have pinned a snapshot since the node was made - it mustn't see it)
+    newFile->epoch = liveEpoch;
+    if (parent->flags & NODEREMOVED) {
+        writeUnlock(stripe);
+        freeNode(newFile);
+        fprintf(session->out, "Path does not exist!\n");
+        return;
+    }
+
+    // scan for duplicates, remembering the last child
+    NODE *last = NULL;
+    for (NODE *pCur = parent->child; pCur != NULL; pCur = pCur->sibling) {
+        if (strcmp(pCur->name, name) == 0) {
+            writeUnlock(stripe);
+            freeNode(newFile);
+            if (type == 'D') fprintf(session->out, "DIR %s already exists!\n", name);
+            if (type == 'F') fprintf(session->out, "File %s already exists!\n", name);
+            return;
+        }
+        last = pCur;
+    }
+
+    // log it, then publish the fully built node
+    recordMutation(type, newFile);
+    preserveLinks(last ? last : parent);
+    atomic_thread_fence(memory_order_release);
+    if (last == NULL) parent->child = newFile;
+    else last->sibling = newFile;
+    indexInsert(parent, newFile);
+    pathIndexAdd(newFile);
+    trigramAdd(newFile);
+
+    writeUnlock(stripe);
+
+    // count it above (atomic adds up the parent chain, no locks)
+    updateAggregates(parent, type == 'D', type == 'F', 0);
+}
+
+// rmdir/rm in a session
+static void sessionRemove(SESSION *session, char *path, char type) {
+    char *name;
+    NODE *parent = resolveParent(session, path, &name);
+    STRIPE *parentStripe = parent ? stripeOf(parent) : NULL;
+
+    while (1) {
+        // find the target without a lock first - removing a directory locks its stripe too
+        NODE *target = parent ? findChild(session, parent, name) : NULL;
+        if (target == NULL) {
+            if (type == 'D') fprintf(session->out, "DIR %s does not exist!\n", name);
+            if (type == 'F') fprintf(session->out, "File %s does not exist!\n", name);
+            return;
+        }
+        STRIPE *targetStripe = stripeOf(target);
+        writeLockPair(parentStripe, targetStripe);
+
+        // find it again (and the node linking to it) now that the list can't change
+        NODE *pPrev = NULL, *pCur;
+        for (pCur = parent->child; pCur != NULL && pCur != target; pCur = pCur->sibling) pPrev = pCur;
+        if (pCur == NULL) {
+            // removed or replaced in between - start over
+            writeUnlockPair(parentStripe, targetStripe);
+            continue;
+        }
+
+        // error messages (same as removeFile)
+        if (type == 'D' && target->type == 'D' && (target->child != NULL || (target->flags & NODELAZY))) {
+            writeUnlockPair(parentStripe, targetStripe);
+            fprintf(session->out, "Cannot remove DIR %s (not empty)!\n", name);
+            return;
+        }
+        if (type != target->type) {
+            writeUnlockPair(parentStripe, targetStripe);
+            if (type == 'D') fprintf(session->out, "Cannot remove %s (not a directory)!\n", name);
+            if (type == 'F') fprintf(session->out, "Cannot remove %s (not a file)!\n", name);
+            return;
+        }
+
+        // log it, unlink it, and mark it so creates racing into it fail
+        // (its sibling link stays intact for readers that are standing on it)
+        recordMutation(type == 'D' ? 'd' : 'f', target);
+        pathIndexDelete(target);
+        trigramDelete(target);
+        preserveLinks(pPrev ? pPrev : parent);
+        if (pPrev == NULL) parent->child = target->sibling;
+        else pPrev->sibling = target->sibling;
+        indexRemove(parent, target);
+        target->flags |= NODEREMOVED;
+
+        writeUnlockPair(parentStripe, targetStripe);
+        updateAggregates(parent, -(type == 'D'), -(type == 'F'), -(long long)target->size);
+        retireNode(target);
+        return;
+    }
+}
+
+// ls [pathname] in a session. the listing is collected first and only printed once it is known
+// to be consistent, so a retry never prints twice
+static void sessionLs(SESSION *session, char *path) {
+    NODE *dir = path ? resolvePath(session, path) : session->cwd;
+    if (dir == NULL) {
+        fprintf(session->out, "No such file or directory: %s\n", path);
+        return;
+    }
+    if (dir->type != 'D') {
+        fprintf(session->out, "%s is a file, not a directory.\n", path);
+        return;
+    }
+
+    char *listing = NULL;
+    size_t listingSize = 0;
+    FILE *listingStream = open_memstream(&listing, &listingSize);
+    if (listingStream == NULL) {
+        fprintf(session->out, "Error: memory allocation failed!\n");
+        return;
+    }
+    lazyExpand(dir);
+    STRIPE *stripe = stripeOf(dir);
+    while (1) {
+        unsigned sequence = readBegin(stripe);
+        rewind(listingStream);
+        for (NODE *pCur = firstChild(session, dir); pCur != NULL; pCur = nextSibling(session, pCur)) {
+            fprintf(listingStream, "%c %s\n", pCur->type, pCur->name);
+        }
+        fflush(listingStream);
+        if (readValidate(stripe, sequence)) break;
+    }
+    fwrite(listing, 1, ftell(listingStream), session->out);
+    fclose(listingStream);
+    free(listing);
+}
+
+// pwd in a session (parent links never change, so no lock is needed)
+static void sessionPwd(SESSION *session) {
+    // measure, then build the path backwards
+    size_t length = 0;
+    for (NODE *pCur = session->cwd; pCur->parent != pCur; pCur = pCur->parent) length += strlen(pCur->name) + 1;
+    char *path = malloc(length + 2);
+    if (path == NULL) {
+        fprintf(session->out, "Error: memory allocation failed!\n");
+        return;
+    }
+    char *start = path + length;
+    *start = 0;
+    for (NODE *pCur = session->cwd; pCur->parent != pCur; pCur = pCur->parent) {
+        size_t nameLength = strlen(pCur->name);
+        start -= nameLength;
+        memcpy(start, pCur->name, nameLength);
+        *--start = '/';
+    }
+    if (length == 0) strcpy(path, "/");
+    fprintf(session->out, "%s\n", path);
+    free(path);
+}
+
+
+// pin: start reading the tree as it is now (again, if already pinned)
+static void sessionPin(SESSION *session) {
+    // no directory may change while the new epoch starts, or a change could be missed by both
+    // the snapshot and its history
+    lockTree();
+    uint32_t epoch;
+    int status = snapshotPin(session->root, &epoch);
+    if (status == 0 && session->pinned) snapshotUnpin(session->epoch);
+    unlockTree();
+    if (status != 0) return;
+    session->epoch = epoch;
+    session->pinned = 1;
+    if (session->cwd->flags & NODEREMOVED) session->cwd = session->root;
+}
+
+// unpin: give the snapshot back and go back to the live tree (the cwd may have been removed from
+// it in the meantime). what only this pin could see is freed once every session has closed,
+// since other pinned sessions may be walking old links right now
+static void sessionUnpin(SESSION *session) {
+    if (!session->pinned) return;
+    lockTree();
+    snapshotUnpin(session->epoch);
+    unlockTree();
+    session->pinned = 0;
+    if (session->cwd->flags & NODEREMOVED) session->cwd = session->root;
+}
+
+// stats in a session: its own command latencies
+static void sessionStats(SESSION *session) {
+    HISTOGRAM *latency = &session->latency;
+    fprintf(session->out, "%lu commands, p50 %lu ns, p99 %lu ns, max %lu ns%s\n", (unsigned long)latency->count,
+        (unsigned long)histogramPercentile(latency, 0.5), (unsigned long)histogramPercentile(latency, 0.99),
+        (unsigned long)latency->max, session->pinned ? " (pinned)" : "");
+}
+
+
+// opens a session on the tree at root, with its cwd at root and its output going to sink
+// returns NULL if allocation failed
+SESSION *sessionOpen(NODE *root, FILE *sink) {
+    pthread_once(&stripesOnce, initStripes);
+
+    SESSION *session = calloc(1, sizeof(SESSION));
+    if (session == NULL) return NULL;
+    session->out = open_memstream(&session->outBuffer, &session->outSize);
+    if (session->out == NULL) {
+        free(session);
+        return NULL;
+    }
+    session->root = root;
+    session->cwd = root;
+    session->sink = sink;
+
+    pthread_mutex_lock(&retiredLock);
+    openSessions++;
+    pthread_mutex_unlock(&retiredLock);
+    return session;
+}
+
+// flushes the session's output, gives back its pin and closes it. the last session to close frees
+// the nodes removed while sessions were open, and what released snapshots and pins kept
+void sessionClose(SESSION *session) {
+    sessionUnpin(session);
+    sessionFlush(session);
+    fclose(session->out);
+    free(session->outBuffer);
+
+    pthread_mutex_lock(&retiredLock);
+    if (--openSessions == 0) {
+        for (size_t i = 0; i < retiredCount; i++) releaseNode(retired[i]);
+        retiredCount = 0;
+        snapshotCollect();
+    }
+    pthread_mutex_unlock(&retiredLock);
+    free(session);
+}
+
+// runs one parsed command in the session
+static void runCommand(SESSION *session, char *command, char *arg) {
+    int mutation = strcmp(command, "mkdir") == 0 || strcmp(command, "creat") == 0
+        || strcmp(command, "rmdir") == 0 || strcmp(command, "rm") == 0;
+
+    // commands that take a path
+    if (arg == NULL && mutation) {
+        fprintf(session->out, "Too few arguments!\n");
+        return;
+    }
+    // a pinned session only reads its snapshot (du and save read the live tree - see cow.h)
+    if (session->pinned && (mutation || strcmp(command, "du") == 0 || strcmp(command, "save") == 0)) {
+        fprintf(session->out, "Read-only session (pinned)!\n");
+        return;
+    }
+    if (strcmp(command, "mkdir") == 0) sessionCreate(session, arg, 'D');
+    else if (strcmp(command, "creat") == 0) sessionCreate(session, arg, 'F');
+    else if (strcmp(command, "rmdir") == 0) sessionRemove(session, arg, 'D');
+    else if (strcmp(command, "rm") == 0) sessionRemove(session, arg, 'F');
+    else if (strcmp(command, "ls") == 0) sessionLs(session, arg);
+    else if (strcmp(command, "pwd") == 0) sessionPwd(session);
+    else if (strcmp(command, "du") == 0) {
+        // the aggregates are only ever changed by atomic adds
+        NODE *node = arg ? resolvePath(session, arg) : session->cwd;
+        if (node == NULL) fprintf(session->out, "No such file or directory: %s\n", arg);
+        else fprintf(session->out, "%ld directories, %ld files, %llu bytes\n", __atomic_load_n(&node->dirs, __ATOMIC_RELAXED),
+            __atomic_load_n(&node->files, __ATOMIC_RELAXED), __atomic_load_n(&node->size, __ATOMIC_RELAXED));
+    }
+    else if (strcmp(command, "cd") == 0) {
+        // cd with no pathname goes to root
+        NODE *dir = arg ? resolvePath(session, arg) : session->root;
+        if (dir == NULL) fprintf(session->out, "No such directory: %s\n", arg);
+        else if (dir->type != 'D') fprintf(session->out, "%s is a file, not a directory.\n", arg);
+        else session->cwd = dir;
+    }
+    else if (strcmp(command, "save") == 0) {
+        // whole-tree read: hold every stripe so the file is a consistent cut
+        lockTree();
+        writeFileTree(session->root, arg ? arg : "ffsim-curdi.txt");
+        unlockTree();
+    }
+    else if (strcmp(command, "pin") == 0) sessionPin(session);
+    else if (strcmp(command, "unpin") == 0) sessionUnpin(session);
+    else if (strcmp(command, "stats") == 0) sessionStats(session);
+    else fprintf(session->out, "Command not found!\n");
+}
+
+// parses one command line ("command arg") and runs it in the session. safe to call from many threads
+// lookups (cd, ls, pwd, path resolution) take no locks, and mutations lock only the parent
+// directory's stripe (plus the target's for rmdir/rm)
+// output collects in the session's buffer, which is flushed once it passes SESSIONFLUSHSIZE
+void sessionRun(SESSION *session, char *line) {
+    char *save;
+    char *command = strtok_r(line, " \r\n", &save); // parse the command
+    if (command == NULL) return; // blank line
+    char *arg = strtok_r(NULL, "\r\n", &save); // parse the arg (the rest of the line)
+
+    uint64_t start = statsNow();
+    runCommand(session, command, arg);
+    histogramRecord(&session->latency, statsNow() - start);
+    if (ftell(session->out) >= SESSIONFLUSHSIZE) sessionFlush(session);
+}
+
+// writes the session's buffered output to its sink
+// (in one write, so output from sessions sharing a sink doesn't interleave within a command)
+void sessionFlush(SESSION *session) {
+    long length = ftell(session->out);
+    if (length <= 0) return;
+    fflush(session->out);
+    fwrite(session->outBuffer, 1, length, session->sink);
+    rewind(session->out);
+}
+
+// takes every stripe for a whole-tree operation (no directory can change until unlockTree)
+void lockTree() {
+    pthread_once(&stripesOnce, initStripes);
+    for (int i = 0; i < LOCKSTRIPES; i++) pthread_mutex_lock(&stripes[i].writer);
+}
+
+void unlockTree() {
+    for (int i = LOCKSTRIPES - 1; i >= 0; i--) pthread_mutex_unlock(&stripes[i].writer);
+}
@@ -0,0 +1,48 @@
+#ifndef __CONCURRENT_H__
+#define __CONCURRENT_H__
+
+#include "node.h"
+#include "stats.h"
+
+// directories are guarded by a fixed table of lock stripes picked by hashing the node's address,
+// so NODE doesn't grow. each stripe is a seqlock: writers take its mutex and bump its sequence,
+// readers scan without writing anything shared and retry if the sequence moved under them
+// (nodes unlinked by a session are only freed once every session has closed, so a reader can
+// always finish walking a list a writer just changed)
+#define LOCKSTRIPES 1024
+// output a session buffers before handing it to its sink in one write
+#define SESSIONFLUSHSIZE (1 << 16)
+
+// one client of the shared tree
+// a pinned session reads the tree as it was when it ran pin (an unnamed snapshot - see cow.h)
+// while other sessions go on changing it, and refuses to change it itself. unpin (or closing)
+// gives the snapshot back
+typedef struct session {
+	NODE *root;
+	NODE *cwd;            // each session has its own cwd
+	FILE *out;            // command output is buffered here (a memory stream)...
+	FILE *sink;           // ...and written to sink a whole number of commands at a time
+	char *outBuffer;
+	size_t outSize;
+	int pinned;           // 1 if reads see snapshot epoch
+	uint32_t epoch;
+	HISTOGRAM latency;    // how long each of its commands took
+} SESSION;
+
+
+// opens a session on the tree at root, with its cwd at root and its output going to sink
+// returns NULL if allocation failed
+SESSION *sessionOpen(NODE *root, FILE *sink);
+// flushes the session's output, gives back its pin and closes it. the last session to close frees
+// the nodes removed while sessions were open, and what released snapshots and pins kept
+void sessionClose(SESSION *session);
+// parses one command line ("command arg") and runs it in the session. safe to call from many threads
+void sessionRun(SESSION *session, char *line);
+// writes the session's buffered output to its sink
+void sessionFlush(SESSION *session);
+
+// takes every stripe for a whole-tree operation (no directory can change until unlockTree)
+void lockTree();
+void unlockTree();
+
+#endif /* __CONCURRENT_H__ */
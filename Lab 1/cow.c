@@ -0,0 +1,477 @@
+#include <pthread.h>
+#include "cow.h"
+#include "lazy.h"
+#include "dirindex.h"
+
+// a named snapshot
+typedef struct pointInTime {
+    char *name;
+    uint32_t epoch;
+} POINTINTIME;
+
+// an epoch snapshots or pins still read, and how many of them
+typedef struct heldEpoch {
+    uint32_t epoch;
+    int refs;
+} HELDEPOCH;
+
+// a removed node kept for the snapshots that can see it, and the epoch it was removed in
+// (it is visible to the held epochs in [node->epoch, removed))
+typedef struct retainedNode {
+    NODE *node;
+    uint32_t removed;
+} RETAINEDNODE;
+
+uint32_t liveEpoch = 0;
+
+static POINTINTIME *snapshots = NULL;
+static int snapshotCount = 0, snapshotCapacity = 0;
+static int viewIndex = -1;      // snapshot the CWD is in (-1 = live tree)
+
+static HELDEPOCH *held = NULL;  // in increasing epoch order
+static int heldCount = 0, heldCapacity = 0;
+static int linksChanged = 1;    // set by preserveLinks - the newest epoch no longer matches the tree
+
+// serializes preserveLinks: sessions change a node's sibling under its parent's stripe and its
+// child under its own, so two of them can save the same node's links at once
+static pthread_mutex_t historyLock = PTHREAD_MUTEX_INITIALIZER;
+
+// every node with a history, so collection doesn't walk the tree (under historyLock)
+static NODE **versioned = NULL;
+static size_t versionedCount = 0, versionedCapacity = 0;
+
+static RETAINEDNODE *retained = NULL;
+static size_t retainedCount = 0, retainedCapacity = 0;
+
+
+// the links of node as snapshot epoch saw them: the oldest history entry at or after epoch,
+// or NULL if the node's own links haven't changed since
+static NODEVERSION *versionAt(NODE *node, uint32_t epoch) {
+    NODEVERSION *found = NULL;
+    for (NODEVERSION *version = __atomic_load_n(&node->history, __ATOMIC_ACQUIRE); version != NULL && version->epoch >= epoch; version = version->next) {
+        found = version;
+    }
+    return found;
+}
+
+// the links of node as snapshot epoch saw them
+NODE *childAt(NODE *node, uint32_t epoch) {
+    NODEVERSION *version = versionAt(node, epoch);
+    return version ? version->child : node->child;
+}
+
+NODE *siblingAt(NODE *node, uint32_t epoch) {
+    NODEVERSION *version = versionAt(node, epoch);
+    return version ? version->sibling : node->sibling;
+}
+
+// the newest held epoch (only valid while heldCount > 0)
+static uint32_t latestHeld() {
+    return held[heldCount - 1].epoch;
+}
+
+// returns 1 if a held epoch is in [low, high]
+static int heldBetween(uint32_t low, uint32_t high) {
+    int first = 0, last = heldCount;
+    while (first < last) {
+        int middle = (first + last) / 2;
+        if (held[middle].epoch < low) first = middle + 1;
+        else last = middle;
+    }
+    return first < heldCount && held[first].epoch <= high;
+}
+
+// takes a reference to an epoch for a new snapshot or pin: the newest one if the tree's links
+// haven't changed since it was taken, otherwise a new one. returns -1 if allocation failed
+static int holdEpoch(uint32_t *epoch) {
+    if (heldCount > 0 && latestHeld() == liveEpoch - 1 && !__atomic_load_n(&linksChanged, __ATOMIC_RELAXED)) {
+        held[heldCount - 1].refs++;
+        *epoch = latestHeld();
+        return 0;
+    }
+    if (heldCount == heldCapacity) {
+        int newCapacity = heldCapacity ? 2 * heldCapacity : 16;
+        HELDEPOCH *newHeld = realloc(held, newCapacity * sizeof(HELDEPOCH));
+        if (newHeld == NULL) {
+            printf("Error: memory allocation failed!\n");
+            return -1;
+        }
+        held = newHeld;
+        heldCapacity = newCapacity;
+    }
+    held[heldCount].epoch = liveEpoch;
+    held[heldCount].refs = 1;
+    heldCount++;
+    __atomic_store_n(&linksChanged, 0, __ATOMIC_RELAXED);
+    *epoch = liveEpoch++;
+    return 0;
+}
+
+// drops a reference to an epoch (what only it kept is reclaimed by snapshotCollect)
+static void releaseEpoch(uint32_t epoch) {
+    for (int i = 0; i < heldCount; i++) {
+        if (held[i].epoch != epoch) continue;
+        if (--held[i].refs == 0) {
+            memmove(&held[i], &held[i + 1], (heldCount - i - 1) * sizeof(HELDEPOCH));
+            heldCount--;
+        }
+        return;
+    }
+}
+
+// frees a node's whole history
+static void freeHistory(NODE *node) {
+    while (node->history != NULL) {
+        NODEVERSION *next = node->history->next;
+        free(node->history);
+        node->history = next;
+    }
+}
+
+// drops the history entries no held epoch reads. an entry is read by the epochs after the next
+// older entry's, up to its own (the oldest one from the node's creation on)
+static void pruneHistory(NODE *node) {
+    NODEVERSION **link = &node->history;
+    while (*link != NULL) {
+        NODEVERSION *version = *link;
+        uint32_t low = version->next ? version->next->epoch + 1 : node->epoch;
+        if (heldBetween(low, version->epoch)) link = &version->next;
+        else {
+            *link = version->next;
+            free(version);
+        }
+    }
+}
+
+// finds a snapshot by name. returns its index, or -1
+static int findSnapshot(char *name) {
+    for (int i = 0; i < snapshotCount; i++) {
+        if (strcmp(snapshots[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// finds the node at pathName in snapshot epoch (like findNode). returns NULL if there is none
+static NODE *findNodeAt(NODE *root, NODE *cwd, char *pathName, uint32_t epoch) {
+    NODE *node = (pathName[0] == '/') ? root : cwd;
+    char *name = pathName;
+    while (node != NULL) {
+        // skip to the next component
+        while (*name == '/') name++;
+        if (*name == 0) return node;
+        size_t length = strcspn(name, "/");
+
+        if (length == 1 && name[0] == '.') {
+            // stay here
+        }
+        else if (length == 2 && name[0] == '.' && name[1] == '.') node = node->parent;
+        else if (node->type != 'D') return NULL;
+        else {
+            // search the children (as the snapshot saw them) for the component
+            NODE *pCur = childAt(node, epoch);
+            while (pCur != NULL && (strncmp(pCur->name, name, length) != 0 || pCur->name[length] != 0)) {
+                pCur = siblingAt(pCur, epoch);
+            }
+            node = pCur;
+        }
+        name += length;
+    }
+    return NULL;
+}
+
+
+/*
+    snapshot [create name | delete name | list | cd name [pathname] | exit]
+    create takes a snapshot of the live tree in constant time - later changes only record the
+    links they overwrite. delete drops one, and frees the removed nodes and old links only it
+    still needed. list (the default) prints every snapshot. cd moves the CWD into a snapshot
+    (to its root, or pathname inside it), where cd, ls and pwd work read-only, and exit returns
+    to the root of the live tree.
+*/
+void snapshot(NODE *root, NODE **cwd, char *args) {
+    char *command = args ? strtok(args, " ") : NULL;
+    char *arg = command ? strtok(NULL, "") : NULL;
+
+    if (command == NULL || strcmp(command, "list") == 0) {
+        for (int i = 0; i < snapshotCount; i++) {
+            printf("%s%s\n", snapshots[i].name, i == viewIndex ? " (CWD)" : "");
+        }
+        return;
+    }
+
+    if (strcmp(command, "create") == 0) {
+        if (arg == NULL) {
+            printf("Too few arguments!\n");
+            return;
+        }
+        if (findSnapshot(arg) >= 0) {
+            printf("Snapshot %s already exists!\n", arg);
+            return;
+        }
+        if (snapshotCount == snapshotCapacity) {
+            int newCapacity = snapshotCapacity ? 2 * snapshotCapacity : 16;
+            POINTINTIME *newSnapshots = realloc(snapshots, newCapacity * sizeof(POINTINTIME));
+            if (newSnapshots == NULL) {
+                printf("Error: memory allocation failed!\n");
+                return;
+            }
+            snapshots = newSnapshots;
+            snapshotCapacity = newCapacity;
+        }
+        char *name = strdup(arg);
+        if (name == NULL) {
+            printf("Error: memory allocation failed!\n");
+            return;
+        }
+
+        // everything that exists now belongs to the snapshot - new nodes get the next epoch
+        // (so a directory still in a lazily loaded snapshot file has to be read first)
+        lazyExpandAll(root);
+        if (holdEpoch(&snapshots[snapshotCount].epoch) != 0) {
+            free(name);
+            return;
+        }
+        snapshots[snapshotCount].name = name;
+        snapshotCount++;
+        return;
+    }
+
+    if (strcmp(command, "delete") == 0) {
+        if (arg == NULL) {
+            printf("Too few arguments!\n");
+            return;
+        }
+        int index = findSnapshot(arg);
+        if (index < 0) {
+            printf("No such snapshot: %s\n", arg);
+            return;
+        }
+        if (index == viewIndex) {
+            printf("Cannot delete snapshot %s (the CWD is in it)!\n", arg);
+            return;
+        }
+        releaseEpoch(snapshots[index].epoch);
+        free(snapshots[index].name);
+        memmove(&snapshots[index], &snapshots[index + 1], (snapshotCount - index - 1) * sizeof(POINTINTIME));
+        snapshotCount--;
+        if (viewIndex > index) viewIndex--;
+        snapshotCollect();
+        return;
+    }
+
+    if (strcmp(command, "cd") == 0) {
+        char *name = arg ? strtok(arg, " ") : NULL;
+        char *pathName = name ? strtok(NULL, "") : NULL;
+        if (name == NULL) {
+            printf("Too few arguments!\n");
+            return;
+        }
+        int index = findSnapshot(name);
+        if (index < 0) {
+            printf("No such snapshot: %s\n", name);
+            return;
+        }
+        NODE *node = pathName ? findNodeAt(root, root, pathName, snapshots[index].epoch) : root;
+        if (node == NULL || node->type != 'D') {
+            printf("No such directory: %s\n", pathName);
+            return;
+        }
+        viewIndex = index;
+        *cwd = node;
+        return;
+    }
+
+    if (strcmp(command, "exit") == 0) {
+        viewIndex = -1;
+        *cwd = root;
+        return;
+    }
+
+    printf("Usage: snapshot [create name | delete name | list | cd name [pathname] | exit]\n");
+}
+
+// takes an unnamed snapshot for a session to read from. returns 0 with its epoch in *epoch,
+// or -1 if allocation failed (the caller keeps the tree from changing - see lockTree)
+int snapshotPin(NODE *root, uint32_t *epoch) {
+    lazyExpandAll(root);
+    return holdEpoch(epoch);
+}
+
+// gives back an epoch snapshotPin returned (the caller keeps the tree from changing)
+void snapshotUnpin(uint32_t epoch) {
+    releaseEpoch(epoch);
+}
+
+// returns 1 while a snapshot or pin is held, or what released ones kept hasn't been collected
+int snapshotsExist() {
+    return heldCount > 0 || versionedCount > 0 || retainedCount > 0;
+}
+
+// frees the history entries and removed nodes that no held epoch can see any more
+// nothing may be reading old links while it runs (no pinned session is open)
+void snapshotCollect() {
+    // retained nodes no held epoch sees lose their history first, so the pass over the
+    // versioned nodes drops them, and they can be freed after it
+    for (size_t i = 0; i < retainedCount; i++) {
+        NODE *node = retained[i].node;
+        if (!heldBetween(node->epoch, retained[i].removed - 1)) freeHistory(node);
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < versionedCount; i++) {
+        pruneHistory(versioned[i]);
+        if (versioned[i]->history != NULL) versioned[kept++] = versioned[i];
+    }
+    versionedCount = kept;
+    kept = 0;
+    for (size_t i = 0; i < retainedCount; i++) {
+        NODE *node = retained[i].node;
+        if (heldBetween(node->epoch, retained[i].removed - 1)) retained[kept++] = retained[i];
+        else freeNode(node);
+    }
+    retainedCount = kept;
+}
+
+// the snapshot the CWD is in (NULL in the live tree)
+char *snapshotView() {
+    return viewIndex >= 0 ? snapshots[viewIndex].name : NULL;
+}
+
+// cd [pathname] inside the snapshot the CWD is in (no pathname goes to its root)
+void snapshotCd(NODE *root, NODE **cwd, char *pathName) {
+    if (pathName == NULL) {
+        *cwd = root;
+        return;
+    }
+    NODE *node = findNodeAt(root, *cwd, pathName, snapshots[viewIndex].epoch);
+    if (node == NULL) printf("No such directory: %s\n", pathName);
+    else if (node->type != 'D') printf("%s is a file, not a directory.\n", pathName);
+    else *cwd = node;
+}
+
+// ls [pathname] inside the snapshot the CWD is in
+void snapshotLs(NODE *cwd, char *pathName) {
+    uint32_t epoch = snapshots[viewIndex].epoch;
+    NODE *dir = cwd;
+    if (pathName != NULL) {
+        NODE *root = cwd;
+        while (root->parent != root) root = root->parent;
+        dir = findNodeAt(root, cwd, pathName, epoch);
+        if (dir == NULL) {
+            printf("No such file or directory: %s\n", pathName);
+            return;
+        }
+    }
+    if (dir->type != 'D') {
+        printf("%c %s\n", dir->type, dir->name);
+        return;
+    }
+    for (NODE *pCur = childAt(dir, epoch); pCur != NULL; pCur = siblingAt(pCur, epoch)) {
+        printf("%c %s\n", pCur->type, pCur->name);
+    }
+}
+
+// pwd inside the snapshot the CWD is in ("name:/path")
+void snapshotPwd(NODE *cwd) {
+    printf("%s:", snapshots[viewIndex].name);
+    writeAbsolutePath(stdout, cwd);
+}
+
+
+// call before changing node->child or node->sibling in the live tree
+// the first change after a snapshot saves the links that snapshot (and any older one that
+// shares them) saw
+void preserveLinks(NODE *node) {
+    __atomic_store_n(&linksChanged, 1, __ATOMIC_RELAXED);
+    if (heldCount == 0) return; // no snapshots
+    uint32_t latest = latestHeld();
+    if (node->epoch > latest) return; // created after the latest snapshot - no snapshot sees it
+
+    pthread_mutex_lock(&historyLock);
+    if (node->history != NULL && node->history->epoch >= latest) { // already saved
+        pthread_mutex_unlock(&historyLock);
+        return;
+    }
+
+    NODEVERSION *version = malloc(sizeof(NODEVERSION));
+    if (version == NULL) {
+        // the snapshots would see the change - better than losing the live change
+        pthread_mutex_unlock(&historyLock);
+        printf("Error: memory allocation failed!\n");
+        return;
+    }
+    version->epoch = latest;
+    version->child = node->child;
+    version->sibling = node->sibling;
+    version->next = node->history;
+
+    // the first entry puts the node on the list collection goes through
+    if (node->history == NULL) {
+        if (versionedCount == versionedCapacity) {
+            size_t newCapacity = versionedCapacity ? 2 * versionedCapacity : 1024;
+            NODE **newVersioned = realloc(versioned, newCapacity * sizeof(NODE*));
+            if (newVersioned == NULL) {
+                pthread_mutex_unlock(&historyLock);
+                free(version);
+                printf("Error: memory allocation failed!\n");
+                return;
+            }
+            versioned = newVersioned;
+            versionedCapacity = newCapacity;
+        }
+        versioned[versionedCount++] = node;
+    }
+    // published whole, for pinned sessions reading the history without the lock
+    __atomic_store_n(&node->history, version, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&historyLock);
+}
+
+// frees node, unless a snapshot can still see it or it has history left to collect (then it
+// is kept until snapshotCollect finds neither)
+void releaseNode(NODE *node) {
+    if ((heldCount == 0 || node->epoch > latestHeld()) && node->history == NULL) {
+        freeNode(node);
+        return;
+    }
+    indexFree(node); // snapshot views list in link order
+    if (retainedCount == retainedCapacity) {
+        size_t newCapacity = retainedCapacity ? 2 * retainedCapacity : 1024;
+        RETAINEDNODE *newRetained = realloc(retained, newCapacity * sizeof(RETAINEDNODE));
+        if (newRetained == NULL) return; // can't track it - leaking one node beats freeing it under a snapshot
+        retained = newRetained;
+        retainedCapacity = newCapacity;
+    }
+    retained[retainedCount].node = node;
+    retained[retainedCount].removed = liveEpoch;
+    retainedCount++;
+}
+
+// frees node and everything under it, except what a snapshot can still see
+// the walk reads the live links but never changes them (unlike freeFileTree's rotations),
+// and frees each node after its subtree, in post-order
+void releaseSubtree(NODE *node) {
+    if (!snapshotsExist()) {
+        // no snapshots - the fast way
+        node->sibling = NULL;
+        freeFileTree(node);
+        return;
+    }
+
+    NODE *pCur = node;
+    while (1) {
+        // go down to a leaf
+        while (pCur->child != NULL) pCur = pCur->child;
+
+        // free it, then every directory climbed out of
+        while (1) {
+            NODE *next = pCur->sibling, *up = pCur->parent;
+            int last = (pCur == node);
+            releaseNode(pCur);
+            if (last) return;
+            if (next != NULL) {
+                pCur = next;
+                break;
+            }
+            pCur = up;
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef __COW_H__
+#define __COW_H__
+
+#include "node.h"
+
+// point-in-time snapshots of the live tree
+// taking a snapshot only holds an epoch (a new one, or the newest if no link has changed since).
+// nodes are never copied - instead, the first time a node's child or sibling link changes after
+// a snapshot, the old links are pushed onto the node's history tagged with the newest held epoch
+// (preserveLinks). a snapshot reads each link from the oldest history entry at or after its
+// epoch, or from the node if there is none. removed nodes a snapshot can still see are kept
+// (releaseNode), and a node's name, type and parent never change (mv is refused while there are
+// snapshots), so parent links are valid in every snapshot. held epochs are counted, and once the
+// last snapshot or pin on one is gone, snapshotCollect frees what only it could see
+// (sizes, aggregates and hashes are not versioned - du, diff and save only look at the live tree)
+
+// old child/sibling links of a node
+typedef struct nodeVersion {
+	uint32_t epoch;             // the links as snapshots up to this epoch saw them
+	struct node *child, *sibling;
+	struct nodeVersion *next;   // older entry
+} NODEVERSION;
+
+// number of snapshots taken. new nodes get it as their epoch
+extern uint32_t liveEpoch;
+
+
+// main command function. runs "snapshot [create name | list | cd name [pathname] | exit]"
+void snapshot(NODE *root, NODE **cwd, char *args);
+
+// the snapshot the CWD is in (NULL in the live tree). commands that change the tree or walk it
+// are refused there - cd, ls and pwd go through their snapshot versions below
+char *snapshotView();
+void snapshotCd(NODE *root, NODE **cwd, char *pathName);
+void snapshotLs(NODE *cwd, char *pathName);
+void snapshotPwd(NODE *cwd);
+
+// takes an unnamed snapshot (not listed) for a session to read from. returns 0 with its epoch in
+// *epoch, or -1 if allocation failed. the tree must not change while it runs (see lockTree)
+int snapshotPin(NODE *root, uint32_t *epoch);
+// gives back an epoch snapshotPin returned (the tree must not change while it runs)
+void snapshotUnpin(uint32_t epoch);
+// returns 1 while a snapshot or pin is held, or what released ones kept hasn't been collected
+// (mv and compact are refused until then)
+int snapshotsExist();
+// frees the history entries and removed nodes no held snapshot or pin can see any more. nothing
+// may be reading old links while it runs - snapshot delete runs it, and so does the last session
+// to close (see concurrent.h)
+void snapshotCollect();
+// the first child of node, and the next sibling of node, as snapshot epoch saw them
+NODE *childAt(NODE *node, uint32_t epoch);
+NODE *siblingAt(NODE *node, uint32_t epoch);
+
+// call before changing node->child or node->sibling in the live tree
+void preserveLinks(NODE *node);
+// frees node, unless a snapshot can still see it
+void releaseNode(NODE *node);
+// frees node and everything under it, except what a snapshot can still see. nothing is modified,
+// so the links snapshots read stay intact
+void releaseSubtree(NODE *node);
+
+#endif /* __COW_H__ */
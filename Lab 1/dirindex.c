@@ -0,0 +1,154 @@
+#include "dirindex.h"
+#include "lazy.h"
+
+
+// allocates an entry for node on a random number of levels (each level with probability 1/4 of
+// the one below). returns NULL if allocation failed
+static INDEXENTRY *newEntry(NAMEINDEX *index, NODE *node, int *levels) {
+    // xorshift - two bits of it per level
+    uint32_t random = index->random;
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    index->random = random;
+    int entryLevels = 1;
+    while (entryLevels < INDEXMAXLEVEL && (random & 3) == 0) {
+        entryLevels++;
+        random >>= 2;
+    }
+
+    INDEXENTRY *entry = malloc(sizeof(INDEXENTRY) + entryLevels * sizeof(INDEXENTRY*));
+    if (entry == NULL) return NULL;
+    entry->node = node;
+    for (int level = 0; level < entryLevels; level++) entry->next[level] = NULL;
+    if (entryLevels > index->levels) index->levels = entryLevels;
+    *levels = entryLevels;
+    return entry;
+}
+
+static void freeIndex(NAMEINDEX *index) {
+    INDEXENTRY *next;
+    for (INDEXENTRY *entry = index->head[0]; entry != NULL; entry = next) {
+        next = entry->next[0];
+        free(entry);
+    }
+    free(index);
+}
+
+static int compareNames(const void *a, const void *b) {
+    return strcmp((*(NODE**)a)->name, (*(NODE**)b)->name);
+}
+
+
+// the index of dir, built from its children if it doesn't have one yet
+// returns NULL if dir is empty or allocation failed
+NAMEINDEX *dirIndex(NODE *dir) {
+    lazyExpand(dir);
+    if (dir->index != NULL || dir->child == NULL) return dir->index;
+
+    // sort the children
+    long count = 0;
+    for (NODE *pCur = dir->child; pCur != NULL; pCur = pCur->sibling) count++;
+    NODE **nodes = malloc(count * sizeof(NODE*));
+    NAMEINDEX *index = calloc(1, sizeof(NAMEINDEX));
+    if (nodes == NULL || index == NULL) {
+        free(nodes);
+        free(index);
+        return NULL;
+    }
+    long i = 0;
+    for (NODE *pCur = dir->child; pCur != NULL; pCur = pCur->sibling) nodes[i++] = pCur;
+    qsort(nodes, count, sizeof(NODE*), compareNames);
+
+    // link the entries in order, appending each one to the end of every level it is on
+    index->random = 0x9e3779b9u ^ (uint32_t)(uintptr_t)dir;
+    if (index->random == 0) index->random = 1;
+    INDEXENTRY **tails[INDEXMAXLEVEL];
+    for (int level = 0; level < INDEXMAXLEVEL; level++) tails[level] = &index->head[level];
+    for (i = 0; i < count; i++) {
+        int levels;
+        INDEXENTRY *entry = newEntry(index, nodes[i], &levels);
+        if (entry == NULL) {
+            free(nodes);
+            freeIndex(index);
+            return NULL;
+        }
+        for (int level = 0; level < levels; level++) {
+            *tails[level] = entry;
+            tails[level] = &entry->next[level];
+        }
+    }
+    index->count = count;
+    free(nodes);
+
+    dir->index = index;
+    return index;
+}
+
+// the first entry whose name sorts after name (the first entry if name is NULL). NULL at the end
+INDEXENTRY *indexAfter(NAMEINDEX *index, char *name) {
+    if (name == NULL) return index->head[0];
+
+    // links is the next array of the last entry at or before name (the heads to begin with)
+    INDEXENTRY **links = index->head;
+    for (int level = index->levels - 1; level >= 0; level--) {
+        while (links[level] != NULL && strcmp(links[level]->node->name, name) <= 0) links = links[level]->next;
+    }
+    return links[0];
+}
+
+// call after linking node under dir (does nothing unless dir has an index)
+void indexInsert(NODE *dir, NODE *node) {
+    NAMEINDEX *index = dir->index;
+    if (index == NULL) return;
+
+    // find the link the new entry goes after on every level
+    INDEXENTRY **update[INDEXMAXLEVEL];
+    INDEXENTRY **links = index->head;
+    for (int level = INDEXMAXLEVEL - 1; level >= 0; level--) {
+        while (links[level] != NULL && strcmp(links[level]->node->name, node->name) < 0) links = links[level]->next;
+        update[level] = &links[level];
+    }
+
+    int levels;
+    INDEXENTRY *entry = newEntry(index, node, &levels);
+    if (entry == NULL) {
+        // drop it - the next sorted listing builds it again
+        indexFree(dir);
+        return;
+    }
+    for (int level = 0; level < levels; level++) {
+        entry->next[level] = *update[level];
+        *update[level] = entry;
+    }
+    index->count++;
+}
+
+// call after unlinking node from dir (does nothing unless dir has an index)
+void indexRemove(NODE *dir, NODE *node) {
+    NAMEINDEX *index = dir->index;
+    if (index == NULL) return;
+
+    // unlink its entry from every level it is on, top down
+    INDEXENTRY *found = NULL;
+    INDEXENTRY **links = index->head;
+    for (int level = index->levels - 1; level >= 0; level--) {
+        while (links[level] != NULL && strcmp(links[level]->node->name, node->name) < 0) links = links[level]->next;
+        if (links[level] != NULL && links[level]->node == node) {
+            found = links[level];
+            links[level] = found->next[level];
+        }
+    }
+    if (found == NULL) return;
+    free(found);
+
+    // an empty directory keeps no index
+    if (--index->count == 0) indexFree(dir);
+}
+
+// frees the index of dir, if it has one
+void indexFree(NODE *dir) {
+    if (dir->index == NULL) return;
+    freeIndex(dir->index);
+    dir->index = NULL;
+}
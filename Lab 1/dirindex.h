@@ -0,0 +1,39 @@
+#ifndef __DIRINDEX_H__
+#define __DIRINDEX_H__
+
+#include "node.h"
+
+// a directory's children in name order, for sorted and paged listings (ls --after/--limit)
+// a skip list: every entry is on level 0 and each level up holds about a quarter of the entries of
+// the one below, so finding the first name after a cursor takes O(log n) steps and each entry
+// listed after that takes one. an index is only built the first time its directory is listed in
+// order - from then on every change to the directory's children updates it, and it is dropped
+// when the directory empties or is freed
+#define INDEXMAXLEVEL 16
+
+typedef struct indexEntry {
+	NODE *node;
+	struct indexEntry *next[];    // the next entry on each of this entry's levels
+} INDEXENTRY;
+
+typedef struct nameIndex {
+	int levels;                   // levels in use
+	long count;                   // entries
+	uint32_t random;              // xorshift state for picking the levels of new entries
+	INDEXENTRY *head[INDEXMAXLEVEL]; // first entry on each level
+} NAMEINDEX;
+
+
+// the index of dir, built from its children if it doesn't have one yet
+// returns NULL if dir is empty or allocation failed
+NAMEINDEX *dirIndex(NODE *dir);
+// the first entry whose name sorts after name (the first entry if name is NULL). NULL at the end
+INDEXENTRY *indexAfter(NAMEINDEX *index, char *name);
+// call after linking node under dir (does nothing unless dir has an index)
+void indexInsert(NODE *dir, NODE *node);
+// call after unlinking node from dir (does nothing unless dir has an index)
+void indexRemove(NODE *dir, NODE *node);
+// frees the index of dir, if it has one
+void indexFree(NODE *dir);
+
+#endif /* __DIRINDEX_H__ */
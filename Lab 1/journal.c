@@ -0,0 +1,500 @@
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "journal.h"
+#include "snapshot.h"
+#include "parallel.h"
+#include "transaction.h"
+
+// journaling state (journalFd < 0 when journaling is off)
+static NODE *journalRoot = NULL;        // the tree being journaled
+static char *journalBaseName = NULL;
+static int journalFd = -1;
+static uint32_t journalGeneration = 0;  // generation of the open journal file
+static uint32_t oldestGeneration = 0;   // oldest journal file recovery still needs
+static char journalBuffer[JOURNALBUFFERSIZE];
+static size_t bufferLength = 0;         // bytes of uncommitted records
+static int pendingRecords = 0;          // uncommitted records
+static struct timespec oldestPending;   // when the first uncommitted record was added
+static long recordsSinceCheckpoint = 0;
+static pid_t checkpointPid = 0;         // forked checkpoint still running (0 if none)
+static uint32_t checkpointGeneration = 0;
+
+// path buffer for journalRecord (grows with the depth of the tree)
+static char *pathBuffer = NULL;
+static size_t pathCapacity = 0;
+
+
+// "<base>.ckpt" (caller frees)
+static char *checkpointName() {
+    char *name = malloc(strlen(journalBaseName) + 6);
+    if (name != NULL) sprintf(name, "%s.ckpt", journalBaseName);
+    return name;
+}
+
+// "<base>.journal.<generation>" (caller frees)
+static char *journalName(uint32_t generation) {
+    char *name = malloc(strlen(journalBaseName) + 20);
+    if (name != NULL) sprintf(name, "%s.journal.%u", journalBaseName, generation);
+    return name;
+}
+
+// removes the journal files in [from, to)
+static void removeJournals(uint32_t from, uint32_t to) {
+    for (uint32_t generation = from; generation < to; generation++) {
+        char *name = journalName(generation);
+        if (name != NULL) unlink(name);
+        free(name);
+    }
+}
+
+// microseconds since the first uncommitted record
+static long pendingAge() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - oldestPending.tv_sec) * 1000000L + (now.tv_nsec - oldestPending.tv_nsec) / 1000;
+}
+
+// writes the buffered records with a single write and makes them durable with a single fdatasync
+static void journalCommit() {
+    if (journalFd < 0 || bufferLength == 0) return;
+
+    size_t written = 0;
+    while (written < bufferLength) {
+        ssize_t result = write(journalFd, journalBuffer + written, bufferLength - written);
+        if (result < 0) break;
+        written += result;
+    }
+    if (written < bufferLength || fdatasync(journalFd) != 0) {
+        printf("Failed to write journal: %s\n", journalBaseName);
+    }
+    bufferLength = 0;
+    pendingRecords = 0;
+}
+
+// opens a new, empty journal file for generation. returns 0 on success
+static int openJournal(uint32_t generation) {
+    char *name = journalName(generation);
+    if (name == NULL) return -1;
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        printf("Failed to open file: %s\n", name);
+        free(name);
+        return -1;
+    }
+
+    JOURNALHEADER header;
+    memcpy(header.magic, JOURNALMAGIC, sizeof(header.magic));
+    header.version = JOURNALVERSION;
+    header.generation = generation;
+    if (write(fd, &header, sizeof(header)) != sizeof(header) || fdatasync(fd) != 0) {
+        printf("Failed to write file: %s\n", name);
+        close(fd);
+        free(name);
+        return -1;
+    }
+
+    free(name);
+    journalFd = fd;
+    journalGeneration = generation;
+    return 0;
+}
+
+// collects a finished background checkpoint (never blocks unless wait is set)
+static void reapCheckpoint(int wait) {
+    int status;
+    if (checkpointPid == 0 || waitpid(checkpointPid, &status, wait ? 0 : WNOHANG) != checkpointPid) return;
+    checkpointPid = 0;
+
+    // the journals before the checkpoint are no longer needed once it is on disk
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        removeJournals(oldestGeneration, checkpointGeneration);
+        oldestGeneration = checkpointGeneration;
+    }
+    else {
+        printf("Checkpoint failed: %s (journals kept)\n", journalBaseName);
+    }
+}
+
+// replays one journal file against root. returns the number of records applied, or -1 if the file doesn't exist
+static long replayJournal(NODE *root, uint32_t generation) {
+    char *name = journalName(generation);
+    FILE *infile = name ? fopen(name, "rb") : NULL;
+    if (infile == NULL) {
+        free(name);
+        return -1;
+    }
+
+    JOURNALHEADER header;
+    long records = 0;
+    if (fread(&header, sizeof(header), 1, infile) != 1 || memcmp(header.magic, JOURNALMAGIC, sizeof(header.magic)) != 0
+            || header.version != JOURNALVERSION || header.generation != generation) {
+        printf("Not a journal file: %s\n", name);
+        fclose(infile);
+        free(name);
+        return 0;
+    }
+
+    // apply records until the end of the file (or a torn record from a crash mid-write)
+    // transaction parts are held until their commit record - without it they are dropped
+    char record[3 + UINT16_MAX + 1];
+    char *transaction = NULL;
+    size_t transactionLength = 0;
+    while (fread(record, 1, 3, infile) == 3) {
+        uint16_t length;
+        uint32_t checksum;
+        memcpy(&length, record + 1, sizeof(length));
+        if (fread(record + 3, 1, length, infile) != length || fread(&checksum, sizeof(checksum), 1, infile) != 1
+                || snapshotChecksum(0, record, 3 + length) != checksum) {
+            printf("Ignoring torn journal record in %s\n", name);
+            break;
+        }
+        char *path = record + 3;
+        path[length] = 0;
+
+        // a transaction: collect its parts, and apply them all at its commit record
+        if (record[0] == 't' || record[0] == 'T') {
+            char *newTransaction = realloc(transaction, transactionLength + length);
+            if (newTransaction == NULL) {
+                printf("Error: memory allocation failed!\n");
+                break;
+            }
+            transaction = newTransaction;
+            memcpy(transaction + transactionLength, path, length);
+            transactionLength += length;
+            if (record[0] == 'T') {
+                transactionReplay(root, transaction, transactionLength);
+                transactionLength = 0;
+            }
+            records++;
+            continue;
+        }
+
+        // the same helpers the commands use, with absolute paths
+        if (record[0] == 'D' || record[0] == 'F') createFile(root, path, record[0]);
+        else if (record[0] == 'd') removeFile(root, path, 'D');
+        else if (record[0] == 'f') removeFile(root, path, 'F');
+        else if (record[0] == 'r') removeTree(root, path);
+        else if (record[0] == 'm') moveFile(root, path, path + strlen(path) + 1);
+        records++;
+    }
+
+    free(transaction);
+    fclose(infile);
+    free(name);
+    return records;
+}
+
+// recovers the tree from <base>.ckpt and its journals, then resumes journaling
+static void journalRecover(NODE *root, NODE **cwd, char *baseName) {
+    journalBaseName = strdup(baseName);
+    char *ckptName = checkpointName();
+    uint32_t generation;
+
+    // load the checkpoint
+    NODE *newRoot = ckptName ? readSnapshot(ckptName, &generation) : NULL;
+    free(ckptName);
+    if (newRoot == NULL) {
+        free(journalBaseName);
+        journalBaseName = NULL;
+        return;
+    }
+    replaceFileTree(root, newRoot);
+    *cwd = root;
+
+    // replay the journals that follow it, oldest first
+    long total = 0, records;
+    oldestGeneration = generation;
+    while ((records = replayJournal(root, generation)) >= 0) {
+        total += records;
+        generation++;
+    }
+    printf("Recovered %ld journal records\n", total);
+
+    // a fresh checkpoint of the recovered tree replaces them
+    journalRoot = root;
+    journalGeneration = generation - 1;
+    journalCheckpoint(root, 1);
+}
+
+// turns journaling on for root, starting from a checkpoint of the current tree
+static void journalOpen(NODE *root, char *baseName) {
+    journalBaseName = strdup(baseName);
+    journalRoot = root;
+
+    // carry on from the generation of an existing checkpoint, so its journals can't be mixed in
+    uint32_t generation = 0;
+    char *ckptName = checkpointName();
+    FILE *ckpt = ckptName ? fopen(ckptName, "rb") : NULL;
+    SNAPSHOTHEADER header;
+    if (ckpt != NULL && fread(&header, sizeof(header), 1, ckpt) == 1 && memcmp(header.magic, SNAPSHOTMAGIC, 4) == 0) {
+        generation = header.generation;
+    }
+    if (ckpt != NULL) fclose(ckpt);
+    free(ckptName);
+
+    // stale journals newer than the checkpoint (from an interrupted session) would be replayed after ours
+    uint32_t stale = generation + 1;
+    char *name;
+    while ((name = journalName(stale)) != NULL && unlink(name) == 0) {
+        free(name);
+        stale++;
+    }
+    free(name);
+
+    oldestGeneration = generation;
+    journalGeneration = generation;
+    if (journalCheckpoint(root, 1) != 0) {
+        free(journalBaseName);
+        journalBaseName = NULL;
+    }
+}
+
+
+/*
+    journal on basename | off | sync | checkpoint | status
+    journal recover basename
+    Log every mkdir/creat/rm/rmdir to basename.journal.N with group commit, checkpointing the tree
+    to basename.ckpt in the background every JOURNALCHECKPOINTRECORDS records. on starts from a
+    checkpoint of the current tree. recover replaces the tree with the checkpoint plus its
+    journals and keeps journaling.
+*/
+void journal(NODE *root, NODE **cwd, char *args) {
+    // parse the subcommand and its arg
+    char *subcommand = args ? strtok(args, " ") : NULL;
+    char *arg = subcommand ? strtok(NULL, "") : NULL;
+    if (subcommand == NULL) {
+        printf("Too few arguments!\n");
+        return;
+    }
+
+    if (strcmp(subcommand, "on") == 0 || strcmp(subcommand, "recover") == 0) {
+        if (arg == NULL) {
+            printf("Too few arguments!\n");
+            return;
+        }
+        journalClose();
+        if (subcommand[0] == 'o') journalOpen(root, arg);
+        else journalRecover(root, cwd, arg);
+        return;
+    }
+    if (journalFd < 0) {
+        printf("Journaling is off!\n");
+        return;
+    }
+    if (strcmp(subcommand, "off") == 0) journalClose();
+    else if (strcmp(subcommand, "sync") == 0) journalCommit();
+    else if (strcmp(subcommand, "checkpoint") == 0) journalCheckpoint(root, 0);
+    else if (strcmp(subcommand, "status") == 0) {
+        reapCheckpoint(0);
+        printf("%s: generation %u, %d uncommitted, %ld since checkpoint%s\n", journalBaseName, journalGeneration,
+            pendingRecords, recordsSinceCheckpoint, checkpointPid ? ", checkpoint running" : "");
+    }
+    else printf("Command not found!\n");
+}
+
+// appends a record with the given op and data to the group buffer, committing the group when it is due
+// (length is at most JOURNALMAXDATA, so the record fits an empty buffer)
+static void appendRecord(char op, char *data, size_t length) {
+    // make room in the group buffer
+    size_t recordLength = 1 + sizeof(uint16_t) + length + sizeof(uint32_t);
+    if (bufferLength + recordLength > JOURNALBUFFERSIZE) journalCommit();
+
+    // append the record
+    char *record = journalBuffer + bufferLength;
+    uint16_t dataLength = length;
+    record[0] = op;
+    memcpy(record + 1, &dataLength, sizeof(dataLength));
+    memcpy(record + 3, data, length);
+    uint32_t checksum = snapshotChecksum(0, record, 3 + length);
+    memcpy(record + 3 + length, &checksum, sizeof(checksum));
+    bufferLength += recordLength;
+    if (pendingRecords++ == 0) clock_gettime(CLOCK_MONOTONIC, &oldestPending);
+    recordsSinceCheckpoint++;
+
+    // group commit: one write + fdatasync covers the whole group
+    if (pendingRecords >= JOURNALGROUPSIZE || pendingAge() >= JOURNALGROUPUSEC) journalCommit();
+}
+
+// the length of node's absolute path ("" for root), and in *top the root of its tree
+static size_t pathLength(NODE *node, NODE **top) {
+    size_t length = 0;
+    for (; node->parent != node; node = node->parent) length += strlen(node->name) + 1;
+    *top = node;
+    return length;
+}
+
+// writes node's absolute path so that it ends at end (built backwards, up the parents)
+static void writePath(NODE *node, char *end) {
+    for (; node->parent != node; node = node->parent) {
+        size_t nameLength = strlen(node->name);
+        end -= nameLength;
+        memcpy(end, node->name, nameLength);
+        *--end = '/';
+    }
+}
+
+// makes room for size bytes in the path buffer. returns -1 if allocation failed
+static int reservePath(size_t size) {
+    if (size <= pathCapacity) return 0;
+    char *newBuffer = realloc(pathBuffer, size);
+    if (newBuffer == NULL) {
+        printf("Error: memory allocation failed!\n");
+        return -1;
+    }
+    pathBuffer = newBuffer;
+    pathCapacity = size;
+    return 0;
+}
+
+// appends a mutation of node to the journal (a no-op while journaling is off)
+// the record holds the node's absolute path, built by walking up its parents - O(depth), not O(tree)
+void journalRecord(char op, NODE *node) {
+    if (journalFd < 0) return;
+
+    // measure the path (and make sure the node is in the journaled tree, not a scratch tree)
+    NODE *top;
+    size_t length = pathLength(node, &top);
+    if (top != journalRoot) return;
+    if (length > JOURNALMAXDATA) {
+        printf("Path too long to journal!\n");
+        return;
+    }
+
+    if (reservePath(length + 1) < 0) return;
+    writePath(node, pathBuffer + length);
+    appendRecord(op, pathBuffer, length);
+}
+
+// appends a move of node to newName under newParent (call before moving it). the record holds
+// both paths: "source\0destination"
+void journalMove(NODE *node, NODE *newParent, char *newName) {
+    if (journalFd < 0) return;
+
+    NODE *top;
+    size_t sourceLength = pathLength(node, &top);
+    if (top != journalRoot) return;
+    size_t nameLength = strlen(newName);
+    size_t parentLength = pathLength(newParent, &top);
+    size_t length = sourceLength + 1 + parentLength + 1 + nameLength;
+    if (length > JOURNALMAXDATA) {
+        printf("Path too long to journal!\n");
+        return;
+    }
+
+    if (reservePath(length) < 0) return;
+    writePath(node, pathBuffer + sourceLength);
+    pathBuffer[sourceLength] = 0;
+    char *destination = pathBuffer + sourceLength + 1;
+    writePath(newParent, destination + parentLength);
+    destination[parentLength] = '/';
+    memcpy(destination + parentLength + 1, newName, nameLength);
+    appendRecord('m', pathBuffer, length);
+}
+
+// 1 if a transaction (its operations as "Xpath\0" each) on root can be journaled: every operation
+// has to fit in a record on its own, since parts are only split between operations
+int journalTransactionFits(NODE *root, char *ops, size_t length) {
+    if (journalFd < 0 || root != journalRoot) return 1;
+    for (size_t start = 0; start < length; start += strlen(ops + start) + 1) {
+        if (strlen(ops + start) + 1 > TRANSACTIONRECORDBYTES) return 0;
+    }
+    return 1;
+}
+
+// appends a transaction (its operations as "Xpath\0" each) to the journal, as a single record if it
+// fits, otherwise as parts (t) followed by one commit record (T), split between operations
+// recovery applies all of it or, if the commit record never made it to disk, none of it
+// (the caller has checked journalTransactionFits, so no part is ever cut short)
+void journalTransaction(NODE *root, char *ops, size_t length) {
+    if (journalFd < 0 || root != journalRoot) return;
+
+    size_t start = 0;
+    while (start < length) {
+        // take whole operations up to the record limit
+        size_t end = start;
+        while (end < length) {
+            size_t next = end + strlen(ops + end) + 1;
+            if (next - start > TRANSACTIONRECORDBYTES && end > start) break;
+            end = next;
+        }
+        appendRecord(end == length ? 'T' : 't', ops + start, end - start);
+        start = end;
+    }
+}
+
+// called by the command loop between commands: commits stale groups and runs due checkpoints
+// an interactive session commits before waiting on the user, scripted input keeps grouping
+void journalIdle() {
+    if (journalFd < 0) return;
+    reapCheckpoint(0);
+    if (pendingRecords > 0 && (isatty(STDIN_FILENO) || pendingAge() >= JOURNALGROUPUSEC)) journalCommit();
+    if (recordsSinceCheckpoint >= JOURNALCHECKPOINTRECORDS && checkpointPid == 0) journalCheckpoint(journalRoot, 0);
+}
+
+// commits everything and stops journaling
+void journalClose() {
+    if (journalFd >= 0) {
+        journalCommit();
+        reapCheckpoint(1);
+        close(journalFd);
+        journalFd = -1;
+    }
+    free(journalBaseName);
+    journalBaseName = NULL;
+    journalRoot = NULL;
+}
+
+// checkpoints the tree and starts the next journal generation. returns 0 on success
+// with wait == 0 the snapshot is written by a forked child from its copy-on-write image of the tree
+// while the parent keeps going. the old journals are only removed once the checkpoint is on disk,
+// so a failed checkpoint never loses records
+int journalCheckpoint(NODE *root, int wait) {
+    if (journalBaseName == NULL) return 0;
+
+    // one checkpoint at a time
+    reapCheckpoint(wait);
+    if (checkpointPid != 0) return 0;
+
+    // everything so far goes into the old generation, and everything after into the new one
+    journalCommit();
+    if (journalFd >= 0) close(journalFd);
+    journalFd = -1;
+    uint32_t generation = journalGeneration + 1;
+    if (openJournal(generation) != 0) {
+        printf("Journaling is off!\n");
+        return -1;
+    }
+    recordsSinceCheckpoint = 0;
+
+    char *ckptName = checkpointName();
+    if (ckptName == NULL) return -1;
+
+    // background: the child writes the snapshot and exits
+    if (!wait) {
+        fflush(stdout); // don't let the child inherit (and repeat) buffered output
+        pid_t pid = fork();
+        if (pid == 0) {
+            int status = writeSnapshot(root, ckptName, generation);
+            fflush(stdout);
+            _exit(status == 0 ? 0 : 1);
+        }
+        if (pid > 0) {
+            checkpointPid = pid;
+            checkpointGeneration = generation;
+            free(ckptName);
+            return 0;
+        }
+        // fork failed - write it ourselves
+    }
+
+    // foreground
+    int status = writeSnapshot(root, ckptName, generation);
+    free(ckptName);
+    if (status == 0) {
+        removeJournals(oldestGeneration, generation);
+        oldestGeneration = generation;
+    }
+    return status;
+}
@@ -0,0 +1,51 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdint.h>
+#include "node.h"
+
+// write-ahead journal of tree mutations
+// <base>.ckpt is a binary snapshot checkpoint, and <base>.journal.<generation> holds the mutations
+// made after the checkpoint of that generation. recovery loads the checkpoint and replays every
+// journal from its generation on
+#define JOURNALMAGIC "FFSJ"
+#define JOURNALVERSION 1
+#define JOURNALBUFFERSIZE (64 * 1024)       // bytes of records buffered before a commit is forced
+#define JOURNALMAXDATA (JOURNALBUFFERSIZE - 7) // most data bytes per record (op, length and checksum take 7)
+#define JOURNALGROUPSIZE 256                // records per group commit
+#define JOURNALGROUPUSEC 10000              // max age of an uncommitted record (microseconds)
+#define JOURNALCHECKPOINTRECORDS 100000     // records between automatic checkpoints
+
+typedef struct journalHeader {
+	char     magic[4];      // JOURNALMAGIC
+	uint32_t version;       // JOURNALVERSION
+	uint32_t generation;    // generation of the checkpoint this journal follows
+} JOURNALHEADER;
+
+// each record is: op (1 byte) | path length (uint16) | absolute path | checksum (uint32)
+// ops are D (mkdir), F (creat), d (rmdir), f (rm) and r (rm -r). the checksum is FNV-1a of everything before it
+// a move (m, mv) holds two paths instead of one: "source\0destination"
+// a transaction's record holds its operations ("Xpath\0" each, X one of the ops above) instead of a
+// path: T, or parts t followed by a T if they don't fit in one - replay applies them at the T
+
+
+// main command function. runs "journal on basename | off | sync | checkpoint | recover basename | status"
+void journal(NODE *root, NODE **cwd, char *args);
+
+// appends a mutation of node to the journal (a no-op while journaling is off)
+void journalRecord(char op, NODE *node);
+// appends a move of node to newName under newParent (call before moving it)
+void journalMove(NODE *node, NODE *newParent, char *newName);
+// 1 if a transaction's operations ("Xpath\0" each) on root can be journaled (always while journaling is off)
+int journalTransactionFits(NODE *root, char *ops, size_t length);
+// appends a committed transaction's operations to the journal (check journalTransactionFits first)
+void journalTransaction(NODE *root, char *ops, size_t length);
+// called by the command loop between commands: commits stale groups and runs due checkpoints
+void journalIdle();
+// commits everything and stops journaling
+void journalClose();
+// checkpoints the tree and starts the next journal generation. returns 0 on success
+// with wait == 0 the snapshot is written by a forked child while the parent keeps going
+int journalCheckpoint(NODE *root, int wait);
+
+#endif /* __JOURNAL_H__ */
@@ -1,96 +1,442 @@
+#include <pthread.h>
+#include <time.h>
 #include "commands.h"
+#include "snapshot.h"
+#include "mapfs.h"
+#include "journal.h"
+#include "bgsave.h"
+#include "concurrent.h"
+#include "parallel.h"
+#include "merkle.h"
+#include "cow.h"
+#include "compact.h"
+#include "pathindex.h"
+#include "server.h"
+#include "transaction.h"
+#include "stats.h"
+#include "columns.h"
+#include "trigram.h"
+
+// most threads -j will start (over all its scripts), and most scripts
+#define MAXTHREADS 256
+#define MAXREPLAYS 16
+// size of the input buffer used in batch mode (lines may be longer - the buffer grows)
+#define BATCHBUFFERSIZE (1 << 20)
+// slots in the command hash table (power of 2, more than twice the number of commands)
+#define COMMANDTABLESIZE 64
+
+// a command name and the function that runs it with the rest of the line as its arg
+typedef struct command {
+	char *name;
+	void (*run)(char *arg);
+	int inSnapshot;         // 1 if it may run while the CWD is in a snapshot (see cow.h)
+} COMMAND;
+
+// a script given with -j, and the threads replaying it
+typedef struct replay {
+	char *fileName;
+	int threadCount;
+	char *script;           // loaded once and shared by its threads (never modified)
+	size_t length;
+} REPLAY;
+
+// what one -j thread replays, and how long its commands took
+typedef struct replayThread {
+	REPLAY *replay;
+	HISTOGRAM latency;
+} REPLAYTHREAD;
 
 // global variables
-NODE *root; 
+NODE *root;
 NODE *cwd;
-char *cmd[] = {"mkdir", "rmdir", "cd", "ls", "pwd", "creat", "rm", "save", "reload", "quit", 0};  // fill with list of commands
+int commandTable[COMMANDTABLESIZE]; // index + 1 into commands[] for each name hash (0 = empty slot)
+long commandCount = 0;              // commands run in batch mode
+int batchRunning = 0;               // set until the batch throughput has been reported
+struct timespec batchStart;
+REPLAY replays[MAXREPLAYS];         // the -j scripts
+int replayCount = 0;
+
 
+// wrappers that give every command the same signature (they all work on the global root/cwd)
+// (between begin and commit, mkdir, rmdir, creat and rm are queued instead of run - see transaction.h)
+void runMkdir(char *arg) { if (transactionOpen()) transactionAdd(cwd, 'D', arg); else mkdir(cwd, arg); }
+void runRmdir(char *arg) { if (transactionOpen()) transactionAdd(cwd, 'd', arg); else rmdir(cwd, arg); }
+void runCd(char *arg) { if (snapshotView()) snapshotCd(root, &cwd, arg); else cd(&cwd, arg); }
+void runLs(char *arg) { if (snapshotView()) snapshotLs(cwd, arg); else ls(cwd, arg); }
+void runPwd(char *arg) { if (snapshotView()) snapshotPwd(cwd); else pwd(cwd); }
+void runCreat(char *arg) { if (transactionOpen()) transactionAdd(cwd, 'F', arg); else creat(cwd, arg); }
+void runRm(char *arg) {
+	if (!transactionOpen()) rm(cwd, arg);
+	else if (arg != NULL && strncmp(arg, "-r", 2) == 0 && (arg[2] == ' ' || arg[2] == 0)) printf("Cannot rm -r in a transaction!\n");
+	else transactionAdd(cwd, 'f', arg);
+}
+void runMv(char *arg) { if (transactionOpen()) printf("Cannot mv in a transaction!\n"); else mv(cwd, arg); }
+void runSave(char *arg) { save(root, arg); }
+void runReload(char *arg) { reload(root, arg); }
+void runQuit(char *arg) { quit(root); }
+void runBsave(char *arg) { bsave(root, arg); }
+void runBload(char *arg) { bload(root, &cwd, arg); }
+void runConvert(char *arg) { convert(arg); }
+void runMap(char *arg) { map(root, &cwd, arg); }
+void runJournal(char *arg) { journal(root, &cwd, arg); }
+void runBgsave(char *arg) { bgsave(root, arg); }
+void runFind(char *arg) { find(cwd, arg); }
+void runDu(char *arg) { du(cwd, arg); }
+void runTruncate(char *arg) { truncateFile(cwd, arg); }
+void runDiff(char *arg) { diff(root, arg); }
+void runTree(char *arg) { tree(cwd, arg); }
+void runSnapshot(char *arg) { snapshot(root, &cwd, arg); }
+void runCompact(char *arg) { compact(root, &cwd, arg); }
+void runPathIndex(char *arg) { pathIndex(root, arg); }
+void runImport(char *arg) { import(cwd, arg); }
+void runBegin(char *arg) { begin(); }
+void runCommit(char *arg) { commit(root, cwd); }
+void runAbort(char *arg) { abortTransaction(); }
+void runStats(char *arg) { stats(arg); }
+void runColumns(char *arg) { columns(root, arg); }
+void runTrigrams(char *arg) { trigrams(root, arg); }
+
+// list of commands
+COMMAND commands[] = {
+	{"mkdir", runMkdir, 0}, {"rmdir", runRmdir, 0}, {"cd", runCd, 1}, {"ls", runLs, 1}, {"pwd", runPwd, 1},
+	{"creat", runCreat, 0}, {"rm", runRm, 0}, {"save", runSave, 1}, {"reload", runReload, 0},
+	{"quit", runQuit, 1}, {"bsave", runBsave, 1}, {"bload", runBload, 0}, {"convert", runConvert, 1},
+	{"map", runMap, 0}, {"journal", runJournal, 0}, {"bgsave", runBgsave, 1}, {"find", runFind, 0},
+	{"du", runDu, 0}, {"tree", runTree, 0}, {"truncate", runTruncate, 0}, {"diff", runDiff, 1},
+	{"snapshot", runSnapshot, 1}, {"compact", runCompact, 0},
+	{"pathindex", runPathIndex, 0}, {"import", runImport, 0},
+	{"begin", runBegin, 0}, {"commit", runCommit, 0}, {"abort", runAbort, 0},
+	{"stats", runStats, 1}, {"mv", runMv, 0}, {"columns", runColumns, 0},
+	{"trigrams", runTrigrams, 0}, {0, 0, 0}
+};
+
+
+// FNV-1a hash of a command name
+unsigned int hashCommand(char *command) {
+	unsigned int hash = 2166136261u;
+	while (*command) {
+		hash ^= (unsigned char)*command++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// fills the command hash table (linear probing) so lookups don't compare against every name
+void buildCommandTable() {
+	for (int i = 0; commands[i].name; i++) {
+		unsigned int slot = hashCommand(commands[i].name) & (COMMANDTABLESIZE - 1);
+		while (commandTable[slot] != 0) slot = (slot + 1) & (COMMANDTABLESIZE - 1);
+		commandTable[slot] = i + 1;
+	}
+}
 
 // finds and returns the index of a command in the commands array
 int findCommand(char *command) {
-	int i = 0;
-	// while we haven't reached the end of commands
-	while(cmd[i]) {
-		// if the user entered command == the current command - return the index
-		if (strcmp(command, cmd[i]) == 0)
-			return i;
-		i++;
+	unsigned int slot = hashCommand(command) & (COMMANDTABLESIZE - 1);
+	// probe until an empty slot
+	while (commandTable[slot] != 0) {
+		// if the user entered command == the command in this slot - return the index
+		if (strcmp(command, commands[commandTable[slot] - 1].name) == 0)
+			return commandTable[slot] - 1;
+		slot = (slot + 1) & (COMMANDTABLESIZE - 1);
 	}
 	return -1;
 }
 
+// parses one line of input ("command arg\n") and runs it
+// the lookup and the command are timed for stats (the end of the lookup is the start of the command)
+void runLine(char *line) {
+	uint64_t start = statsNow();
+
+	// parse user input
+	char *command = strtok(line, " \r\n"); // parse the command
+	if (command == NULL) return; // blank line
+	char *arg = strtok(NULL, "\r\n"); // parse the arg (the rest of the line)
+
+	// find the command
+	int commandIndex = findCommand(command);
+	uint64_t found = statsNow();
+	statsPhase(PHASEDISPATCH, found - start);
+
+	// run the command
+	if (commandIndex < 0) printf("Command not found!\n"); // default error message
+	else if (!commands[commandIndex].inSnapshot && snapshotView()) printf("Read-only snapshot: %s\n", snapshotView());
+	else {
+		commands[commandIndex].run(arg);
+		statsCommand(commandIndex, commands[commandIndex].name, statsNow() - found);
+	}
+}
+
 //initializes the root node of the file tree and current working directory
-int initialize() {
-	root = (NODE *)malloc(sizeof(NODE)); // allocate space for a node
-	strcpy(root->name, "/"); // set the name of the item to "/" for root directory
-	root->parent = root; // set it's parent to itself
-	root->sibling = 0; // initialize sibling and child to 0
-	root->child = 0;
-	root->type = 'D'; // type = directory
+void initialize() {
+	root = newRootNode(); // allocate a directory named "/" that is its own parent
 	cwd = root; // save it as the current working directory
-	printf("Filesystem initialized!\n");
+	buildCommandTable();
+}
+
+// seconds since start
+double secondsSince(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// prints the batch throughput (registered with atexit, so quit reports it too)
+void reportBatch() {
+	if (!batchRunning) return;
+	batchRunning = 0;
+	double seconds = secondsSince(&batchStart);
+	fflush(stdout);
+	fprintf(stderr, "%ld commands in %.3f s (%.0f commands/s)\n", commandCount, seconds,
+		seconds > 0 ? commandCount / seconds : 0.0);
+}
+
+// runs every line of infile without prompts
+// input is read in large blocks and split into lines in place, and stdout is fully buffered
+void runBatch(FILE *infile) {
+	size_t capacity = BATCHBUFFERSIZE;
+	size_t length = 0; // bytes in the buffer (an unfinished line at the front after each block)
+	char *buffer = malloc(capacity + 1);
+	if (buffer == NULL) {
+		printf("Error: memory allocation failed!\n");
+		return;
+	}
+	setvbuf(stdout, NULL, _IOFBF, BATCHBUFFERSIZE);
+	clock_gettime(CLOCK_MONOTONIC, &batchStart);
+	batchRunning = 1;
+	atexit(reportBatch);
+
+	while (1) {
+		// a line longer than the buffer - grow it
+		if (length == capacity) {
+			char *newBuffer = realloc(buffer, 2 * capacity + 1);
+			if (newBuffer == NULL) {
+				printf("Error: memory allocation failed!\n");
+				break;
+			}
+			buffer = newBuffer;
+			capacity *= 2;
+		}
+
+		// fill the rest of the buffer
+		size_t bytesRead = fread(buffer + length, 1, capacity - length, infile);
+		length += bytesRead;
+		int atEnd = (bytesRead == 0);
+		if (atEnd && length > 0) buffer[length++] = '\n'; // last line without a newline
+
+		// run every complete line
+		char *line = buffer;
+		char *end;
+		while ((end = memchr(line, '\n', buffer + length - line)) != NULL) {
+			*end = 0;
+			// '#' starts a comment line in scripts
+			if (line[0] != '#') {
+				runLine(line);
+				commandCount++;
+				// the journal, background saves and compaction get a turn between commands, like at the prompt
+				journalIdle();
+				bgsaveIdle();
+				compactIdle(root, &cwd);
+			}
+			line = end + 1;
+		}
+
+		// keep the unfinished line for the next block
+		length = buffer + length - line;
+		memmove(buffer, line, length);
+		if (atEnd) break;
+	}
+	free(buffer);
+
+	// end of script: make the journal durable and let a background save finish
+	bgsaveWait();
+	journalClose();
+	reportBatch();
+}
+
+// body of a -j thread: replays a whole script in its own session and keeps its command latencies
+void *replayThread(void *arg) {
+	REPLAYTHREAD *thread = arg;
+	SESSION *session = sessionOpen(root, stdout);
+	if (session == NULL) return NULL;
+
+	char *line = NULL;      // grows to the longest line, like the batch buffer
+	size_t lineCapacity = 0;
+	char *next = thread->replay->script;
+	char *end = next + thread->replay->length;
+	while (next < end) {
+		// copy the line out (sessionRun splits it in place and the script is shared)
+		char *newline = memchr(next, '\n', end - next);
+		size_t length = (newline ? newline : end) - next;
+		if (length + 1 > lineCapacity) {
+			size_t newCapacity = lineCapacity ? lineCapacity : MAXLINELENGTH;
+			while (newCapacity < length + 1) newCapacity *= 2;
+			char *newLine = realloc(line, newCapacity);
+			if (newLine == NULL) {
+				fprintf(session->out, "Error: memory allocation failed!\n");
+				break;
+			}
+			line = newLine;
+			lineCapacity = newCapacity;
+		}
+		memcpy(line, next, length);
+		line[length] = 0;
+		next = newline ? newline + 1 : end;
+
+		// '#' starts a comment line in scripts
+		if (line[0] != '#') sessionRun(session, line);
+	}
+	free(line);
+	thread->latency = session->latency;
+	sessionClose(session);
+	return NULL;
 }
 
+// loads the script of a -j option. returns 0 if it couldn't be read
+int loadReplay(REPLAY *replay) {
+	FILE *infile = strcmp(replay->fileName, "-") == 0 ? stdin : fopen(replay->fileName, "r");
+	if (infile == NULL) {
+		printf("Failed to open file: %s\n", replay->fileName);
+		return 0;
+	}
+	FILE *scriptStream = open_memstream(&replay->script, &replay->length);
+	char *block = malloc(BATCHBUFFERSIZE);
+	if (scriptStream == NULL || block == NULL) {
+		printf("Error: memory allocation failed!\n");
+		return 0;
+	}
+	size_t bytesRead;
+	while ((bytesRead = fread(block, 1, BATCHBUFFERSIZE, infile)) > 0) fwrite(block, 1, bytesRead, scriptStream);
+	fclose(scriptStream);
+	free(block);
+	if (infile != stdin) fclose(infile);
+	return 1;
+}
 
-int main() {
+// replays every -j script at once, each on its own threads with a session per thread, and prints
+// the combined throughput and command latencies on stderr
+void runReplays() {
+	int threadCount = 0;
+	for (int i = 0; i < replayCount; i++) {
+		if (!loadReplay(&replays[i])) return;
+		threadCount += replays[i].threadCount;
+	}
+	REPLAYTHREAD *threadData = calloc(threadCount, sizeof(REPLAYTHREAD));
+	if (threadData == NULL) {
+		printf("Error: memory allocation failed!\n");
+		return;
+	}
+	for (int i = 0, next = 0; i < replayCount; i++) {
+		for (int j = 0; j < replays[i].threadCount; j++) threadData[next++].replay = &replays[i];
+	}
+
+	setvbuf(stdout, NULL, _IOFBF, BATCHBUFFERSIZE);
+	pthread_t threads[MAXTHREADS];
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < threadCount; i++) {
+		if (pthread_create(&threads[i], NULL, replayThread, &threadData[i]) != 0) {
+			printf("Failed to start thread %d\n", i);
+			threadCount = i;
+			break;
+		}
+	}
+	HISTOGRAM latency;
+	memset(&latency, 0, sizeof(latency));
+	for (int i = 0; i < threadCount; i++) {
+		pthread_join(threads[i], NULL);
+		histogramMerge(&latency, &threadData[i].latency);
+	}
+	double seconds = secondsSince(&start);
+
+	fflush(stdout);
+	fprintf(stderr, "%lu commands on %d threads in %.3f s (%.0f commands/s, p50 %.1f us, p99 %.1f us)\n",
+		(unsigned long)latency.count, threadCount, seconds, seconds > 0 ? latency.count / seconds : 0.0,
+		histogramPercentile(&latency, 0.5) / 1e3, histogramPercentile(&latency, 0.99) / 1e3);
+	free(threadData);
+	for (int i = 0; i < replayCount; i++) free(replays[i].script);
+
+	// the threads journaled their changes - make them durable
+	journalClose();
+}
+
+
+/*
+    lab1_Curdi [-b scriptfile] [-j threads scriptfile]... [-s port]
+    With no args, run the interactive prompt. With -b, run the commands in scriptfile ("-" for stdin)
+    in batch mode: no prompts, buffered output, and a throughput report on stderr at the end.
+    With -j, start that many threads on the shared tree, each replaying scriptfile in its own
+    session (own cwd, relative or absolute paths) - mkdir, rmdir, cd, ls [pathname], pwd, du,
+    creat, rm, save, stats (the session's latencies), and pin/unpin (read a snapshot taken at pin
+    while the other sessions go on writing - see concurrent.h). -j may be given once per script,
+    and all the scripts are replayed at the same time. With -s, serve the tree over TCP on port (see server.h for the line protocol)
+    until SIGINT/SIGTERM, with a session per connection. -b runs first, so it can build the tree
+    the threads or clients work on.
+*/
+int main(int argc, char *argv[]) {
 	// initialize the file system
 	initialize();
+
+	// parse the options
+	char *batchFileName = NULL, *port = NULL;
+	int threadCount = 0, badOption = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) batchFileName = argv[++i];
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) port = argv[++i];
+		else if (strcmp(argv[i], "-j") == 0 && i + 2 < argc && replayCount < MAXREPLAYS) {
+			REPLAY *replay = &replays[replayCount++];
+			replay->threadCount = atoi(argv[++i]);
+			replay->fileName = argv[++i];
+			if (replay->threadCount <= 0) badOption = 1;
+			threadCount += replay->threadCount;
+		}
+		else badOption = 1;
+	}
+	if (badOption || threadCount > MAXTHREADS) {
+		printf("Usage: %s [-b scriptfile] [-j threads scriptfile]... [-s port] (at most %d threads and %d scripts)\n",
+			argv[0], MAXTHREADS, MAXREPLAYS);
+		return 1;
+	}
+
+	// batch mode
+	if (batchFileName != NULL) {
+		FILE *infile = strcmp(batchFileName, "-") == 0 ? stdin : fopen(batchFileName, "r");
+		if (infile == NULL) {
+			printf("Failed to open file: %s\n", batchFileName);
+			return 1;
+		}
+		runBatch(infile);
+	}
+	// concurrent replay
+	if (replayCount > 0) runReplays();
+	// network service
+	if (port != NULL) {
+		int status = runServer(root, port);
+		journalClose();
+		return status;
+	}
+	if (batchFileName != NULL || replayCount > 0) return 0;
+
+	printf("Filesystem initialized!\n");
 	char userInput[MAXLINELENGTH];
-	char *command;
-	int commandIndex;
-	char *arg;
-	
+
 	// program loop
 	while(1) {
+		// let the journal commit and checkpoint between commands, report finished background saves,
+		// and compact if the tree has drifted
+		journalIdle();
+		bgsaveIdle();
+		compactIdle(root, &cwd);
+
 		// get user input
 		printf("Enter command: ");
-		fgets(userInput, sizeof(userInput), stdin);
-
-		// parse user input ("command arg\n")
-		command = strtok(userInput, " "); // parse the command
-		// if the user did not enter an arg, we need to remove the newline char from the command
-		int newLineIndex = strcspn(command, "\n"); // get the index of the newline
-		command[newLineIndex] = 0; // replace the newline with null 
-		arg = strtok(NULL, "\n"); // parse the arg
-		//printf("command: %s, arg: %s\n", command, arg);
-		
-		// find the command
-		commandIndex = findCommand(command);
-
-		// run the command
-		switch(commandIndex) {
-			case 0: // mkdir
-				mkdir(cwd, arg);
-				break;
-			case 1: // rmdir
-				rmdir(cwd, arg);
-				break;
-			case 2: // cd
-				cd(&cwd, arg);
-				break;
-			case 3: // ls
-				ls(cwd);
-				break;
-			case 4: // pwd
-				pwd(cwd);
-				break;
-			case 5: // creat
-				creat(cwd, arg);
-				break;
-			case 6: // rm
-				rm(cwd, arg);
-				break;
-			case 7: // save
-				save(root, arg);
-				break;
-			case 8: // reload
-				reload(root, arg);
-				break;
-			case 9: // quit
-				quit(root);
-				break;
-			default: // default error message
-				printf("Command not found!\n");
+		if (fgets(userInput, sizeof(userInput), stdin) == NULL) {
+			// end of input (ctrl-D) - same as quit
+			printf("\n");
+			quit(root);
 		}
+
+		// parse and run it
+		runLine(userInput);
 	}
 }
@@ -0,0 +1,232 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "lazy.h"
+#include "snapshot.h"
+#include "cow.h"
+#include "pathindex.h"
+#include "stats.h"
+#include "columns.h"
+#include "trigram.h"
+
+static int snapshotFd = -1;         // the snapshot being loaded (-1 if there is none)
+static char *snapshotName = NULL;
+static SNAPSHOTHEADER header;
+static long lazyCount = 0;          // NODELAZY directories alive
+
+// sessions can expand directories from many threads
+static pthread_mutex_t lazyLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// reads length bytes at offset. returns 0 on success
+static int readAt(int fd, void *buffer, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t bytesRead = pread(fd, buffer, length, offset);
+        if (bytesRead <= 0) return -1;
+        buffer = (char*)buffer + bytesRead;
+        length -= bytesRead;
+        offset += bytesRead;
+    }
+    return 0;
+}
+
+// the offset of entry index in the snapshot
+static uint64_t entryOffset(uint64_t index) {
+    return sizeof(SNAPSHOTHEADER) + index * sizeof(SNAPSHOTENTRY);
+}
+
+// marks node lazy if the entry says it has children to read
+static void markLazy(NODE *node, SNAPSHOTENTRY *entry, uint32_t index) {
+    node->dirs = entry->dirs;
+    node->files = entry->files;
+    if (entry->childCount > 0) {
+        node->flags |= NODELAZY;
+        node->lazyEntry = index;
+        __atomic_add_fetch(&lazyCount, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// reads dir's children and links them under it (lazyLock held). returns 0 on success
+static int readChildren(NODE *dir) {
+    SNAPSHOTENTRY entry, *children = NULL;
+    char *names = NULL;
+    NODE *first = NULL, *last = NULL;
+    uint32_t index = dir->lazyEntry;
+    int status = -1;
+
+    // the directory's entry says where its children are
+    if (readAt(snapshotFd, &entry, sizeof(entry), entryOffset(index)) != 0 || entry.type != 'D'
+            || entry.childCount == 0 || entry.firstChild <= index
+            || (uint64_t)entry.firstChild + entry.childCount > header.nodeCount) {
+        printf("Corrupt snapshot: %s\n", snapshotName);
+        return -1;
+    }
+    children = malloc(entry.childCount * sizeof(SNAPSHOTENTRY));
+    if (children == NULL) goto nomem;
+    if (readAt(snapshotFd, children, entry.childCount * sizeof(SNAPSHOTENTRY), entryOffset(entry.firstChild)) != 0) goto corrupt;
+
+    // their names are one run of the blob, in the same order
+    uint64_t nameStart = children[0].nameOffset;
+    uint64_t nameEnd = (uint64_t)children[entry.childCount - 1].nameOffset + children[entry.childCount - 1].nameLength;
+    if (nameEnd < nameStart || nameEnd > header.nameBytes) goto corrupt;
+    names = malloc(nameEnd - nameStart + 1);
+    if (names == NULL) goto nomem;
+    if (readAt(snapshotFd, names, nameEnd - nameStart, entryOffset(header.nodeCount) + nameStart) != 0) goto corrupt;
+
+    // build the children as an unlinked list first, so a bad entry leaves dir as it was
+    char name[sizeof(dir->name)];
+    for (uint32_t i = 0; i < entry.childCount; i++) {
+        SNAPSHOTENTRY *child = &children[i];
+        if (child->parent != index || (child->type != 'D' && child->type != 'F')
+                || child->nameLength == 0 || child->nameLength >= sizeof(name)
+                || child->nameOffset < nameStart || (uint64_t)child->nameOffset + child->nameLength > nameEnd) {
+            goto corrupt;
+        }
+        memcpy(name, names + (child->nameOffset - nameStart), child->nameLength);
+        name[child->nameLength] = 0;
+
+        NODE *node = newNode(dir, name, child->type);
+        if (node == NULL) goto nomem;
+        if (last == NULL) first = node;
+        else last->sibling = node;
+        last = node;
+        if (node->type == 'D') markLazy(node, child, entry.firstChild + i);
+    }
+
+    // link them
+    preserveLinks(dir);
+    columnsInvalidate();
+    dir->child = first;
+    first = NULL;
+    if (pathIndexCovers(dir)) {
+        for (NODE *pCur = dir->child; pCur != NULL; pCur = pCur->sibling) pathIndexAdd(pCur);
+    }
+    if (trigramCovers(dir)) {
+        for (NODE *pCur = dir->child; pCur != NULL; pCur = pCur->sibling) trigramAdd(pCur);
+    }
+    statsCount(COUNTBYTESLOADED, (1 + entry.childCount) * sizeof(SNAPSHOTENTRY) + nameEnd - nameStart);
+    status = 0;
+    goto done;
+
+corrupt:
+    printf("Corrupt snapshot: %s\n", snapshotName);
+    goto done;
+nomem:
+    printf("Error: memory allocation failed!\n");
+done:
+    // free what was built but not linked (lazy children were counted, freeNode counts them off)
+    while (first != NULL) {
+        NODE *next = first->sibling;
+        freeNode(first);
+        first = next;
+    }
+    free(children);
+    free(names);
+    return status;
+}
+
+
+// opens fileName and reads the root's children into a new tree. returns its root, or NULL on
+// failure (message printed)
+NODE *lazyOpen(char *fileName) {
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        printf("Failed to open file: %s\n", fileName);
+        return NULL;
+    }
+
+    // check the header and the root's entry
+    SNAPSHOTHEADER newHeader;
+    SNAPSHOTENTRY rootEntry;
+    off_t fileSize = lseek(fd, 0, SEEK_END);
+    if (readAt(fd, &newHeader, sizeof(newHeader), 0) != 0
+            || memcmp(newHeader.magic, SNAPSHOTMAGIC, sizeof(newHeader.magic)) != 0) {
+        printf("Not a snapshot file: %s\n", fileName);
+        close(fd);
+        return NULL;
+    }
+    if (newHeader.version != SNAPSHOTVERSION) {
+        printf("Snapshot version %u has no directory index (bsave it again to use -l): %s\n", newHeader.version, fileName);
+        close(fd);
+        return NULL;
+    }
+    if (newHeader.nodeCount == 0
+            || (uint64_t)fileSize != sizeof(SNAPSHOTHEADER) + (uint64_t)newHeader.nodeCount * sizeof(SNAPSHOTENTRY) + newHeader.nameBytes
+            || readAt(fd, &rootEntry, sizeof(rootEntry), sizeof(SNAPSHOTHEADER)) != 0 || rootEntry.type != 'D') {
+        printf("Corrupt snapshot: %s\n", fileName);
+        close(fd);
+        return NULL;
+    }
+    char *newName = strdup(fileName);
+    NODE *root = newRootNode();
+    if (newName == NULL || root == NULL) {
+        printf("Error: memory allocation failed!\n");
+        free(newName);
+        free(root);
+        close(fd);
+        return NULL;
+    }
+
+    // switch to the new file (directories from the old one are freed with the tree bload replaces)
+    pthread_mutex_lock(&lazyLock);
+    if (snapshotFd >= 0) close(snapshotFd);
+    free(snapshotName);
+    snapshotFd = fd;
+    snapshotName = newName;
+    header = newHeader;
+    markLazy(root, &rootEntry, 0);
+    pthread_mutex_unlock(&lazyLock);
+
+    // the top level
+    lazyExpand(root);
+    return root;
+}
+
+// reads dir's children from the snapshot if it is NODELAZY (safe to call from any thread)
+// the flag is cleared only once the children are linked, so a thread that sees it clear sees them
+void lazyExpand(NODE *dir) {
+    if (!(__atomic_load_n(&dir->flags, __ATOMIC_ACQUIRE) & NODELAZY)) return;
+
+    pthread_mutex_lock(&lazyLock);
+    if (dir->flags & NODELAZY) {
+        // a directory that can't be read is left empty, and what it held comes off the totals
+        if (readChildren(dir) != 0) updateAggregates(dir, -dir->dirs, -dir->files, 0);
+        __atomic_fetch_and(&dir->flags, (unsigned char)~NODELAZY, __ATOMIC_RELEASE);
+        __atomic_sub_fetch(&lazyCount, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&lazyLock);
+}
+
+// reads everything below top that hasn't been read yet (free when nothing is lazy)
+// each directory is expanded as the DFS reaches it, so its children are there to descend into
+void lazyExpandAll(NODE *top) {
+    if (lazyNodes() == 0) return;
+
+    lazyExpand(top);
+    NODE *pCur = top->child;
+    while (pCur != NULL) {
+        lazyExpand(pCur);
+
+        // go to child
+        if (pCur->child != NULL) {
+            pCur = pCur->child;
+            continue;
+        }
+
+        // climb until we find a node with a sibling left to visit
+        while (pCur->sibling == NULL && pCur->parent != top) pCur = pCur->parent;
+
+        // shift
+        pCur = pCur->sibling;
+    }
+}
+
+// the number of NODELAZY directories in memory
+long lazyNodes() {
+    return __atomic_load_n(&lazyCount, __ATOMIC_RELAXED);
+}
+
+// helper for freeNode(). counts off node if it is NODELAZY
+void lazyRelease(NODE *node) {
+    if (node->flags & NODELAZY) __atomic_sub_fetch(&lazyCount, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,29 @@
+#ifndef __LAZY_H__
+#define __LAZY_H__
+
+#include "node.h"
+
+// lazy loading of a binary snapshot (bload -l)
+// a version 2 snapshot keeps every directory's children together and its entry says where they
+// are (see snapshot.h), so a directory can be read on its own with two preads. bload -l only reads
+// the root's children: every directory below them starts out NODELAZY, with its entry index in
+// lazyEntry and its aggregates taken from the entry, and its children are read the first time
+// anything looks at them - path resolution, cd, ls, creates and removes call lazyExpand on a
+// directory before scanning its children, and whole-tree walks (save, bsave, find, tree, ...)
+// call lazyExpandAll first. the snapshot stays open until the next bload -l, and isn't checksummed
+// (that would mean reading all of it) - every entry used is range checked instead
+
+
+// opens fileName and reads the root's children into a new tree. returns its root, or NULL on
+// failure (message printed)
+NODE *lazyOpen(char *fileName);
+// reads dir's children from the snapshot if it is NODELAZY (safe to call from any thread)
+void lazyExpand(NODE *dir);
+// reads everything below top that hasn't been read yet
+void lazyExpandAll(NODE *top);
+// the number of NODELAZY directories in memory
+long lazyNodes();
+// helper for freeNode(). counts off node if it is NODELAZY
+void lazyRelease(NODE *node);
+
+#endif /* __LAZY_H__ */
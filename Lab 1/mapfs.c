@@ -0,0 +1,755 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mapfs.h"
+#include "journal.h"
+#include "lazy.h"
+
+// returned by the path helpers when a path doesn't resolve (0 is the root)
+#define MAPNOTFOUND UINT32_MAX
+
+// the open namespace (mapBase == NULL when nothing is open)
+static int mapFd = -1;
+static char *mapBase = NULL;
+static size_t mapSize = 0;
+static char *mapFileName = NULL;
+static uint32_t mapCwd = 0;
+
+// output side of compaction and save: appends records in DFS order to a new file
+// the directories on the path to the last record are kept on a stack with their last child
+typedef struct mapBuilder {
+    int fd;
+    char *base;
+    size_t size;
+    uint64_t count;
+    struct { uint32_t index, lastChild; } *stack;
+    int depth, stackCapacity;
+} MAPBUILDER;
+
+
+static MAPHEADER *mapHeader() {
+    return (MAPHEADER*)mapBase;
+}
+
+static MAPNODE *mapRecord(uint32_t index) {
+    return (MAPNODE*)(mapBase + MAPHEADERSIZE) + index;
+}
+
+// size of a file with room for capacity records
+static size_t mapFileSize(uint64_t capacity) {
+    return MAPHEADERSIZE + capacity * sizeof(MAPNODE);
+}
+
+// doubles the capacity of the open file. returns 0 on success, -1 on failure (message printed)
+static int mapGrow() {
+    uint64_t newCapacity = mapHeader()->capacity * 2;
+    size_t newSize = mapFileSize(newCapacity);
+
+    // extend the file, then map it again at its new size
+    if (ftruncate(mapFd, newSize) != 0) {
+        printf("Failed to grow file: %s\n", mapFileName);
+        return -1;
+    }
+    char *newBase = mmap(NULL, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, mapFd, 0);
+    if (newBase == MAP_FAILED) {
+        printf("Failed to map file: %s\n", mapFileName);
+        return -1;
+    }
+    munmap(mapBase, mapSize);
+    mapBase = newBase;
+    mapSize = newSize;
+    mapHeader()->capacity = newCapacity;
+    return 0;
+}
+
+// appends an unlinked record to the append region. returns its index, or MAPNOTFOUND on failure
+static uint32_t mapAppend(uint32_t parent, char *name, char type) {
+    if (mapHeader()->recordCount == mapHeader()->capacity && mapGrow() != 0) return MAPNOTFOUND;
+    if (mapHeader()->recordCount >= MAPNOTFOUND) {
+        printf("Namespace is full, run map compact\n");
+        return MAPNOTFOUND;
+    }
+
+    uint32_t index = mapHeader()->recordCount++;
+    MAPNODE *record = mapRecord(index);
+    memset(record, 0, sizeof(MAPNODE));
+    strcpy(record->name, name);
+    record->type = type;
+    record->parent = parent;
+    mapHeader()->liveCount++;
+    return index;
+}
+
+// finds a child of dir by name. returns its index, or MAPNOTFOUND
+static uint32_t mapFindChild(uint32_t dir, char *name) {
+    for (uint32_t index = mapRecord(dir)->child; index != 0; index = mapRecord(index)->sibling) {
+        if (strcmp(mapRecord(index)->name, name) == 0) return index;
+    }
+    return MAPNOTFOUND;
+}
+
+// resolves a path (absolute, or relative to the map cwd) in place. returns its index, or MAPNOTFOUND
+// every component but the last has to be a directory
+static uint32_t mapResolve(char *path) {
+    uint32_t index = (path[0] == '/') ? 0 : mapCwd;
+    char *buffer = strdup(path);
+    if (buffer == NULL) return MAPNOTFOUND;
+
+    for (char *name = strtok(buffer, "/"); name != NULL; name = strtok(NULL, "/")) {
+        if (mapRecord(index)->type != 'D') {
+            index = MAPNOTFOUND;
+            break;
+        }
+        if (strcmp(name, ".") == 0) continue;
+        if (strcmp(name, "..") == 0) index = mapRecord(index)->parent;
+        else index = mapFindChild(index, name);
+        if (index == MAPNOTFOUND) break;
+    }
+
+    free(buffer);
+    return index;
+}
+
+// splits path into its parent directory and final name (path is modified, *name points into it)
+// returns the parent's index, or MAPNOTFOUND if it doesn't exist or isn't a directory
+static uint32_t mapResolveParent(char *path, char **name) {
+    // strip trailing slashes
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') path[--length] = 0;
+
+    char *slash = strrchr(path, '/');
+    uint32_t parent;
+    if (slash == NULL) {
+        // a plain name lives in the cwd
+        *name = path;
+        parent = mapCwd;
+    }
+    else {
+        *name = slash + 1;
+        if (slash == path) parent = 0; // "/name"
+        else {
+            *slash = 0;
+            parent = mapResolve(path);
+        }
+    }
+    if (parent == MAPNOTFOUND || mapRecord(parent)->type != 'D') return MAPNOTFOUND;
+    return parent;
+}
+
+// mkdir/creat in the mapped namespace
+static void mapCreate(char *path, char type) {
+    char *name;
+    uint32_t parent = mapResolveParent(path, &name);
+    if (parent == MAPNOTFOUND) {
+        printf("Path does not exist!\n");
+        return;
+    }
+    if (name[0] == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        printf("Invalid name: %s\n", name);
+        return;
+    }
+    if (strlen(name) >= sizeof(mapRecord(0)->name)) {
+        printf("Name too long: %s\n", name);
+        return;
+    }
+
+    // scan for duplicates, remembering the last child
+    uint32_t last = 0;
+    for (uint32_t index = mapRecord(parent)->child; index != 0; index = mapRecord(index)->sibling) {
+        if (strcmp(mapRecord(index)->name, name) == 0) {
+            if (type == 'D') printf("DIR %s already exists!\n", name);
+            if (type == 'F') printf("File %s already exists!\n", name);
+            return;
+        }
+        last = index;
+    }
+
+    // append the record and link it in place (mapAppend may move the mapping, so no pointers are held)
+    uint32_t index = mapAppend(parent, name, type);
+    if (index == MAPNOTFOUND) return;
+    if (last == 0) mapRecord(parent)->child = index;
+    else mapRecord(last)->sibling = index;
+}
+
+// rmdir/rm in the mapped namespace
+static void mapRemove(char *path, char type) {
+    char *name;
+    uint32_t parent = mapResolveParent(path, &name);
+
+    // find the record and the one linking to it
+    uint32_t prev = 0, index = MAPNOTFOUND;
+    if (parent != MAPNOTFOUND) {
+        for (index = mapRecord(parent)->child; index != 0; index = mapRecord(index)->sibling) {
+            if (strcmp(mapRecord(index)->name, name) == 0) break;
+            prev = index;
+        }
+    }
+    if (index == MAPNOTFOUND || index == 0) {
+        if (type == 'D') printf("DIR %s does not exist!\n", name);
+        if (type == 'F') printf("File %s does not exist!\n", name);
+        return;
+    }
+
+    // error messages (same as removeFile)
+    MAPNODE *record = mapRecord(index);
+    if (type == 'D' && record->type != 'D') {
+        printf("Cannot remove %s (not a directory)!\n", name);
+        return;
+    }
+    if (type == 'D' && record->child != 0) {
+        printf("Cannot remove DIR %s (not empty)!\n", name);
+        return;
+    }
+    if (type == 'F' && record->type != 'F') {
+        printf("Cannot remove %s (not a file)!\n", name);
+        return;
+    }
+
+    // unlink and mark dead. the space is reclaimed by compaction
+    if (prev == 0) mapRecord(parent)->child = record->sibling;
+    else mapRecord(prev)->sibling = record->sibling;
+    record->type = 0;
+    mapHeader()->liveCount--;
+    if (mapCwd == index) mapCwd = parent;
+
+    // compact once the dead records outweigh the live ones
+    uint64_t dead = mapHeader()->recordCount - mapHeader()->liveCount;
+    if (dead >= MAPCOMPACTMIN && dead > mapHeader()->liveCount) mapCompact();
+}
+
+// writes the absolute path of a record into path (at least MAXLINELENGTH bytes)
+static void mapPath(uint32_t index, char *path, size_t size) {
+    // build the path backwards from the end of the buffer
+    char *start = path + size - 1;
+    *start = 0;
+    while (index != 0) {
+        MAPNODE *record = mapRecord(index);
+        size_t length = strlen(record->name);
+        if ((size_t)(start - path) < length + 1) break; // too deep for the buffer
+        start -= length;
+        memcpy(start, record->name, length);
+        *--start = '/';
+        index = record->parent;
+    }
+    if (*start == 0) *--start = '/';
+    memmove(path, start, strlen(start) + 1);
+}
+
+// starts a new namespace file with room for capacity records (just the root)
+static int builderStart(MAPBUILDER *builder, char *tempFileName, uint64_t capacity) {
+    if (capacity < MAPMINCAPACITY) capacity = MAPMINCAPACITY;
+    builder->size = mapFileSize(capacity);
+    builder->fd = open(tempFileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (builder->fd < 0) {
+        printf("Failed to open file: %s\n", tempFileName);
+        return -1;
+    }
+    builder->base = MAP_FAILED;
+    if (ftruncate(builder->fd, builder->size) == 0) {
+        builder->base = mmap(NULL, builder->size, PROT_READ | PROT_WRITE, MAP_SHARED, builder->fd, 0);
+    }
+    builder->stackCapacity = 64;
+    builder->stack = malloc(builder->stackCapacity * sizeof(*builder->stack));
+    if (builder->base == MAP_FAILED || builder->stack == NULL) {
+        printf("Failed to map file: %s\n", tempFileName);
+        if (builder->base != MAP_FAILED) munmap(builder->base, builder->size);
+        free(builder->stack);
+        close(builder->fd);
+        unlink(tempFileName);
+        return -1;
+    }
+
+    MAPHEADER *header = (MAPHEADER*)builder->base;
+    memcpy(header->magic, MAPMAGIC, sizeof(header->magic));
+    header->version = MAPVERSION;
+    header->capacity = capacity;
+
+    // the root
+    MAPNODE *root = (MAPNODE*)(builder->base + MAPHEADERSIZE);
+    strcpy(root->name, "/");
+    root->type = 'D';
+    builder->count = 1;
+    builder->depth = 0;
+    builder->stack[0].index = 0;
+    builder->stack[0].lastChild = 0;
+    return 0;
+}
+
+// appends a record under the directory on top of the stack. returns its index
+static uint32_t builderAdd(MAPBUILDER *builder, char *name, char type) {
+    uint32_t index = builder->count++;
+    uint32_t parent = builder->stack[builder->depth].index;
+    MAPNODE *records = (MAPNODE*)(builder->base + MAPHEADERSIZE);
+
+    strcpy(records[index].name, name);
+    records[index].type = type;
+    records[index].parent = parent;
+
+    // link after the parent's last child
+    if (builder->stack[builder->depth].lastChild == 0) records[parent].child = index;
+    else records[builder->stack[builder->depth].lastChild].sibling = index;
+    builder->stack[builder->depth].lastChild = index;
+    return index;
+}
+
+// opens a directory record for the records that follow. returns 0 on success, -1 on failure
+static int builderPush(MAPBUILDER *builder, uint32_t index) {
+    if (builder->depth + 1 == builder->stackCapacity) {
+        void *newStack = realloc(builder->stack, 2 * builder->stackCapacity * sizeof(*builder->stack));
+        if (newStack == NULL) return -1;
+        builder->stack = newStack;
+        builder->stackCapacity *= 2;
+    }
+    builder->depth++;
+    builder->stack[builder->depth].index = index;
+    builder->stack[builder->depth].lastChild = 0;
+    return 0;
+}
+
+// finishes the file and renames it over fileName. with ok == 0 the file is thrown away instead
+// returns 0 if the file was installed
+static int builderFinish(MAPBUILDER *builder, char *tempFileName, char *fileName, int ok) {
+    MAPHEADER *header = (MAPHEADER*)builder->base;
+    header->recordCount = builder->count;
+    header->liveCount = builder->count;
+    header->baseCount = builder->count;
+
+    // flush everything before the rename makes the file visible
+    if (ok && (msync(builder->base, builder->size, MS_SYNC) != 0 || fsync(builder->fd) != 0)) {
+        printf("Failed to write file: %s\n", tempFileName);
+        ok = 0;
+    }
+    munmap(builder->base, builder->size);
+    close(builder->fd);
+    free(builder->stack);
+    if (ok && rename(tempFileName, fileName) != 0) {
+        printf("Failed to write file: %s\n", fileName);
+        ok = 0;
+    }
+    if (!ok) unlink(tempFileName);
+    return ok ? 0 : -1;
+}
+
+// "<fileName>.tmp" (caller frees)
+static char *tempNameFor(char *fileName) {
+    char *tempFileName = malloc(strlen(fileName) + 5);
+    if (tempFileName != NULL) sprintf(tempFileName, "%s.tmp", fileName);
+    return tempFileName;
+}
+
+
+/*
+    map open filename | close | sync | compact | stat
+    map mkdir pathname | creat pathname | rmdir pathname | rm pathname
+    map ls [pathname] | cd [pathname] | pwd
+    map save filename | load
+    Work on a namespace file that is mmaped instead of loaded. Opening only reads the live
+    records once to check them, lookups run in place, and mutations append to the end of the file
+    (removed records are reclaimed by compaction). save writes the current tree to a namespace
+    file, and load replaces the current tree with the open namespace.
+*/
+void map(NODE *root, NODE **cwd, char *args) {
+    // parse the subcommand and its arg
+    char *subcommand = args ? strtok(args, " ") : NULL;
+    char *arg = subcommand ? strtok(NULL, "") : NULL;
+    if (subcommand == NULL) {
+        printf("Too few arguments!\n");
+        return;
+    }
+
+    // subcommands that don't need an open namespace
+    if (strcmp(subcommand, "open") == 0) {
+        if (arg == NULL) printf("Too few arguments!\n");
+        else mapOpen(arg);
+        return;
+    }
+    if (strcmp(subcommand, "save") == 0) {
+        if (arg == NULL) printf("Too few arguments!\n");
+        else mapSaveTree(root, arg);
+        return;
+    }
+    if (mapBase == NULL) {
+        printf("No namespace open!\n");
+        return;
+    }
+
+    // subcommands that take a path
+    if (arg == NULL && (strcmp(subcommand, "mkdir") == 0 || strcmp(subcommand, "creat") == 0
+            || strcmp(subcommand, "rmdir") == 0 || strcmp(subcommand, "rm") == 0)) {
+        printf("Too few arguments!\n");
+        return;
+    }
+    if (strcmp(subcommand, "mkdir") == 0) mapCreate(arg, 'D');
+    else if (strcmp(subcommand, "creat") == 0) mapCreate(arg, 'F');
+    else if (strcmp(subcommand, "rmdir") == 0) mapRemove(arg, 'D');
+    else if (strcmp(subcommand, "rm") == 0) mapRemove(arg, 'F');
+    else if (strcmp(subcommand, "ls") == 0 || strcmp(subcommand, "cd") == 0) {
+        uint32_t index = arg ? mapResolve(arg) : 0;
+        if (index == MAPNOTFOUND) {
+            printf("No such file or directory: %s\n", arg);
+            return;
+        }
+        if (mapRecord(index)->type != 'D') {
+            printf("%s is a file, not a directory.\n", arg);
+            return;
+        }
+        if (subcommand[0] == 'c') {
+            mapCwd = index;
+            return;
+        }
+        if (arg == NULL) index = mapCwd;
+        for (index = mapRecord(index)->child; index != 0; index = mapRecord(index)->sibling) {
+            printf("%c %s\n", mapRecord(index)->type, mapRecord(index)->name);
+        }
+    }
+    else if (strcmp(subcommand, "pwd") == 0) {
+        char path[4 * MAXLINELENGTH];
+        mapPath(mapCwd, path, sizeof(path));
+        printf("%s\n", path);
+    }
+    else if (strcmp(subcommand, "stat") == 0) {
+        MAPHEADER *header = mapHeader();
+        printf("%s: %llu live, %llu dead, %llu in append region, capacity %llu (%zu bytes)\n", mapFileName,
+            (unsigned long long)header->liveCount, (unsigned long long)(header->recordCount - header->liveCount),
+            (unsigned long long)(header->recordCount - header->baseCount), (unsigned long long)header->capacity, mapSize);
+    }
+    else if (strcmp(subcommand, "sync") == 0) {
+        if (msync(mapBase, mapSize, MS_SYNC) != 0) printf("Failed to write file: %s\n", mapFileName);
+    }
+    else if (strcmp(subcommand, "compact") == 0) mapCompact();
+    else if (strcmp(subcommand, "close") == 0) mapClose();
+    else if (strcmp(subcommand, "load") == 0) {
+        NODE *newRoot = mapLoadTree();
+        if (newRoot == NULL) return;
+        replaceFileTree(root, newRoot);
+        *cwd = root;
+
+        // the new tree bypasses the journal, so checkpoint it instead
+        journalCheckpoint(root, 1);
+    }
+    else printf("Command not found!\n");
+}
+
+// checks the records reachable from the root of a mapped file: every link is in range, every
+// name is terminated, and the links form a tree (each record is reached once, from the directory
+// its parent link names), so lookups, ".." and the walks can trust them without checking again
+// returns 0 if the file is sound, -1 at the first bad record (message printed)
+static int mapValidate(char *base, char *fileName) {
+    MAPHEADER *header = (MAPHEADER*)base;
+    MAPNODE *records = (MAPNODE*)(base + MAPHEADERSIZE);
+    uint64_t count = header->recordCount;
+    uint8_t *seen = calloc(count / 8 + 1, 1);
+    if (seen == NULL) {
+        printf("Error: memory allocation failed!\n");
+        return -1;
+    }
+
+    // the root, then a DFS pre-order walk (same shape as mapCompact) checking each record it reaches
+    uint64_t bad = MAPNOTFOUND, live = 1;
+    if (records[0].type != 'D' || records[0].parent != 0 || records[0].sibling != 0
+            || memchr(records[0].name, 0, sizeof(records[0].name)) == NULL) bad = 0;
+    seen[0] = 1;
+    uint32_t dir = 0;
+    uint32_t index = (bad == 0) ? 0 : records[0].child;
+    while (index != 0) {
+        MAPNODE *record = &records[index];
+        if (index >= count || (seen[index / 8] & (1 << (index % 8))) || record->parent != dir
+                || (record->type != 'D' && record->type != 'F') || (record->type == 'F' && record->child != 0)
+                || record->name[0] == 0 || memchr(record->name, 0, sizeof(record->name)) == NULL) {
+            bad = index;
+            break;
+        }
+        seen[index / 8] |= 1 << (index % 8);
+        live++;
+
+        // descend into the subtree first
+        if (record->child != 0) {
+            dir = index;
+            index = record->child;
+            continue;
+        }
+
+        // climb until we find a record with a sibling left to visit
+        // (every record climbed through was checked on the way down)
+        while (records[index].sibling == 0 && records[index].parent != 0) {
+            index = dir;
+            dir = records[index].parent;
+        }
+
+        // shift
+        index = records[index].sibling;
+    }
+    free(seen);
+
+    if (bad != MAPNOTFOUND) {
+        printf("Corrupt namespace file (record %llu): %s\n", (unsigned long long)bad, fileName);
+        return -1;
+    }
+    if (live != header->liveCount) {
+        printf("Corrupt namespace file (%llu live records, header says %llu): %s\n", (unsigned long long)live,
+            (unsigned long long)header->liveCount, fileName);
+        return -1;
+    }
+    return 0;
+}
+
+// opens (or creates) a mapped namespace file. returns 0 on success, -1 on failure (message printed)
+// the live records are all checked once here (mapValidate) - a file that fails is refused
+int mapOpen(char *fileName) {
+    // only one namespace is open at a time
+    if (mapBase != NULL) mapClose();
+
+    int fd = open(fileName, O_RDWR | O_CREAT, 0644);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+        printf("Failed to open file: %s\n", fileName);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    // a new (empty) file gets a header and a root
+    int newFile = (fileStat.st_size == 0);
+    size_t size = newFile ? mapFileSize(MAPMINCAPACITY) : (size_t)fileStat.st_size;
+    if (newFile && ftruncate(fd, size) != 0) {
+        printf("Failed to grow file: %s\n", fileName);
+        close(fd);
+        return -1;
+    }
+    if (size < MAPHEADERSIZE + sizeof(MAPNODE)) {
+        printf("Not a namespace file: %s\n", fileName);
+        close(fd);
+        return -1;
+    }
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        printf("Failed to map file: %s\n", fileName);
+        close(fd);
+        return -1;
+    }
+
+    MAPHEADER *header = (MAPHEADER*)base;
+    if (newFile) {
+        memcpy(header->magic, MAPMAGIC, sizeof(header->magic));
+        header->version = MAPVERSION;
+        header->capacity = MAPMINCAPACITY;
+        header->recordCount = header->liveCount = header->baseCount = 1;
+        MAPNODE *root = (MAPNODE*)(base + MAPHEADERSIZE);
+        strcpy(root->name, "/");
+        root->type = 'D';
+    }
+    else if (memcmp(header->magic, MAPMAGIC, sizeof(header->magic)) != 0 || header->version != MAPVERSION
+            || header->capacity > (SIZE_MAX - MAPHEADERSIZE) / sizeof(MAPNODE) || mapFileSize(header->capacity) != size
+            || header->recordCount == 0 || header->recordCount > MAPNOTFOUND
+            || header->recordCount > header->capacity || header->liveCount > header->recordCount) {
+        printf("Not a namespace file: %s\n", fileName);
+        munmap(base, size);
+        close(fd);
+        return -1;
+    }
+    else if (mapValidate(base, fileName) != 0) {
+        munmap(base, size);
+        close(fd);
+        return -1;
+    }
+
+    mapFd = fd;
+    mapBase = base;
+    mapSize = size;
+    mapFileName = strdup(fileName);
+    mapCwd = 0;
+    return 0;
+}
+
+// unmaps the open namespace (after flushing it)
+void mapClose() {
+    if (mapBase == NULL) return;
+    msync(mapBase, mapSize, MS_SYNC);
+    munmap(mapBase, mapSize);
+    close(mapFd);
+    free(mapFileName);
+    mapBase = NULL;
+    mapFileName = NULL;
+    mapFd = -1;
+}
+
+// rewrites the live records of the open namespace in DFS order into a fresh file
+// the new file replaces the old one atomically, so a crash leaves one or the other intact
+int mapCompact() {
+    char *tempFileName = tempNameFor(mapFileName);
+    MAPBUILDER builder;
+    uint32_t newCwd = 0;
+    int ok = 1;
+
+    if (tempFileName == NULL || builderStart(&builder, tempFileName, mapHeader()->liveCount * 2) != 0) {
+        free(tempFileName);
+        return -1;
+    }
+
+    // DFS pre-order walk of the old records (same shape as saveFileTree)
+    uint32_t index = mapRecord(0)->child;
+    while (index != 0) {
+        MAPNODE *record = mapRecord(index);
+        uint32_t newIndex = builderAdd(&builder, record->name, record->type);
+        if (index == mapCwd) newCwd = newIndex;
+
+        // descend into the subtree first
+        if (record->child != 0) {
+            if (builderPush(&builder, newIndex) != 0) {
+                ok = 0;
+                break;
+            }
+            index = record->child;
+            continue;
+        }
+
+        // climb until we find a record with a sibling left to visit
+        while (mapRecord(index)->sibling == 0 && mapRecord(index)->parent != 0) {
+            index = mapRecord(index)->parent;
+            builder.depth--;
+        }
+
+        // shift
+        index = mapRecord(index)->sibling;
+    }
+
+    // swap the new file in
+    char *fileName = strdup(mapFileName);
+    if (builderFinish(&builder, tempFileName, fileName, ok) == 0) {
+        mapClose();
+        if (mapOpen(fileName) == 0) mapCwd = newCwd;
+    }
+    else ok = 0;
+
+    free(fileName);
+    free(tempFileName);
+    return ok ? 0 : -1;
+}
+
+// writes a heap tree to a new mapped namespace file
+int mapSaveTree(NODE *root, char *fileName) {
+    lazyExpandAll(root);
+
+    // size the file up front
+    uint64_t nodeCount = 1;
+    NODE *pCur = root->child;
+    while (pCur != NULL) {
+        nodeCount++;
+        if (pCur->child != NULL) {
+            pCur = pCur->child;
+            continue;
+        }
+        while (pCur->sibling == NULL && pCur->parent != root) pCur = pCur->parent;
+        pCur = pCur->sibling;
+    }
+    if (nodeCount >= MAPNOTFOUND) {
+        printf("Tree too large for a namespace file!\n");
+        return -1;
+    }
+
+    char *tempFileName = tempNameFor(fileName);
+    MAPBUILDER builder;
+    int ok = 1;
+    if (tempFileName == NULL || builderStart(&builder, tempFileName, nodeCount + nodeCount / 2) != 0) {
+        free(tempFileName);
+        return -1;
+    }
+
+    // DFS pre-order walk (same shape as saveFileTree)
+    pCur = root->child;
+    while (pCur != NULL) {
+        uint32_t index = builderAdd(&builder, pCur->name, pCur->type);
+
+        // descend into the subtree first
+        if (pCur->child != NULL) {
+            if (builderPush(&builder, index) != 0) {
+                ok = 0;
+                break;
+            }
+            pCur = pCur->child;
+            continue;
+        }
+
+        // climb until we find a node with a sibling left to visit
+        while (pCur->sibling == NULL && pCur->parent != root) {
+            pCur = pCur->parent;
+            builder.depth--;
+        }
+
+        // shift
+        pCur = pCur->sibling;
+    }
+
+    // the open namespace may be the file being replaced - reopen it on the new file
+    int reopen = (mapBase != NULL && strcmp(mapFileName, fileName) == 0);
+    if (reopen) mapClose();
+    ok = (builderFinish(&builder, tempFileName, fileName, ok) == 0);
+    if (reopen) mapOpen(fileName);
+
+    free(tempFileName);
+    return ok ? 0 : -1;
+}
+
+// builds a heap tree from the open namespace. returns its root, or NULL on failure (message printed)
+NODE *mapLoadTree() {
+    NODE *root = newRootNode();
+    NODE **stack = malloc(64 * sizeof(NODE*)); // the heap copy of each directory on the current path
+    int stackCapacity = 64, depth = 0;
+    if (root == NULL || stack == NULL) {
+        printf("Error: memory allocation failed!\n");
+        free(root);
+        free(stack);
+        return NULL;
+    }
+    stack[0] = root;
+    NODE *lastChild = NULL; // last node linked under stack[depth]
+
+    // DFS pre-order walk of the records
+    uint32_t index = mapRecord(0)->child;
+    while (index != 0) {
+        MAPNODE *record = mapRecord(index);
+        NODE *node = newNode(stack[depth], record->name, record->type);
+        if (node == NULL) {
+            printf("Error: memory allocation failed!\n");
+            freeFileTree(root);
+            free(stack);
+            return NULL;
+        }
+        if (lastChild == NULL) stack[depth]->child = node;
+        else lastChild->sibling = node;
+        lastChild = node;
+
+        // descend into the subtree first
+        if (record->child != 0) {
+            if (depth + 1 == stackCapacity) {
+                NODE **newStack = realloc(stack, 2 * stackCapacity * sizeof(NODE*));
+                if (newStack == NULL) {
+                    printf("Error: memory allocation failed!\n");
+                    freeFileTree(root);
+                    free(stack);
+                    return NULL;
+                }
+                stack = newStack;
+                stackCapacity *= 2;
+            }
+            stack[++depth] = node;
+            lastChild = NULL;
+            index = record->child;
+            continue;
+        }
+
+        // climb until we find a record with a sibling left to visit
+        // (the parent's heap copy becomes the last child of the level we climb back to)
+        while (mapRecord(index)->sibling == 0 && mapRecord(index)->parent != 0) {
+            index = mapRecord(index)->parent;
+            lastChild = stack[depth--];
+        }
+
+        // shift
+        index = mapRecord(index)->sibling;
+    }
+
+    free(stack);
+    computeAggregates(root);
+    return root;
+}
@@ -0,0 +1,50 @@
+#ifndef __MAPFS_H__
+#define __MAPFS_H__
+
+#include <stdint.h>
+#include "node.h"
+
+// memory mapped namespace file
+// header page | records (MAPNODE)
+// records refer to each other by index, so the file can be used in place from any address.
+// record 0 is the root, and index 0 doubles as "none" for child/sibling links
+#define MAPMAGIC "FFSM"
+#define MAPVERSION 1
+#define MAPHEADERSIZE 4096      // records start on the second page
+#define MAPMINCAPACITY 1024     // records allocated for a new file
+#define MAPCOMPACTMIN 4096      // dead records needed before a removal triggers compaction
+
+typedef struct mapHeader {
+	char     magic[4];          // MAPMAGIC
+	uint32_t version;           // MAPVERSION
+	uint64_t capacity;          // records the file has room for
+	uint64_t recordCount;       // records in use (live or dead). new records are appended here
+	uint64_t liveCount;         // records still linked into the tree
+	uint64_t baseCount;         // records written by the last compaction (the rest is the append region)
+} MAPHEADER;
+
+typedef struct mapNode {
+	char     name[64];          // node's name string
+	uint32_t parent;            // record indices (0 = none, the root is its own parent)
+	uint32_t child;
+	uint32_t sibling;
+	char     type;              // 'D', 'F', or 0 once removed
+	char     reserved[3];
+} MAPNODE;
+
+
+// main command function. runs "map <subcommand> [args]" against the mapped namespace
+void map(NODE *root, NODE **cwd, char *args);
+
+// opens (or creates) a mapped namespace file. returns 0 on success, -1 on failure (message printed)
+int mapOpen(char *fileName);
+// unmaps the open namespace (after flushing it)
+void mapClose();
+// rewrites the live records of the open namespace in DFS order into a fresh file
+int mapCompact();
+// writes a heap tree to a new mapped namespace file
+int mapSaveTree(NODE *root, char *fileName);
+// builds a heap tree from the open namespace. returns its root, or NULL on failure (message printed)
+NODE *mapLoadTree();
+
+#endif /* __MAPFS_H__ */
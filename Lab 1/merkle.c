@@ -0,0 +1,499 @@
+#define _GNU_SOURCE // copy_file_range
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "merkle.h"
+#include "snapshot.h"
+#include "lazy.h"
+
+// an unchanged subtree's lines in the last incremental save
+typedef struct chunk {
+    NODE *node;             // the directory (NULL for an empty slot)
+    uint64_t hash;          // its orderHash when it was written (the lines are in sibling order)
+    uint64_t pathHash;      // hash of its path (the lines hold full paths)
+    off_t offset;           // where its lines start
+    off_t length;
+} CHUNK;
+
+// a table of chunks, keyed by node address (open addressing, linear probing)
+typedef struct chunkTable {
+    CHUNK *chunks;
+    size_t capacity;        // power of 2
+    size_t count;
+} CHUNKTABLE;
+
+// the last incremental save, and what its file looked like right after it was written
+// (if the file has been touched since, nothing is reused)
+static char *lastSaveName = NULL;
+static struct stat lastSaveStat;
+static CHUNKTABLE lastSaveChunks;
+
+
+// murmur3's 64-bit finalizer
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+// 64-bit FNV-1a. pass the previous result as hash to continue, or 0 to start
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    if (hash == 0) hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// hash of one child as its parent sees it: type, name, and size (files) or hash (directories)
+// a child directory's hash must be fresh
+static uint64_t childHash(NODE *node) {
+    uint64_t hash = hashBytes(hashBytes(0, &node->type, 1), node->name, strlen(node->name));
+    uint64_t content = node->type == 'D' ? node->hash : node->size;
+    return mix64(hash ^ mix64(content + 1));
+}
+
+// returns the Merkle hash of dir's children, recomputing the stale directories below it
+// a directory is finished once all of its child directories are fresh, so the walk only goes
+// down stale directories (iterative, with a stack of the directories on the path)
+uint64_t subtreeHash(NODE *dir) {
+    if (!(dir->flags & NODEHASHSTALE)) return dir->hash;
+    lazyExpandAll(dir); // (a directory still in its snapshot is stale, so a fresh one has none below)
+
+    struct frame {
+        NODE *dir;
+        NODE *next;         // next child to look at
+    } *stack = malloc(64 * sizeof(struct frame));
+    int capacity = 64, depth = 0;
+    if (stack == NULL) {
+        printf("Error: memory allocation failed!\n");
+        return dir->hash;
+    }
+    stack[0].dir = dir;
+    stack[0].next = dir->child;
+
+    while (depth >= 0) {
+        struct frame *frame = &stack[depth];
+
+        // find the next stale child directory
+        NODE *pCur = frame->next;
+        while (pCur != NULL && !(pCur->type == 'D' && (pCur->flags & NODEHASHSTALE))) pCur = pCur->sibling;
+        if (pCur != NULL) {
+            // go to child
+            frame->next = pCur->sibling;
+            if (depth + 1 == capacity) {
+                struct frame *newStack = realloc(stack, 2 * capacity * sizeof(struct frame));
+                if (newStack == NULL) {
+                    printf("Error: memory allocation failed!\n");
+                    break;
+                }
+                stack = newStack;
+                capacity *= 2;
+            }
+            depth++;
+            stack[depth].dir = pCur;
+            stack[depth].next = pCur->child;
+            continue;
+        }
+
+        // every child is fresh - combine them (a sum, so sibling order doesn't matter), and chain
+        // them in order for orderHash (a child directory brings its own order along)
+        uint64_t hash = 0, orderHash = 0;
+        for (NODE *child = frame->dir->child; child != NULL; child = child->sibling) {
+            uint64_t one = childHash(child);
+            hash += one;
+            orderHash = mix64(orderHash + one + (child->type == 'D' ? child->orderHash : 0));
+        }
+        frame->dir->hash = hash;
+        frame->dir->orderHash = orderHash;
+        frame->dir->flags &= ~NODEHASHSTALE;
+        depth--;
+    }
+
+    free(stack);
+    return dir->hash;
+}
+
+// reads a save file or binary snapshot into a new tree. returns its root, or NULL on failure (message printed)
+static NODE *readTreeFile(char *fileName) {
+    if (isSnapshotFile(fileName)) return readSnapshot(fileName, NULL);
+
+    FILE *infile = fopen(fileName, "r");
+    if (infile == NULL) {
+        printf("Failed to open file: %s\n", fileName);
+        return NULL;
+    }
+    NODE *tree = newRootNode();
+    if (tree == NULL) printf("Error: memory allocation failed!\n");
+    else loadFileTree(tree, infile, 0); // the tree is empty, so the input is trusted like reload
+    fclose(infile);
+    return tree;
+}
+
+// qsort comparator for an array of NODE* by name
+static int compareNames(const void *a, const void *b) {
+    return strcmp((*(NODE**)a)->name, (*(NODE**)b)->name);
+}
+
+// fills *children with dir's children sorted by name (growing it as needed). returns the count, or -1
+static long sortedChildren(NODE *dir, NODE ***children, size_t *capacity) {
+    long count = 0;
+    for (NODE *pCur = dir->child; pCur != NULL; pCur = pCur->sibling) {
+        if (count == *capacity) {
+            size_t newCapacity = *capacity ? 2 * *capacity : 64;
+            NODE **newChildren = realloc(*children, newCapacity * sizeof(NODE*));
+            if (newChildren == NULL) return -1;
+            *children = newChildren;
+            *capacity = newCapacity;
+        }
+        (*children)[count++] = pCur;
+    }
+    qsort(*children, count, sizeof(NODE*), compareNames);
+    return count;
+}
+
+// prints "<mark> <type> <path>" for one difference
+static void printDifference(char mark, NODE *node) {
+    printf("%c %c ", mark, node->type);
+    writeAbsolutePath(stdout, node);
+}
+
+// prints the differences from tree from to tree to. returns how many there were
+// only directory pairs whose hashes differ are descended into (iteratively, with a stack of pairs)
+static long diffTrees(NODE *from, NODE *to) {
+    NODE **pairs = malloc(2 * 64 * sizeof(NODE*));
+    size_t pairCapacity = 64, pairCount = 0;
+    NODE **fromChildren = NULL, **toChildren = NULL;
+    size_t fromCapacity = 0, toCapacity = 0;
+    long differences = 0;
+    if (pairs == NULL) {
+        printf("Error: memory allocation failed!\n");
+        return 0;
+    }
+    pairs[0] = from;
+    pairs[1] = to;
+    pairCount = 1;
+
+    while (pairCount > 0) {
+        pairCount--;
+        NODE *fromDir = pairs[2 * pairCount], *toDir = pairs[2 * pairCount + 1];
+        if (subtreeHash(fromDir) == subtreeHash(toDir)) continue; // same contents all the way down
+
+        // match the children up by name
+        long fromCount = sortedChildren(fromDir, &fromChildren, &fromCapacity);
+        long toCount = sortedChildren(toDir, &toChildren, &toCapacity);
+        if (fromCount < 0 || toCount < 0) {
+            printf("Error: memory allocation failed!\n");
+            break;
+        }
+        long i = 0, j = 0;
+        while (i < fromCount || j < toCount) {
+            int order = (i == fromCount) ? 1 : (j == toCount) ? -1 : strcmp(fromChildren[i]->name, toChildren[j]->name);
+            if (order < 0) {
+                // only in from
+                printDifference('-', fromChildren[i++]);
+                differences++;
+                continue;
+            }
+            if (order > 0) {
+                // only in to
+                printDifference('+', toChildren[j++]);
+                differences++;
+                continue;
+            }
+
+            NODE *fromChild = fromChildren[i++], *toChild = toChildren[j++];
+            if (fromChild->type != toChild->type) {
+                // replaced by a node of the other type
+                printDifference('-', fromChild);
+                printDifference('+', toChild);
+                differences += 2;
+            }
+            else if (fromChild->type == 'F') {
+                if (fromChild->size != toChild->size) {
+                    printDifference('~', toChild);
+                    differences++;
+                }
+            }
+            else {
+                // compare the two directories later
+                if (pairCount == pairCapacity) {
+                    NODE **newPairs = realloc(pairs, 2 * 2 * pairCapacity * sizeof(NODE*));
+                    if (newPairs == NULL) {
+                        printf("Error: memory allocation failed!\n");
+                        continue;
+                    }
+                    pairs = newPairs;
+                    pairCapacity *= 2;
+                }
+                pairs[2 * pairCount] = fromChild;
+                pairs[2 * pairCount + 1] = toChild;
+                pairCount++;
+            }
+        }
+    }
+
+    free(pairs);
+    free(fromChildren);
+    free(toChildren);
+    return differences;
+}
+
+
+/*
+    diff filename [filename]
+    Print the differences between the tree saved in the first file and the current tree, or
+    the tree saved in the second file. Files may be save files or binary snapshots.
+    Each difference is a line "+ type path" (only in the second tree), "- type path" (only in
+    the first) or "~ F path" (the file's size differs). A directory that is only in one tree is
+    listed without its contents. Only subtrees whose hashes differ are compared, so the time
+    taken follows the size of the change.
+*/
+void diff(NODE *root, char *fileNames) {
+    // parse the file names
+    char *fromFileName = fileNames ? strtok(fileNames, " ") : NULL;
+    char *toFileName = fromFileName ? strtok(NULL, " ") : NULL;
+    if (fromFileName == NULL) {
+        printf("Too few arguments!\n");
+        return;
+    }
+
+    NODE *from = readTreeFile(fromFileName);
+    if (from == NULL) return;
+    NODE *to = toFileName ? readTreeFile(toFileName) : root;
+    if (to == NULL) {
+        freeFileTree(from);
+        return;
+    }
+
+    long differences = diffTrees(from, to);
+    printf("%ld difference%s\n", differences, differences == 1 ? "" : "s");
+
+    freeFileTree(from);
+    if (to != root) freeFileTree(to);
+}
+
+
+// finds the slot for node in table (its chunk, or the empty slot where it would go)
+static CHUNK *findChunk(CHUNKTABLE *table, NODE *node) {
+    size_t slot = mix64((uintptr_t)node) & (table->capacity - 1);
+    while (table->chunks[slot].node != NULL && table->chunks[slot].node != node) slot = (slot + 1) & (table->capacity - 1);
+    return &table->chunks[slot];
+}
+
+// adds a chunk to table (kept at most half full). returns -1 if allocation failed
+static int addChunk(CHUNKTABLE *table, CHUNK *chunk) {
+    if (2 * (table->count + 1) > table->capacity) {
+        CHUNKTABLE grown = {calloc(table->capacity ? 2 * table->capacity : 1024, sizeof(CHUNK)),
+            table->capacity ? 2 * table->capacity : 1024, table->count};
+        if (grown.chunks == NULL) return -1;
+        for (size_t i = 0; i < table->capacity; i++) {
+            if (table->chunks[i].node != NULL) *findChunk(&grown, table->chunks[i].node) = table->chunks[i];
+        }
+        free(table->chunks);
+        *table = grown;
+    }
+    CHUNK *slot = findChunk(table, chunk->node);
+    if (slot->node == NULL) table->count++;
+    *slot = *chunk;
+    return 0;
+}
+
+// copies length bytes at offset in inFd to the end of outfile. returns 0 on success
+static int copyChunk(int inFd, off_t offset, off_t length, FILE *outfile) {
+    if (fflush(outfile) != 0) return -1;
+    int outFd = fileno(outfile);
+    // the kernel copies (or shares) the blocks without them passing through here
+    while (length > 0) {
+        ssize_t copied = copy_file_range(inFd, &offset, outFd, NULL, length, 0);
+        if (copied <= 0) break;
+        length -= copied;
+    }
+    // no copy_file_range across these files - copy through a buffer instead
+    char buffer[64 * 1024];
+    while (length > 0) {
+        ssize_t bytesRead = pread(inFd, buffer, length < (off_t)sizeof(buffer) ? length : (off_t)sizeof(buffer), offset);
+        if (bytesRead <= 0 || write(outFd, buffer, bytesRead) != bytesRead) return -1;
+        offset += bytesRead;
+        length -= bytesRead;
+    }
+    // the stream's idea of its position is stale
+    return fseeko(outfile, 0, SEEK_END);
+}
+
+// helper for save -i. writes the tree to fileName in the save format like writeFileTree, copying
+// unchanged subtrees from the previous incremental save of the same file. returns 0 on success
+// the walk is saveFileTree's, with a check at every directory with at least SAVECHUNKNODES nodes
+// below it: if its orderHash and path match the chunk written last time, the old lines are copied
+// and the subtree is skipped. otherwise it is written out and becomes a chunk for next time
+int saveIncremental(NODE *root, char *fileName) {
+    lazyExpandAll(root);
+
+    // the previous save can only be reused if its file hasn't changed since
+    int oldFd = -1;
+    struct stat fileStat;
+    if (lastSaveName != NULL && strcmp(lastSaveName, fileName) == 0 && stat(fileName, &fileStat) == 0
+            && fileStat.st_dev == lastSaveStat.st_dev && fileStat.st_ino == lastSaveStat.st_ino
+            && fileStat.st_size == lastSaveStat.st_size
+            && fileStat.st_mtim.tv_sec == lastSaveStat.st_mtim.tv_sec
+            && fileStat.st_mtim.tv_nsec == lastSaveStat.st_mtim.tv_nsec) {
+        oldFd = open(fileName, O_RDONLY);
+    }
+
+    char *tempFileName = malloc(strlen(fileName) + 5);
+    char *path = malloc(MAXLINELENGTH);
+    struct openChunk {
+        NODE *dir;
+        uint64_t hash, pathHash;
+        off_t offset;
+    } *stack = malloc(64 * sizeof(struct openChunk));
+    CHUNKTABLE chunks = {NULL, 0, 0};
+    size_t pathCapacity = MAXLINELENGTH, pathLength = 0;
+    int stackCapacity = 64, top = -1;
+    long reused = 0, written = 0;
+    if (tempFileName == NULL || path == NULL || stack == NULL) {
+        printf("Error: memory allocation failed!\n");
+        free(tempFileName);
+        free(path);
+        free(stack);
+        if (oldFd >= 0) close(oldFd);
+        return -1;
+    }
+    sprintf(tempFileName, "%s.tmp", fileName);
+    FILE *outfile = fopen(tempFileName, "w+");
+    if (outfile == NULL) {
+        printf("Failed to open file: %s\n", tempFileName);
+        free(tempFileName);
+        free(path);
+        free(stack);
+        if (oldFd >= 0) close(oldFd);
+        return -1;
+    }
+    char *outBuffer = malloc(SAVEBUFFERSIZE);
+    if (outBuffer != NULL) setvbuf(outfile, outBuffer, _IOFBF, SAVEBUFFERSIZE);
+
+    int status = 0;
+    fprintf(outfile, "%c /\n", root->type);
+    NODE *pCur = root->child;
+    while (pCur != NULL && status == 0) {
+        // extend the path with the current node's name ("<parent path>/<name>")
+        size_t nameLength = strlen(pCur->name);
+        size_t nodeLength = pathLength + 1 + nameLength;
+        if (nodeLength + 1 > pathCapacity) {
+            while (nodeLength + 1 > pathCapacity) pathCapacity *= 2;
+            char *newPath = realloc(path, pathCapacity);
+            if (newPath == NULL) {
+                printf("Error: memory allocation failed!\n");
+                status = -1;
+                break;
+            }
+            path = newPath;
+        }
+        path[pathLength] = '/';
+        memcpy(path + pathLength + 1, pCur->name, nameLength);
+
+        int copied = 0;
+        if (pCur->type == 'D' && pCur->dirs + pCur->files >= SAVECHUNKNODES) {
+            subtreeHash(pCur); // (freshens orderHash too)
+            CHUNK chunk = {pCur, pCur->orderHash, hashBytes(0, path, nodeLength), ftello(outfile), 0};
+            CHUNK *old = oldFd >= 0 ? findChunk(&lastSaveChunks, pCur) : NULL;
+            if (old != NULL && old->node == pCur && old->hash == chunk.hash && old->pathHash == chunk.pathHash) {
+                // unchanged since the last save - copy its lines and skip the subtree
+                chunk.length = old->length;
+                if (copyChunk(oldFd, old->offset, old->length, outfile) != 0 || addChunk(&chunks, &chunk) != 0) status = -1;
+                reused += pCur->dirs + pCur->files + 1;
+                copied = 1;
+            }
+            else {
+                // write it out, and remember where it started until the walk climbs out of it
+                if (top + 1 == stackCapacity) {
+                    struct openChunk *newStack = realloc(stack, 2 * stackCapacity * sizeof(struct openChunk));
+                    if (newStack == NULL) {
+                        printf("Error: memory allocation failed!\n");
+                        status = -1;
+                        break;
+                    }
+                    stack = newStack;
+                    stackCapacity *= 2;
+                }
+                top++;
+                stack[top].dir = pCur;
+                stack[top].hash = chunk.hash;
+                stack[top].pathHash = chunk.pathHash;
+                stack[top].offset = chunk.offset;
+            }
+        }
+        if (!copied) {
+            // print the line to the file ("D /path/to/node\n")
+            putc(pCur->type, outfile);
+            putc(' ', outfile);
+            fwrite(path, 1, nodeLength, outfile);
+            putc('\n', outfile);
+            written++;
+        }
+
+        // descend into the subtree first - the node's path becomes the parent path
+        if (!copied && pCur->child != NULL) {
+            pathLength = nodeLength;
+            pCur = pCur->child;
+            continue;
+        }
+
+        // climb until we find a node with a sibling left to visit
+        // every directory climbed out of is finished - a written chunk ends there
+        while (1) {
+            if (top >= 0 && stack[top].dir == pCur) {
+                CHUNK chunk = {pCur, stack[top].hash, stack[top].pathHash, stack[top].offset, ftello(outfile) - stack[top].offset};
+                if (addChunk(&chunks, &chunk) != 0) status = -1;
+                top--;
+            }
+            if (pCur->sibling != NULL || pCur->parent == root) break;
+            pCur = pCur->parent;
+            pathLength -= strlen(pCur->name) + 1;
+        }
+
+        // shift (NULL once the last child of root is done)
+        pCur = pCur->sibling;
+    }
+
+    // close the file (flushes the buffer), then install it
+    if (status != 0) printf("Error: memory allocation failed!\n");
+    if (ferror(outfile) | fclose(outfile)) {
+        printf("Failed to write file: %s\n", tempFileName);
+        status = -1;
+    }
+    else if (status == 0 && rename(tempFileName, fileName) != 0) {
+        printf("Failed to write file: %s\n", fileName);
+        status = -1;
+    }
+    if (oldFd >= 0) close(oldFd);
+
+    if (status == 0 && stat(fileName, &lastSaveStat) == 0) {
+        // the new chunks are what the next save can reuse
+        free(lastSaveChunks.chunks);
+        lastSaveChunks = chunks;
+        if (lastSaveName == NULL || strcmp(lastSaveName, fileName) != 0) {
+            free(lastSaveName);
+            lastSaveName = strdup(fileName);
+        }
+        printf("Saved %s: %ld nodes written, %ld copied from the last save\n", fileName, written, reused);
+    }
+    else {
+        if (status != 0) remove(tempFileName);
+        free(chunks.chunks);
+        // the old chunks may point into a file that is gone
+        free(lastSaveName);
+        lastSaveName = NULL;
+    }
+    free(outBuffer);
+    free(tempFileName);
+    free(path);
+    free(stack);
+    return status;
+}
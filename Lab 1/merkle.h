@@ -0,0 +1,25 @@
+#ifndef __MERKLE_H__
+#define __MERKLE_H__
+
+#include "node.h"
+
+// every directory caches a hash of its children (their types, names, sizes and, for directories,
+// their own hashes). the sum of the child hashes is used, so sibling order doesn't matter to
+// diff. save -i writes children in order, so it reuses chunks by a second hash, computed in the
+// same pass, that chains the children in order instead (orderHash)
+// a change marks the directories above it stale (updateAggregates), and a hash is only
+// recomputed - for the stale directories below it - when something asks for it
+// incremental saves reuse the bytes of the previous save for every unchanged directory with at
+// least SAVECHUNKNODES nodes below it
+#define SAVECHUNKNODES 256
+
+// main command function. runs "diff filename [filename]"
+void diff(NODE *root, char *fileNames);
+
+// returns the Merkle hash of dir's children, recomputing the stale directories below it
+uint64_t subtreeHash(NODE *dir);
+// helper for save -i. writes the tree to fileName in the save format like writeFileTree, copying
+// unchanged subtrees from the previous incremental save of the same file. returns 0 on success
+int saveIncremental(NODE *root, char *fileName);
+
+#endif /* __MERKLE_H__ */
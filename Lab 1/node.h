@@ -0,0 +1,84 @@
+#ifndef __NODE_H__
+#define __NODE_H__
+
+// the file tree itself and the helpers that work on it (implemented in commands.c)
+// kept apart from commands.h, whose mkdir/rmdir/creat clash with the libc prototypes in
+// <sys/stat.h>, <unistd.h> and <fcntl.h> - modules that need those headers include only this one
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// max line length for user input in the terminal
+#define MAXLINELENGTH 255
+// size of the stdio buffer used when writing a save file
+#define SAVEBUFFERSIZE (1 << 20)
+// size of the buffer ls collects its output in
+#define LSBUFFERSIZE (64 << 10)
+
+// NODE flags
+#define NODEREMOVED 0x01      // unlinked by a concurrent session, kept alive until the sessions are done
+#define NODEHASHSTALE 0x02    // (directories) hash needs recomputing - see merkle.h
+#define NODELAZY 0x04         // (directories) children not read from the snapshot yet - see lazy.h
+
+typedef struct node {
+	char  name[64];       // node's name string
+	char  type;
+	unsigned char flags;  // NODE* flags above
+	uint32_t nameId;      // id in the trigram index (0 if it isn't in it - see trigram.h)
+	struct node *child, *sibling, *parent;
+	// subtree aggregates, kept up to date on every change (see updateAggregates)
+	// a directory holds the totals of everything below it, a file holds its own size
+	long  dirs, files;
+	unsigned long long size;
+	uint64_t hash;        // (directories) Merkle hash of the children, valid unless NODEHASHSTALE is set
+	uint64_t orderHash;   // (directories) the same, but it changes with the order of the children too
+	uint64_t pathHash;    // hash of the absolute path (see pathindex.h)
+	uint32_t epoch;       // liveEpoch when it was created - snapshots taken since can see it (see cow.h)
+	uint32_t lazyEntry;   // (NODELAZY directories) index of its entry in the snapshot being loaded
+	struct nodeVersion *history; // child/sibling links as older snapshots saw them (NULL if unchanged)
+	struct nameIndex *index;     // (directories) the children in name order, once a sorted ls needs it (see dirindex.h)
+} NODE;
+
+
+// takes an absolute path and returns a pointer to the parent of the path
+NODE *navigateToAbsolutePath(NODE *cwd, char **pathName);
+// finds the node at pathName (absolute, or relative to cwd, with . and ..). returns NULL if there is none
+NODE *findNode(NODE *cwd, char *pathName);
+// allocates and initializes an unlinked node. returns NULL if allocation failed
+NODE *newNode(NODE *parent, char *name, char type);
+// frees a node (and its directory index) that is already unlinked
+void freeNode(NODE *node);
+// returns the last child of a directory (NULL if it is empty)
+NODE *lastChildOf(NODE *dir);
+// helper for mkdir() and creat()
+void createFile(NODE *cwd, char *fileName, char type);
+// helper for rmdir() and rm()
+void removeFile(NODE *cwd, char *fileName, char type);
+// helper for mv() and journal replay. moves source to destination (into it if it is a directory)
+void moveFile(NODE *cwd, char *source, char *destination);
+// the length of node's absolute path (1 for root)
+size_t absolutePathLength(NODE *node);
+// writes node's absolute path into the absolutePathLength(node) bytes at path (no terminator)
+void buildAbsolutePath(NODE *node, char *path, size_t length);
+// writes the absolute path of node and a newline to out (any depth)
+void writeAbsolutePath(FILE *out, NODE *node);
+// helper for save() and bgsave. writes the tree to fileName in the save format. returns 0 on success
+int writeFileTree(NODE *root, char *fileName);
+// helper for save(). iteratively traverses the file tree and saves all node data
+void saveFileTree(NODE *root, FILE *outfile);
+// helper for reload(). bulk loads a file written by save(), skipping duplicate checks unless validate is set
+void loadFileTree(NODE *root, FILE *infile, int validate);
+// allocates an empty root directory (its own parent). returns NULL if allocation failed
+NODE *newRootNode();
+// adds a change below dir to the aggregates of dir and every directory above it
+void updateAggregates(NODE *dir, long dirs, long files, long long size);
+// recomputes the aggregates of every directory under root (after a bulk load)
+void computeAggregates(NODE *root);
+// frees first, its siblings and all of their descendants
+void freeFileTree(NODE *first);
+// replaces the contents of root with the contents of newRoot, then frees newRoot
+void replaceFileTree(NODE *root, NODE *newRoot);
+
+#endif /* __NODE_H__ */
@@ -0,0 +1,654 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "parallel.h"
+#include "journal.h"
+#include "cow.h"
+#include "dirindex.h"
+#include "pathindex.h"
+#include "lazy.h"
+#include "columns.h"
+#include "trigram.h"
+
+// what a job does at each node
+enum { OPFIND, OPTREE, OPREMOVE, OPIMPORT };
+
+typedef struct task TASK;
+
+// a subtree handed off to the pool. its output goes at offset in the output of the task that spawned it
+typedef struct segment {
+    size_t offset;
+    TASK *task;
+} SEGMENT;
+
+// one subtree to walk (every node below dir)
+struct task {
+    NODE *dir;
+    int depth;                          // dir's depth below the start of the job
+    FILE *out;                          // output (find and tree), a memory stream
+    char *outBuffer;
+    size_t outSize;
+    SEGMENT *segments;                  // subtrees handed off from this one, in DFS order
+    int segmentCount, segmentCapacity;
+    long dirs, files;                   // nodes visited
+    long skipped;                       // (import) host entries that couldn't be read or named
+};
+
+// a record returned by getdents64
+typedef struct hostEntry {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} HOSTENTRY;
+
+// a worker's deque of waiting tasks. the owner pushes and pops at the bottom (newest, so its own
+// walk stays depth first), thieves take from the top (oldest, so the biggest subtrees move)
+typedef struct worker {
+    pthread_mutex_t lock;
+    TASK *tasks[POOLDEQUESIZE];         // ring buffer
+    long top, bottom;
+} __attribute__((aligned(64))) WORKER;
+
+// the pool
+static WORKER workers[POOLMAXTHREADS];
+static int workerCount = 0;             // 0 until the pool is started
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobStarted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobFinished = PTHREAD_COND_INITIALIZER;
+static long jobNumber = 0;              // bumped for every job
+static int busyWorkers = 0;             // pool threads still in the current job
+
+// the current job
+static int jobOp;
+static char *jobPattern;                // find -name pattern (NULL matches everything)
+static int jobHostFd;                   // import: the host directory being imported
+static NODE *jobImportRoot;             // import: the node it becomes
+static atomic_long pendingTasks;        // tasks spawned and not yet finished
+static atomic_int idleWorkers;          // workers looking for something to steal
+
+
+// takes the newest task from the worker's own deque
+static TASK *popTask(WORKER *worker) {
+    TASK *task = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->bottom > worker->top) task = worker->tasks[--worker->bottom % POOLDEQUESIZE];
+    pthread_mutex_unlock(&worker->lock);
+    return task;
+}
+
+// takes the oldest task from some other worker, starting at a random one
+static TASK *stealTask(int self, unsigned int *seed) {
+    int start = rand_r(seed) % workerCount;
+    for (int i = 0; i < workerCount; i++) {
+        WORKER *victim = &workers[(start + i) % workerCount];
+        if (victim == &workers[self] || victim->bottom == victim->top) continue; // (racy peek, checked again under the lock)
+        TASK *task = NULL;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->bottom > victim->top) task = victim->tasks[victim->top++ % POOLDEQUESIZE];
+        pthread_mutex_unlock(&victim->lock);
+        if (task != NULL) return task;
+    }
+    return NULL;
+}
+
+// allocates a task for the subtree below dir. returns NULL if allocation failed
+static TASK *newTask(NODE *dir, int depth) {
+    TASK *task = calloc(1, sizeof(TASK));
+    if (task == NULL) return NULL;
+    task->dir = dir;
+    task->depth = depth;
+    if (jobOp == OPFIND || jobOp == OPTREE) {
+        task->out = open_memstream(&task->outBuffer, &task->outSize);
+        if (task->out == NULL) {
+            free(task);
+            return NULL;
+        }
+    }
+    return task;
+}
+
+// hands the subtree below dir to the pool if a worker is idle and this one has nothing queued
+// returns 1 if it was handed off, 0 if the caller should walk it
+static int spawnTask(TASK *parent, WORKER *worker, NODE *dir, int depth) {
+    if (atomic_load_explicit(&idleWorkers, memory_order_relaxed) == 0 || worker->bottom != worker->top) return 0;
+
+    // make room to remember where its output goes
+    if (parent->segmentCount == parent->segmentCapacity) {
+        int newCapacity = parent->segmentCapacity ? 2 * parent->segmentCapacity : 8;
+        SEGMENT *newSegments = realloc(parent->segments, newCapacity * sizeof(SEGMENT));
+        if (newSegments == NULL) return 0;
+        parent->segments = newSegments;
+        parent->segmentCapacity = newCapacity;
+    }
+    TASK *task = newTask(dir, depth);
+    if (task == NULL) return 0;
+
+    if (parent->out != NULL) fflush(parent->out);
+    parent->segments[parent->segmentCount].offset = parent->out ? parent->outSize : 0;
+    parent->segments[parent->segmentCount++].task = task;
+
+    atomic_fetch_add(&pendingTasks, 1);
+    pthread_mutex_lock(&worker->lock);
+    worker->tasks[worker->bottom++ % POOLDEQUESIZE] = task;
+    pthread_mutex_unlock(&worker->lock);
+    return 1;
+}
+
+// import: creates the children of dir from the host directory at the same place below jobHostFd
+// (the children are linked before the walk reaches them, and no other worker sees dir until then)
+static void importDir(TASK *task, NODE *dir) {
+    // dir's path relative to the imported directory, built backwards from the parent links
+    char path[PATH_MAX];
+    char *start = path + sizeof(path) - 1;
+    *start = 0;
+    for (NODE *pCur = dir; pCur != jobImportRoot; pCur = pCur->parent) {
+        size_t length = strlen(pCur->name);
+        if (start - path < length + 1) {
+            task->skipped++;
+            return;
+        }
+        start -= length;
+        memcpy(start, pCur->name, length);
+        *--start = '/';
+    }
+    int fd = openat(jobHostFd, *start ? start + 1 : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        task->skipped++;
+        return;
+    }
+
+    // read the entries in large batches, appending a node for each
+    char buffer[IMPORTBUFFERSIZE];
+    NODE *last = NULL;
+    long bytes;
+    while ((bytes = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+        for (long offset = 0; offset < bytes; offset += ((HOSTENTRY*)(buffer + offset))->d_reclen) {
+            HOSTENTRY *entry = (HOSTENTRY*)(buffer + offset);
+            char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) continue;
+            if (strlen(name) >= sizeof(dir->name)) {
+                task->skipped++;
+                continue;
+            }
+
+            // directories become D, everything else (files, links, devices...) F
+            char type;
+            if (entry->d_type == DT_UNKNOWN) {
+                // the filesystem doesn't fill d_type in
+                struct stat entryStat;
+                if (fstatat(fd, name, &entryStat, AT_SYMLINK_NOFOLLOW) < 0) {
+                    task->skipped++;
+                    continue;
+                }
+                type = S_ISDIR(entryStat.st_mode) ? 'D' : 'F';
+            }
+            else type = entry->d_type == DT_DIR ? 'D' : 'F';
+
+            NODE *node = newNode(dir, name, type);
+            if (node == NULL) {
+                task->skipped++;
+                continue;
+            }
+            if (last == NULL) dir->child = node;
+            else last->sibling = node;
+            last = node;
+        }
+    }
+    if (bytes < 0) task->skipped++;
+    close(fd);
+}
+
+// does the job's work at one node
+static void visitNode(TASK *task, NODE *node, int depth) {
+    if (node->type == 'D') task->dirs++;
+    else task->files++;
+
+    if (jobOp == OPFIND) {
+        if (jobPattern == NULL || fnmatch(jobPattern, node->name, 0) == 0) writeAbsolutePath(task->out, node);
+    }
+    else if (jobOp == OPTREE) {
+        fprintf(task->out, "%*s%c %s\n", 2 * depth, "", node->type, node->name);
+    }
+    else if (jobOp == OPIMPORT && node->type == 'D') importDir(task, node);
+}
+
+// walks everything below task->dir without recursion, in DFS order
+// a directory is either walked here or handed to the pool as a new task (which then owns it)
+static void runTask(TASK *task, WORKER *worker) {
+    NODE *dir = task->dir;
+    int depth = task->depth + 1; // depth of pCur
+    if (jobOp == OPIMPORT && dir == jobImportRoot) importDir(task, dir); // (the others were visited)
+    NODE *pCur = dir->child;
+
+    while (pCur != NULL) {
+        visitNode(task, pCur, depth);
+
+        // read the links first - a task spawned for pCur may free it (rm -r) at any time
+        NODE *next = pCur->sibling;
+        NODE *up = pCur->parent;
+        if (pCur->type == 'D' && pCur->child != NULL) {
+            if (!spawnTask(task, worker, pCur, depth)) {
+                // walk it here: go to child
+                pCur = pCur->child;
+                depth++;
+                continue;
+            }
+        }
+        else if (jobOp == OPREMOVE) freeNode(pCur);
+
+        // go to the next sibling, or climb until there is one (each directory climbed out of is done)
+        while (next == NULL && up != dir) {
+            pCur = up;
+            depth--;
+            next = pCur->sibling;
+            up = pCur->parent;
+            if (jobOp == OPREMOVE) freeNode(pCur);
+        }
+        pCur = next;
+    }
+
+    if (jobOp == OPREMOVE) freeNode(dir);
+    if (task->out != NULL) fflush(task->out);
+}
+
+// one worker's part of a job: runs and steals tasks until every task is done
+static void runWorker(int self) {
+    WORKER *worker = &workers[self];
+    unsigned int seed = self + 1;
+    int idle = 0;
+
+    while (atomic_load(&pendingTasks) > 0) {
+        TASK *task = popTask(worker);
+        if (task == NULL) task = stealTask(self, &seed);
+        if (task == NULL) {
+            // nothing to do - let the others know they can hand work off
+            if (!idle) {
+                idle = 1;
+                atomic_fetch_add(&idleWorkers, 1);
+            }
+            sched_yield();
+            continue;
+        }
+        if (idle) {
+            idle = 0;
+            atomic_fetch_sub(&idleWorkers, 1);
+        }
+        runTask(task, worker);
+        atomic_fetch_sub(&pendingTasks, 1);
+    }
+    if (idle) atomic_fetch_sub(&idleWorkers, 1);
+}
+
+// body of the pool threads: wait for a job, help with it, repeat
+static void *poolThread(void *arg) {
+    int self = (int)(long)arg;
+    long lastJob = 0;
+    while (1) {
+        pthread_mutex_lock(&poolLock);
+        while (jobNumber == lastJob) pthread_cond_wait(&jobStarted, &poolLock);
+        lastJob = jobNumber;
+        pthread_mutex_unlock(&poolLock);
+
+        runWorker(self);
+
+        pthread_mutex_lock(&poolLock);
+        if (--busyWorkers == 0) pthread_cond_signal(&jobFinished);
+        pthread_mutex_unlock(&poolLock);
+    }
+    return NULL;
+}
+
+// starts one worker per core (the calling thread is worker 0)
+static void startPool() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    workerCount = cores < 1 ? 1 : (cores > POOLMAXTHREADS ? POOLMAXTHREADS : cores);
+    for (int i = 0; i < workerCount; i++) pthread_mutex_init(&workers[i].lock, NULL);
+    for (int i = 1; i < workerCount; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, poolThread, (void*)(long)i) != 0) {
+            workerCount = i; // run with the workers that did start
+            break;
+        }
+        pthread_detach(thread);
+    }
+}
+
+// writes the output of task and the tasks spawned from it in DFS order, totals their counts
+// into task, and frees the spawned tasks (without recursion - pending tasks wait on a stack)
+static void finishJob(TASK *first) {
+    typedef struct frame { TASK *task; int segment; size_t position; } FRAME;
+    int capacity = 64, depth = 0;
+    FRAME *stack = malloc(capacity * sizeof(FRAME));
+    if (stack == NULL) {
+        printf("Error: memory allocation failed!\n");
+        return;
+    }
+    stack[0] = (FRAME){first, 0, 0};
+
+    while (depth >= 0) {
+        FRAME *frame = &stack[depth];
+        TASK *task = frame->task;
+
+        // output up to the next spawned task (or the end)
+        size_t end = frame->segment < task->segmentCount ? task->segments[frame->segment].offset : task->outSize;
+        if (task->out != NULL) fwrite(task->outBuffer + frame->position, 1, end - frame->position, stdout);
+        frame->position = end;
+
+        if (frame->segment < task->segmentCount) {
+            // descend into the spawned task
+            TASK *child = task->segments[frame->segment++].task;
+            if (depth + 1 == capacity) {
+                FRAME *newStack = realloc(stack, 2 * capacity * sizeof(FRAME));
+                if (newStack == NULL) {
+                    // can't go deeper - drop its output, keep its counts
+                    first->dirs += child->dirs;
+                    first->files += child->files;
+                    first->skipped += child->skipped;
+                    continue;
+                }
+                stack = newStack;
+                capacity *= 2;
+            }
+            stack[++depth] = (FRAME){child, 0, 0};
+            continue;
+        }
+
+        // this task is done
+        if (task->out != NULL) fclose(task->out);
+        free(task->outBuffer);
+        free(task->segments);
+        if (task != first) {
+            first->dirs += task->dirs;
+            first->files += task->files;
+            first->skipped += task->skipped;
+            free(task);
+        }
+        depth--;
+    }
+    free(stack);
+}
+
+// runs op on every node below dir on the pool. returns the finished root task (its counts are
+// the totals), or NULL if allocation failed. output is written to stdout in DFS order
+static TASK *runJob(int op, NODE *dir, char *pattern) {
+    if (workerCount == 0) startPool();
+    jobOp = op;
+    jobPattern = pattern;
+
+    TASK *task = newTask(dir, 0);
+    if (task == NULL) {
+        printf("Error: memory allocation failed!\n");
+        return NULL;
+    }
+    if (op == OPTREE) {
+        // the start of the tree is printed as a path
+        writeAbsolutePath(task->out, dir);
+    }
+
+    // seed worker 0 (this thread) and wake the pool
+    atomic_store(&pendingTasks, 1);
+    atomic_store(&idleWorkers, 0);
+    workers[0].tasks[workers[0].bottom++ % POOLDEQUESIZE] = task;
+    pthread_mutex_lock(&poolLock);
+    busyWorkers = workerCount - 1;
+    jobNumber++;
+    pthread_cond_broadcast(&jobStarted);
+    pthread_mutex_unlock(&poolLock);
+
+    runWorker(0);
+
+    // wait for the pool threads to leave the job
+    pthread_mutex_lock(&poolLock);
+    while (busyWorkers > 0) pthread_cond_wait(&jobFinished, &poolLock);
+    pthread_mutex_unlock(&poolLock);
+
+    finishJob(task);
+    return task;
+}
+
+// finds the node for a command's pathname arg (cwd if there is none). prints an error if it doesn't exist
+static NODE *startNode(NODE *cwd, char *pathName) {
+    if (pathName == NULL) return cwd;
+    NODE *node = findNode(cwd, pathName);
+    if (node == NULL) printf("No such file or directory: %s\n", pathName);
+    return node;
+}
+
+
+/*
+    find [pathname] [-name pattern]
+    Print the absolute pathname of pathname (or CWD) and of every node below it whose name
+    matches the shell pattern (*, ? and [...], optionally quoted), or of every node if no pattern
+    is given.
+    Display an error message (No such file or directory: pathname) for an invalid pathname.
+    With the trigram index on (see trigram.h), the matches come in the order they were created.
+*/
+void find(NODE *cwd, char *args) {
+    char *pathName = NULL, *pattern = NULL;
+
+    // parse the args
+    char *token = args ? strtok(args, " ") : NULL;
+    if (token != NULL && strcmp(token, "-name") != 0) {
+        pathName = token;
+        token = strtok(NULL, " ");
+    }
+    if (token != NULL) {
+        if (strcmp(token, "-name") != 0 || (pattern = strtok(NULL, "")) == NULL) {
+            printf("Usage: find [pathname] [-name pattern]\n");
+            return;
+        }
+        // -name 'f*' - one pair of matching quotes around the pattern is dropped, like a shell would
+        size_t patternLength = strlen(pattern);
+        if (patternLength >= 2 && (pattern[0] == '\'' || pattern[0] == '"') && pattern[patternLength - 1] == pattern[0]) {
+            pattern[patternLength - 1] = 0;
+            pattern++;
+        }
+    }
+
+    NODE *start = startNode(cwd, pathName);
+    if (start == NULL) return;
+
+    // the start itself
+    if (pattern == NULL || fnmatch(pattern, start->name, 0) == 0) writeAbsolutePath(stdout, start);
+    if (start->type != 'D') return;
+
+    lazyExpandAll(start);
+    if (columnsFind(start, pattern) || trigramFind(start, pattern)) return;
+    free(runJob(OPFIND, start, pattern));
+}
+
+/*
+    tree [pathname]
+    Print pathname (or CWD) and every node below it in DFS order, indented by depth,
+    followed by the number of directories and files.
+    Display an error message (No such file or directory: pathname) for an invalid pathname.
+*/
+void tree(NODE *cwd, char *pathName) {
+    NODE *start = startNode(cwd, pathName);
+    if (start == NULL) return;
+
+    if (start->type != 'D') {
+        writeAbsolutePath(stdout, start);
+        printf("0 directories, 0 files\n");
+        return;
+    }
+    lazyExpandAll(start);
+    if (columnsTree(start)) return;
+    TASK *task = runJob(OPTREE, start, NULL);
+    if (task == NULL) return;
+    printf("%ld directories, %ld files\n", task->dirs, task->files);
+    free(task);
+}
+
+// helper for rm -r. removes pathName and everything under it
+// the subtree is unlinked first, then freed by the pool. the CWD can't be inside it
+void removeTree(NODE *cwd, char *pathName) {
+    NODE *target = findNode(cwd, pathName);
+    if (target == NULL) {
+        printf("No such file or directory: %s\n", pathName);
+        return;
+    }
+    if (target->parent == target) {
+        printf("Cannot remove /!\n");
+        return;
+    }
+    for (NODE *pCur = cwd; pCur->parent != pCur; pCur = pCur->parent) {
+        if (pCur == target) {
+            printf("Cannot remove %s (contains the CWD)!\n", pathName);
+            return;
+        }
+    }
+
+    // uncount it and everything under it
+    updateAggregates(target->parent, -(target->dirs + (target->type == 'D')), -(target->files + (target->type == 'F')),
+        -(long long)target->size);
+
+    // log the mutation (before the node, which the path is built from, is freed)
+    journalRecord('r', target);
+
+    // unlink it
+    pathIndexDeleteSubtree(target);
+    trigramDeleteSubtree(target);
+    NODE *parent = target->parent;
+    if (parent->child == target) {
+        preserveLinks(parent);
+        parent->child = target->sibling;
+    }
+    else {
+        NODE *pPrev = parent->child;
+        while (pPrev->sibling != target) pPrev = pPrev->sibling;
+        preserveLinks(pPrev);
+        pPrev->sibling = target->sibling;
+    }
+    indexRemove(parent, target);
+
+    // free it and everything under it. while snapshots exist, the nodes they see must stay intact,
+    // so the subtree is released in place instead of on the pool
+    if (snapshotsExist()) releaseSubtree(target);
+    else if (target->type != 'D' || target->child == NULL) freeNode(target);
+    else {
+        TASK *task = runJob(OPREMOVE, target, NULL);
+        if (task == NULL) {
+            // no pool task - free it here instead
+            releaseSubtree(target);
+        }
+        free(task);
+    }
+}
+
+/*
+    import host-directory [pathname]
+    Create the directory pathname (by default the last name in host-directory, in the CWD) and
+    fill it with everything below the real directory host-directory: its directories as D and
+    everything else (files, links, devices...) as F. Links are not followed.
+    The host tree is read on the pool, each worker listing directories with getdents64.
+*/
+void import(NODE *cwd, char *args) {
+    char *hostName = args ? strtok(args, " ") : NULL;
+    char *pathName = hostName ? strtok(NULL, " ") : NULL;
+    if (hostName == NULL) {
+        printf("Too few arguments!\n");
+        return;
+    }
+
+    // the default pathname is the last name of the host directory
+    char name[MAXLINELENGTH];
+    if (pathName == NULL) {
+        size_t length = strlen(hostName);
+        while (length > 1 && hostName[length - 1] == '/') length--;
+        size_t start = length;
+        while (start > 0 && hostName[start - 1] != '/') start--;
+        if (start == length) {
+            printf("Too few arguments!\n"); // importing / needs a pathname
+            return;
+        }
+        snprintf(name, sizeof(name), "%.*s", (int)(length - start), hostName + start);
+    }
+    else snprintf(name, sizeof(name), "%s", pathName);
+
+    // find the parent and check the name (like createFile)
+    NODE *parent = cwd;
+    char *fileName = name;
+    if (fileName[0] == '/') {
+        parent = navigateToAbsolutePath(cwd, &fileName);
+        if (parent == NULL) {
+            printf("Path does not exist!\n");
+            return;
+        }
+    }
+    if (strlen(fileName) >= sizeof(parent->name)) {
+        printf("Name too long: %s\n", fileName);
+        return;
+    }
+    lazyExpand(parent);
+    for (NODE *pCur = parent->child; pCur != NULL; pCur = pCur->sibling) {
+        if (strcmp(pCur->name, fileName) == 0) {
+            printf("DIR %s already exists!\n", fileName);
+            return;
+        }
+    }
+
+    int hostFd = open(hostName, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (hostFd < 0) {
+        printf("Failed to open directory: %s\n", hostName);
+        return;
+    }
+    NODE *dir = newNode(parent, fileName, 'D');
+    if (dir == NULL) {
+        printf("Error: memory allocation failed!\n");
+        close(hostFd);
+        return;
+    }
+
+    // build the subtree off to the side, on the pool
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    jobHostFd = hostFd;
+    jobImportRoot = dir;
+    TASK *task = runJob(OPIMPORT, dir, NULL);
+    close(hostFd);
+    if (task == NULL) {
+        freeFileTree(dir);
+        return;
+    }
+    computeAggregates(dir);
+
+    // link it in like createFile, and log every node in it
+    NODE *last = lastChildOf(parent);
+    preserveLinks(last ? last : parent);
+    if (last == NULL) parent->child = dir;
+    else last->sibling = dir;
+    indexInsert(parent, dir);
+    if (pathIndexCovers(parent)) pathIndexAddSubtree(dir);
+    if (trigramCovers(parent)) trigramAddSubtree(dir);
+    updateAggregates(parent, dir->dirs + 1, dir->files, dir->size);
+    journalRecord('D', dir);
+    NODE *pCur = dir->child;
+    while (pCur != NULL) {
+        journalRecord(pCur->type, pCur);
+        if (pCur->child != NULL) {
+            pCur = pCur->child;
+            continue;
+        }
+        while (pCur->sibling == NULL && pCur->parent != dir) pCur = pCur->parent;
+        pCur = pCur->sibling;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long entries = task->dirs + task->files;
+    printf("Imported %ld directories, %ld files in %.3f s (%.0f entries/s)\n", task->dirs, task->files, seconds,
+        seconds > 0 ? entries / seconds : 0.0);
+    if (task->skipped > 0) printf("%ld entries skipped (unreadable, or names too long)\n", task->skipped);
+    free(task);
+}
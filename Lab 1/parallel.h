@@ -0,0 +1,28 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include "node.h"
+
+// recursive commands run on a pool of worker threads (one per core, started on first use).
+// each worker walks its subtree iteratively in DFS order, and hands a directory off to the pool
+// instead of descending into it when another worker is idle. idle workers steal the oldest
+// (largest) waiting subtree from a random worker
+#define POOLMAXTHREADS 64
+#define POOLDEQUESIZE 64        // slots per worker deque (a worker only hands off while its deque is empty)
+#define IMPORTBUFFERSIZE (32 * 1024)    // bytes of directory entries an import worker reads per getdents64
+
+
+// main command functions
+// find [pathname] [-name pattern] - print the absolute path of every node under pathname (or cwd)
+// whose name matches the shell pattern
+void find(NODE *cwd, char *args);
+// tree [pathname] - print pathname (or cwd) and everything under it, indented by depth
+void tree(NODE *cwd, char *pathName);
+// import host-directory [pathname] - build pathname (by default named after host-directory) from
+// the real directory tree at host-directory
+void import(NODE *cwd, char *args);
+
+// helper for rm -r. removes pathName and everything under it
+void removeTree(NODE *cwd, char *pathName);
+
+#endif /* __PARALLEL_H__ */
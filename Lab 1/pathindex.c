@@ -0,0 +1,453 @@
+#include <pthread.h>
+#include <time.h>
+#include "pathindex.h"
+#include "lazy.h"
+
+static NODE **slots = NULL;         // the table (NULL while the index is off - stored atomically,
+                                    // since sessions test it without indexLock)
+static size_t capacity = 0;         // slots (a power of 2)
+static int shift = 64;              // 64 - log2(capacity)
+static size_t entries = 0;
+static NODE *indexRoot = NULL;      // the root of the indexed tree
+static int lookupsOn = 0;           // 0 while the index is off (or pathindex bench is timing the walk)
+static int hashesStale = 0;         // a directory moved while the index was off - the path hashes
+                                    // below it are wrong until the next fill recomputes them
+
+// creates and removes in concurrent sessions update the table from many threads
+static pthread_mutex_t indexLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// the path hash of a child called name of a directory with path hash hash
+uint64_t extendPathHash(uint64_t hash, char *name) {
+    hash = (hash ^ '/') * PATHHASHPRIME;
+    for (unsigned char *c = (unsigned char*)name; *c != 0; c++) hash = (hash ^ *c) * PATHHASHPRIME;
+    return hash;
+}
+
+// the slot a hash starts probing at (Fibonacci hashing - FNV's low bits alone cluster)
+static size_t homeSlot(uint64_t hash) {
+    return (hash * 0x9e3779b97f4a7c15ULL) >> shift;
+}
+
+// puts node in the first free slot from its home slot, unless it is in the table (which has room)
+static void insertSlot(NODE *node) {
+    size_t slot = homeSlot(node->pathHash);
+    while (slots[slot] != NULL) {
+        // already in (a refill can see a node a concurrent session is about to add)
+        if (slots[slot] == node) return;
+        slot = (slot + 1) & (capacity - 1);
+    }
+    slots[slot] = node;
+    entries++;
+}
+
+// takes node out of the table, shifting later entries of its probe run back into the gap
+static void deleteSlot(NODE *node) {
+    size_t slot = homeSlot(node->pathHash);
+    while (slots[slot] != NULL && slots[slot] != node) slot = (slot + 1) & (capacity - 1);
+    if (slots[slot] == NULL) return; // not in it
+    size_t gap = slot;
+    while (1) {
+        slot = (slot + 1) & (capacity - 1);
+        if (slots[slot] == NULL) break;
+        // an entry can move back into the gap unless its home slot lies after the gap
+        size_t home = homeSlot(slots[slot]->pathHash);
+        if (((slot - home) & (capacity - 1)) >= ((slot - gap) & (capacity - 1))) {
+            slots[gap] = slots[slot];
+            gap = slot;
+        }
+    }
+    slots[gap] = NULL;
+    entries--;
+}
+
+// sizes the table for count entries and empties it. returns -1 if allocation failed
+static int resetTable(size_t count) {
+    size_t newCapacity = PATHINDEXMINSLOTS;
+    int newShift = 64 - 10;
+    while (newCapacity < 2 * (count + 1)) {
+        newCapacity *= 2;
+        newShift--;
+    }
+    NODE **newSlots = calloc(newCapacity, sizeof(NODE*));
+    if (newSlots == NULL) return -1;
+    free(slots);
+    __atomic_store_n(&slots, newSlots, __ATOMIC_RELAXED);
+    capacity = newCapacity;
+    shift = newShift;
+    entries = 0;
+    return 0;
+}
+
+// resizes the table for count entries, moving over the entries it has (no tree walk, so it is safe
+// from a session thread while others change the tree). returns -1 if allocation failed
+static int growTable(size_t count) {
+    NODE **oldSlots = slots;
+    size_t oldCapacity = capacity;
+    __atomic_store_n(&slots, NULL, __ATOMIC_RELAXED); // (resetTable would free it)
+    if (resetTable(count) < 0) {
+        __atomic_store_n(&slots, oldSlots, __ATOMIC_RELAXED);
+        return -1;
+    }
+    for (size_t slot = 0; slot < oldCapacity; slot++) {
+        if (oldSlots[slot] != NULL) insertSlot(oldSlots[slot]);
+    }
+    free(oldSlots);
+    return 0;
+}
+
+// frees the table (the index is off)
+static void dropTable() {
+    free(slots);
+    __atomic_store_n(&slots, NULL, __ATOMIC_RELAXED);
+    capacity = entries = 0;
+    indexRoot = NULL;
+    lookupsOn = 0;
+}
+
+// adds every node below root. returns -1 if allocation failed (the index is then off)
+// (walks the tree unlocked - only for whole-tree commands, which sessions never run)
+static int fillTable(NODE *root) {
+    if (resetTable(root->dirs + root->files) < 0) {
+        dropTable();
+        return -1;
+    }
+    NODE *pCur = root->child;
+    while (pCur != NULL) {
+        if (hashesStale) pCur->pathHash = extendPathHash(pCur->parent->pathHash, pCur->name);
+        insertSlot(pCur);
+        // go to child
+        if (pCur->child != NULL) {
+            pCur = pCur->child;
+            continue;
+        }
+        // go to the next sibling, or climb until there is one
+        while (pCur->sibling == NULL && pCur->parent != root) pCur = pCur->parent;
+        pCur = pCur->sibling;
+    }
+    hashesStale = 0;
+    return 0;
+}
+
+// whether node's absolute path is the first length bytes of path (compared from the end, up the
+// parent chain)
+static int pathMatches(NODE *node, char *path, size_t length) {
+    size_t end = length;
+    while (node->parent != node) {
+        size_t nameLength = strlen(node->name);
+        if (nameLength + 1 > end || path[end - nameLength - 1] != '/'
+                || memcmp(path + end - nameLength, node->name, nameLength) != 0) {
+            return 0;
+        }
+        end -= nameLength + 1;
+        node = node->parent;
+    }
+    return end == 0 && node == indexRoot;
+}
+
+
+// resolves the first length bytes of the absolute path pathName from the index, if it can
+// returns 0 if it can't answer (index off, cwd not in the live tree, or a path with ., .. or
+// extra slashes), otherwise 1 with the node, or NULL if there is none, in *node
+int pathIndexLookup(NODE *cwd, char *pathName, size_t length, NODE **node) {
+    if (!lookupsOn || (cwd->parent == cwd && cwd != indexRoot)) return 0;
+    if (length == 1) {
+        *node = indexRoot;
+        return 1;
+    }
+
+    // hash the path, checking that every component is a plain name
+    uint64_t hash = PATHHASHBASIS;
+    size_t componentStart = 1;
+    for (size_t i = 0; i <= length; i++) {
+        if (i == length || pathName[i] == '/') {
+            size_t componentLength = i - componentStart;
+            if (componentLength == 0) return 0; // "//" or a trailing '/'
+            if (pathName[componentStart] == '.' && (componentLength == 1
+                    || (componentLength == 2 && pathName[componentStart + 1] == '.'))) {
+                return 0;
+            }
+            componentStart = i + 1;
+        }
+        if (i < length) hash = (hash ^ (unsigned char)pathName[i]) * PATHHASHPRIME;
+    }
+
+    // probe for a node with the hash and the path (sessions add and delete, and grow the table,
+    // concurrently - a node is deleted under the lock before it is unlinked, so a hit is live)
+    pthread_mutex_lock(&indexLock);
+    if (slots == NULL) { // turned off by a failed grow
+        pthread_mutex_unlock(&indexLock);
+        return 0;
+    }
+    for (size_t slot = homeSlot(hash); slots[slot] != NULL; slot = (slot + 1) & (capacity - 1)) {
+        if (slots[slot]->pathHash == hash && pathMatches(slots[slot], pathName, length)) {
+            *node = slots[slot];
+            pthread_mutex_unlock(&indexLock);
+            return 1;
+        }
+    }
+    pthread_mutex_unlock(&indexLock);
+    // a miss may only be a directory not read from its snapshot yet - walk to it instead
+    if (lazyNodes() > 0) return 0;
+    *node = NULL;
+    return 1;
+}
+
+// whether nodes linked or unlinked under dir have to be added to or deleted from the index
+// (dir's tree is found by walking up to its root - O(depth), like the journal record)
+int pathIndexCovers(NODE *dir) {
+    if (slots == NULL) return 0;
+    while (dir->parent != dir) dir = dir->parent;
+    return dir == indexRoot;
+}
+
+// call after linking node into the live tree (a no-op while the index is off)
+void pathIndexAdd(NODE *node) {
+    if (__atomic_load_n(&slots, __ATOMIC_RELAXED) == NULL) return;
+    pthread_mutex_lock(&indexLock);
+    if (slots == NULL) { // turned off by a failed grow in another session
+        pthread_mutex_unlock(&indexLock);
+        return;
+    }
+    if (2 * (entries + 1) > capacity && growTable(entries + 1) < 0) {
+        printf("Error: memory allocation failed! Path index off\n");
+        dropTable();
+    }
+    else insertSlot(node);
+    pthread_mutex_unlock(&indexLock);
+}
+
+// call before unlinking node from the live tree (a no-op while the index is off)
+void pathIndexDelete(NODE *node) {
+    if (__atomic_load_n(&slots, __ATOMIC_RELAXED) == NULL) return;
+    pthread_mutex_lock(&indexLock);
+    if (slots == NULL) { // turned off by a failed grow in another session
+        pthread_mutex_unlock(&indexLock);
+        return;
+    }
+    deleteSlot(node);
+    pthread_mutex_unlock(&indexLock);
+}
+
+// call after linking node and everything under it (import)
+void pathIndexAddSubtree(NODE *node) {
+    if (__atomic_load_n(&slots, __ATOMIC_RELAXED) == NULL) return;
+    pthread_mutex_lock(&indexLock);
+    if (slots == NULL) { // turned off by a failed grow in another session
+        pthread_mutex_unlock(&indexLock);
+        return;
+    }
+    if (2 * (entries + node->dirs + node->files + 1) > capacity && growTable(entries + node->dirs + node->files + 1) < 0) {
+        printf("Error: memory allocation failed! Path index off\n");
+        dropTable();
+    }
+    else {
+        insertSlot(node);
+        NODE *pCur = node->child;
+        while (pCur != NULL) {
+            insertSlot(pCur);
+            if (pCur->child != NULL) {
+                pCur = pCur->child;
+                continue;
+            }
+            while (pCur->sibling == NULL && pCur->parent != node) pCur = pCur->parent;
+            pCur = pCur->sibling;
+        }
+    }
+    pthread_mutex_unlock(&indexLock);
+}
+
+// call before unlinking node and everything under it (rm -r)
+void pathIndexDeleteSubtree(NODE *node) {
+    if (__atomic_load_n(&slots, __ATOMIC_RELAXED) == NULL) return;
+    pthread_mutex_lock(&indexLock);
+    if (slots == NULL) { // turned off by a failed grow in another session
+        pthread_mutex_unlock(&indexLock);
+        return;
+    }
+    deleteSlot(node);
+    NODE *pCur = node->child;
+    while (pCur != NULL) {
+        deleteSlot(pCur);
+        if (pCur->child != NULL) {
+            pCur = pCur->child;
+            continue;
+        }
+        while (pCur->sibling == NULL && pCur->parent != node) pCur = pCur->parent;
+        pCur = pCur->sibling;
+    }
+    pthread_mutex_unlock(&indexLock);
+}
+
+// call after moving node to a new parent or name (after pathIndexDeleteSubtree and the relink)
+// with the index off only node's own hash is updated, so a move costs nothing below it
+void pathIndexMove(NODE *node) {
+    node->pathHash = extendPathHash(node->parent->pathHash, node->name);
+    if (slots == NULL || !pathIndexCovers(node->parent)) {
+        if (node->child != NULL) hashesStale = 1;
+        return;
+    }
+
+    // the index is keyed by absolute path, so everything below has a new key
+    NODE *pCur = node->child;
+    while (pCur != NULL) {
+        pCur->pathHash = extendPathHash(pCur->parent->pathHash, pCur->name);
+        if (pCur->child != NULL) {
+            pCur = pCur->child;
+            continue;
+        }
+        while (pCur->sibling == NULL && pCur->parent != node) pCur = pCur->parent;
+        pCur = pCur->sibling;
+    }
+    pathIndexAddSubtree(node);
+}
+
+// call after a whole-tree change under root (does nothing unless root is the indexed tree)
+void pathIndexRebuild(NODE *root) {
+    if (slots == NULL || root != indexRoot) return;
+    pthread_mutex_lock(&indexLock);
+    if (fillTable(root) < 0) printf("Error: memory allocation failed! Path index off\n");
+    pthread_mutex_unlock(&indexLock);
+}
+
+
+// builds the absolute path of node in path (size bytes). returns its length, or 0 if it didn't fit
+static size_t buildPath(NODE *node, char *path, size_t size) {
+    char *start = path + size - 1;
+    *start = 0;
+    for (NODE *pCur = node; pCur->parent != pCur; pCur = pCur->parent) {
+        size_t length = strlen(pCur->name);
+        if (start - path < length + 1) return 0;
+        start -= length;
+        memcpy(start, pCur->name, length);
+        *--start = '/';
+    }
+    size_t length = path + size - 1 - start;
+    memmove(path, start, length + 1);
+    return length;
+}
+
+// times count lookups of random absolute paths by walking and through the index
+static void benchLookups(NODE *root, long count) {
+    long total = root->dirs + root->files;
+    if (total == 0 || count <= 0) {
+        printf("Nothing to look up!\n");
+        return;
+    }
+
+    // pick count nodes spread over the tree, then shuffle them
+    NODE **nodes = malloc(count * sizeof(NODE*));
+    char **paths = malloc(count * sizeof(char*));
+    char *path = malloc(MAXLINELENGTH * 4);
+    if (nodes == NULL || paths == NULL || path == NULL) {
+        printf("Error: memory allocation failed!\n");
+        free(nodes);
+        free(paths);
+        free(path);
+        return;
+    }
+    long picked = 0, seen = 0;
+    NODE *pCur = root->child;
+    while (pCur != NULL && picked < count) {
+        // take the node if it is the next of count evenly spaced ones
+        if ((seen++ * count) / total >= picked) nodes[picked++] = pCur;
+        if (pCur->child != NULL) {
+            pCur = pCur->child;
+            continue;
+        }
+        while (pCur->sibling == NULL && pCur->parent != root) pCur = pCur->parent;
+        pCur = pCur->sibling;
+    }
+    uint64_t random = 88172645463325252ULL;
+    for (long i = picked - 1; i > 0; i--) {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        long j = random % (i + 1);
+        NODE *swap = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = swap;
+    }
+    long usable = 0;
+    for (long i = 0; i < picked; i++) {
+        if (buildPath(nodes[i], path, MAXLINELENGTH * 4) == 0) continue; // deeper than the buffer
+        paths[usable] = strdup(path);
+        if (paths[usable] == NULL) break;
+        nodes[usable++] = nodes[i];
+    }
+
+    // time both ways (with the same findNode), checking that each finds the right node
+    double seconds[2];
+    long wrong = 0;
+    for (int indexed = 0; indexed < 2; indexed++) {
+        lookupsOn = indexed;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long i = 0; i < usable; i++) wrong += findNode(root, paths[i]) != nodes[i];
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        seconds[indexed] = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    }
+    lookupsOn = 1;
+
+    printf("%ld lookups: %.0f ns each walking, %.0f ns each with the index (%zu paths, %zu KiB)\n", usable,
+        usable ? seconds[0] * 1e9 / usable : 0.0, usable ? seconds[1] * 1e9 / usable : 0.0, entries,
+        capacity * sizeof(NODE*) / 1024);
+    if (wrong != 0) printf("%ld lookups found the wrong node!\n", wrong);
+
+    for (long i = 0; i < usable; i++) free(paths[i]);
+    free(nodes);
+    free(paths);
+    free(path);
+}
+
+
+/*
+    pathindex [on | off | bench [count]]
+    on builds the index of every absolute path in the tree, and absolute lookups use it from then
+    on. off frees it. bench times count lookups (PATHBENCHLOOKUPS by default) of absolute paths
+    spread over the tree, walking and with the index. with no argument, prints whether it is on.
+*/
+void pathIndex(NODE *root, char *args) {
+    char *command = args ? strtok(args, " ") : NULL;
+    char *arg = command ? strtok(NULL, " ") : NULL;
+
+    if (command == NULL) {
+        if (slots == NULL) printf("Path index off\n");
+        else printf("Path index on: %zu paths, %zu KiB\n", entries, capacity * sizeof(NODE*) / 1024);
+        return;
+    }
+
+    if (strcmp(command, "on") == 0) {
+        indexRoot = root;
+        if (fillTable(root) < 0) {
+            printf("Error: memory allocation failed!\n");
+            return;
+        }
+        lookupsOn = 1;
+        printf("Path index on: %zu paths, %zu KiB\n", entries, capacity * sizeof(NODE*) / 1024);
+        return;
+    }
+
+    if (strcmp(command, "off") == 0) {
+        dropTable();
+        return;
+    }
+
+    if (strcmp(command, "bench") == 0) {
+        long count = arg ? strtol(arg, NULL, 10) : PATHBENCHLOOKUPS;
+        // the index is only built for the benchmark if it is off
+        int wasOn = (slots != NULL);
+        if (!wasOn) {
+            indexRoot = root;
+            if (fillTable(root) < 0) {
+                printf("Error: memory allocation failed!\n");
+                return;
+            }
+        }
+        benchLookups(root, count);
+        if (!wasOn) dropTable();
+        return;
+    }
+
+    printf("Usage: pathindex [on | off | bench [count]]\n");
+}
@@ -0,0 +1,49 @@
+#ifndef __PATHINDEX_H__
+#define __PATHINDEX_H__
+
+#include "node.h"
+
+// an optional hash table from absolute path to node over the whole live tree, so an absolute
+// path resolves in one probe instead of a scan of every directory's children along the way
+// (findNode, navigateToAbsolutePath). every node carries the FNV-1a hash of its absolute path,
+// extended from its parent's (newNode), so the table only stores node pointers: open addressing
+// with linear probing, kept at most half full - 8 to 16 bytes per node while it is on. a hit is
+// verified against the names up the node's parent chain, so a hash collision is never returned
+// creates and removes update it (rm -r drops the whole subtree), and whole-tree changes (reload,
+// bload, map, compact) rebuild it. "pathindex off" frees it and lookups walk again
+// mv changes the path of everything under the moved node: with the index on their keys are
+// recomputed and reinserted (O(subtree) - the price of keying by absolute path), and with it off
+// they are left stale and recomputed by the fill that turns it back on, so mv stays O(depth)
+// after bload -l the index only holds what has been read from the snapshot, so a miss falls back
+// to the walk (which reads the directories on the way) until all of it has been read
+#define PATHHASHBASIS 0xcbf29ce484222325ULL   // FNV-1a offset basis - root's hash (of the empty string)
+#define PATHHASHPRIME 0x100000001b3ULL
+#define PATHINDEXMINSLOTS 1024
+#define PATHBENCHLOOKUPS 100000               // default lookups per pathindex bench
+
+
+// main command function. runs "pathindex [on | off | bench [count]]"
+void pathIndex(NODE *root, char *args);
+
+// the path hash of a child called name of a directory with path hash hash
+uint64_t extendPathHash(uint64_t hash, char *name);
+// resolves the first length bytes of the absolute path pathName from the index, if it can
+// returns 0 if it can't answer (index off, cwd not in the live tree, or a path with ., .. or
+// extra slashes), otherwise 1 with the node, or NULL if there is none, in *node
+int pathIndexLookup(NODE *cwd, char *pathName, size_t length, NODE **node);
+// whether nodes linked or unlinked under dir have to be added to or deleted from the index
+// (only if dir's tree is the indexed one - scratch trees, like diff's and convert's, and trees
+// being loaded, which are covered by a rebuild afterwards, have another root)
+int pathIndexCovers(NODE *dir);
+// call after linking node into the live tree / before unlinking it (no-ops while the index is off)
+void pathIndexAdd(NODE *node);
+void pathIndexDelete(NODE *node);
+// call after linking node and everything under it (import) / before unlinking them (rm -r)
+void pathIndexAddSubtree(NODE *node);
+void pathIndexDeleteSubtree(NODE *node);
+// call after moving node to a new parent or name (pathIndexDeleteSubtree before unlinking it)
+void pathIndexMove(NODE *node);
+// call after a whole-tree change under root (does nothing unless root is the indexed tree)
+void pathIndexRebuild(NODE *root);
+
+#endif /* __PATHINDEX_H__ */
@@ -0,0 +1,206 @@
+#include <sys/epoll.h>
+#include "csapp.h"
+#include "server.h"
+#include "concurrent.h"
+#include "journal.h"
+
+// one client connection
+typedef struct connection {
+    int fd;
+    rio_t rio;                          // buffered reads from the (nonblocking) socket
+    SESSION *session;                   // its cwd - command output is flushed to out
+    char line[MAXLINELENGTH];           // the line being read (may arrive in pieces)
+    size_t lineLength;
+    int overlong;                       // the line outgrew line - the rest of it is dropped up to its newline
+    FILE *out;                          // replies waiting to be sent (a memory stream)
+    char *outBuffer;
+    size_t outSize;
+    size_t outSent;                     // bytes of outBuffer already written to the socket
+    int quitting;                       // close once the replies are sent
+} CONNECTION;
+
+static int epollFd;
+static volatile sig_atomic_t stopping = 0;
+
+
+static void stopServer(int sig) {
+    stopping = 1;
+}
+
+// watch the connection for input, or only for room to write while replies are backed up
+static void watchConnection(CONNECTION *connection, int op) {
+    struct epoll_event event;
+    event.events = (connection->outSize > connection->outSent || connection->quitting) ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = connection;
+    epoll_ctl(epollFd, op, connection->fd, &event);
+}
+
+static void closeConnection(CONNECTION *connection) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    sessionClose(connection->session);
+    fclose(connection->out);
+    free(connection->outBuffer);
+    free(connection);
+}
+
+// accepts every waiting client
+static void acceptConnections(NODE *root, int listenFd) {
+    while (1) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) return; // EAGAIN - no more waiting (or a client that gave up)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        CONNECTION *connection = calloc(1, sizeof(CONNECTION));
+        if (connection != NULL) connection->out = open_memstream(&connection->outBuffer, &connection->outSize);
+        if (connection != NULL && connection->out != NULL) connection->session = sessionOpen(root, connection->out);
+        if (connection == NULL || connection->session == NULL) {
+            printf("Error: memory allocation failed!\n");
+            if (connection != NULL && connection->out != NULL) {
+                fclose(connection->out);
+                free(connection->outBuffer);
+            }
+            free(connection);
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        rio_readinitb(&connection->rio, fd);
+        watchConnection(connection, EPOLL_CTL_ADD);
+    }
+}
+
+// writes as much of the queued replies as the socket takes. returns -1 if the client is gone
+static int sendReplies(CONNECTION *connection) {
+    fflush(connection->out);
+    while (connection->outSent < connection->outSize) {
+        ssize_t written = write(connection->fd, connection->outBuffer + connection->outSent,
+            connection->outSize - connection->outSent);
+        if (written < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        connection->outSent += written;
+    }
+    // all sent - reuse the stream from the start
+    rewind(connection->out);
+    fflush(connection->out);
+    connection->outSent = 0;
+    return 0;
+}
+
+// replies to a line that didn't fit the line buffer (none of it is run)
+static void rejectLine(CONNECTION *connection) {
+    connection->overlong = 0;
+    fprintf(connection->out, "Line too long!\n\n");
+}
+
+// runs every complete line the client has sent (pipelined commands are all run in one go)
+// a line too long for the buffer is dropped whole and answered with an error
+// returns -1 if the connection failed
+static int readCommands(CONNECTION *connection) {
+    size_t lineMax = sizeof(connection->line) - 1;
+    while (!connection->quitting && ftell(connection->out) - connection->outSent < SERVERMAXPENDING) {
+        // rio_readlineb copies what it has before failing with EAGAIN, so zero the rest of the
+        // line first to find how much of it arrived
+        char *start = connection->line + connection->lineLength;
+        size_t room = sizeof(connection->line) - connection->lineLength;
+        memset(start, 0, room);
+        ssize_t result = rio_readlineb(&connection->rio, start, room);
+        if (result < 0) {
+            if (errno != EAGAIN) return -1;
+            // the rest of the line hasn't arrived yet (once the buffer is full, stop keeping it)
+            connection->lineLength += strnlen(start, room - 1);
+            if (connection->lineLength == lineMax) connection->overlong = 1;
+            if (connection->overlong) connection->lineLength = 0;
+            return 0;
+        }
+        if (result == 0) {
+            // client is done sending - answer what it sent, then close
+            if (connection->overlong) rejectLine(connection);
+            connection->quitting = 1;
+            break;
+        }
+
+        // a complete line, or a full buffer with more of the line still to come
+        size_t length = connection->lineLength + result;
+        connection->lineLength = 0;
+        if (connection->line[length - 1] != '\n' && length == lineMax) {
+            connection->overlong = 1;
+            continue;
+        }
+        if (connection->overlong) {
+            // the end of a line that was too long
+            rejectLine(connection);
+            continue;
+        }
+        char *command = connection->line;
+        while (*command == ' ') command++;
+        if (*command == '\n' || *command == '\r' || *command == 0) continue; // blank line - no reply
+        if (strncmp(command, "quit", 4) == 0 && strchr(" \r\n", command[4]) != NULL) {
+            connection->quitting = 1;
+            break;
+        }
+        sessionRun(connection->session, connection->line);
+        sessionFlush(connection->session);
+        fputc('\n', connection->out); // end of this command's reply
+    }
+    fflush(connection->out);
+    return 0;
+}
+
+// handles one ready connection. returns -1 once it should be closed
+static int serveConnection(CONNECTION *connection, unsigned int events) {
+    if (events & EPOLLERR) return -1;
+    if (events & EPOLLIN) {
+        if (readCommands(connection) < 0) return -1;
+    }
+    if (sendReplies(connection) < 0) return -1;
+    if (connection->outSent == connection->outSize) {
+        if (connection->quitting) return -1;
+        // it was waiting on output - catch up on lines already buffered, which epoll won't report
+        if (!(events & EPOLLIN) && connection->rio.rio_cnt > 0) {
+            if (readCommands(connection) < 0 || sendReplies(connection) < 0) return -1;
+        }
+    }
+    watchConnection(connection, EPOLL_CTL_MOD);
+    return 0;
+}
+
+
+// serves the tree at root on port until SIGINT/SIGTERM. every connection gets its own session
+// (and cwd). one thread multiplexes every client with epoll, and sockets never block it
+int runServer(NODE *root, char *port) {
+    int listenFd = open_listenfd(port);
+    if (listenFd < 0) {
+        printf("Failed to listen on port: %s\n", port);
+        return 1;
+    }
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+    epollFd = epoll_create1(0);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // NULL marks the listening socket
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+
+    signal(SIGPIPE, SIG_IGN); // a client vanishing mid-reply shows up as a write error instead
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    printf("Serving on port %s\n", port);
+    fflush(stdout);
+
+    struct epoll_event events[SERVERMAXEVENTS];
+    while (!stopping) {
+        int ready = epoll_wait(epollFd, events, SERVERMAXEVENTS, SERVERIDLEMSEC);
+        for (int i = 0; i < ready; i++) {
+            CONNECTION *connection = events[i].data.ptr;
+            if (connection == NULL) acceptConnections(root, listenFd);
+            else if (serveConnection(connection, events[i].events) < 0) closeConnection(connection);
+        }
+        // group commits and checkpoints get a turn, like between commands at the prompt
+        journalIdle();
+    }
+
+    // open connections are dropped - their commands have all run
+    close(listenFd);
+    close(epollFd);
+    printf("Server stopped\n");
+    return 0;
+}
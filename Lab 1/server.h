@@ -0,0 +1,18 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include "node.h"
+
+// line protocol: a client sends commands one per line ("command arg\n"), and may send many before
+// reading any replies. each command's reply is its output followed by an empty line (no command
+// prints an empty line), in the order the commands were sent. blank lines get no reply, and
+// "quit" closes the connection once its earlier replies have been sent
+#define SERVERMAXEVENTS 256                 // ready connections handled per epoll_wait
+#define SERVERMAXPENDING (1 << 20)          // reply bytes queued before a connection stops being read
+#define SERVERIDLEMSEC 10                   // max wait between journal group commits
+
+// serves the tree at root on port until SIGINT/SIGTERM. every connection gets its own session
+// (and cwd). returns nonzero if the port could not be opened
+int runServer(NODE *root, char *port);
+
+#endif /* __SERVER_H__ */
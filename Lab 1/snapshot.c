@@ -0,0 +1,356 @@
+#include "commands.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "lazy.h"
+
+
+/*
+    bsave [filename]
+    Save the current filesystem tree as a binary snapshot in the file filename.
+*/
+void bsave(NODE *root, char *fileName) {
+    // if no file name was passed as an arg - give default file name
+    if (fileName == NULL) fileName = "ffsim-curdi.bin";
+
+    // write the snapshot (errors are printed by the helper)
+    writeSnapshot(root, fileName, 0);
+}
+
+/*
+    bload [-l] [filename]
+    Replace the filesystem tree with the binary snapshot in the file filename, and CWD with /.
+    The current tree is kept if the snapshot cannot be read.
+    With -l only the top level is loaded: every directory is read from the file the first time
+    something looks inside it, so loading takes the same time whatever the size of the tree.
+    The file must not change while it is in use.
+*/
+// NOTE: cwd is passed as a double pointer (like cd) because the old CWD is freed with the old tree
+void bload(NODE *root, NODE **cwd, char *fileName) {
+    int lazy = 0;
+
+    // parse the optional -l flag
+    if (fileName != NULL && strncmp(fileName, "-l", 2) == 0 && (fileName[2] == ' ' || fileName[2] == 0)) {
+        lazy = 1;
+        fileName += 2;
+        while (*fileName == ' ') fileName++;
+        if (*fileName == 0) fileName = NULL;
+    }
+
+    // if no file name was passed as an arg - give default file name
+    if (fileName == NULL) fileName = "ffsim-curdi.bin";
+
+    // read the snapshot into a separate tree first, so a bad file leaves the current tree alone
+    NODE *newRoot = lazy ? lazyOpen(fileName) : readSnapshot(fileName, NULL);
+    if (newRoot == NULL) return;
+
+    // swap it in
+    replaceFileTree(root, newRoot);
+    *cwd = root;
+
+    // the new tree bypasses the journal, so checkpoint it instead
+    journalCheckpoint(root, 1);
+}
+
+/*
+    convert infile outfile
+    Convert a file between the text format written by save and the binary snapshot format.
+    The direction is picked from the format of infile.
+*/
+void convert(char *fileNames) {
+    // parse the two file names ("infile outfile")
+    char *inFileName = fileNames ? strtok(fileNames, " ") : NULL;
+    char *outFileName = inFileName ? strtok(NULL, " ") : NULL;
+    if (outFileName == NULL) {
+        printf("Too few arguments!\n");
+        return;
+    }
+
+    // binary -> text
+    if (isSnapshotFile(inFileName)) {
+        NODE *tree = readSnapshot(inFileName, NULL);
+        if (tree == NULL) return;
+        save(tree, outFileName);
+        freeFileTree(tree);
+        return;
+    }
+
+    // text -> binary
+    FILE *infile = fopen(inFileName, "r");
+    if (infile == NULL) {
+        printf("Failed to open file: %s\n", inFileName);
+        return;
+    }
+    NODE *tree = newRootNode();
+    if (tree == NULL) {
+        printf("Error: memory allocation failed!\n");
+        fclose(infile);
+        return;
+    }
+    loadFileTree(tree, infile, 0); // the tree is empty, so the input is trusted like reload
+    fclose(infile);
+    writeSnapshot(tree, outFileName, 0);
+    freeFileTree(tree);
+}
+
+
+// writes the tree to a binary snapshot. returns 0 on success, -1 on failure (message printed)
+// the node table and name blob are built in memory with one BFS pass, then written with three
+// fwrite calls to a temporary file that is renamed over fileName (a failed save never clobbers it)
+int writeSnapshot(NODE *root, char *fileName, uint32_t generation) {
+    SNAPSHOTENTRY *entries = NULL;
+    char *names = NULL;
+    NODE **nodes = NULL; // node of each entry - the BFS queue is the table itself
+    size_t entryCapacity = 1024, nameCapacity = 16 * 1024;
+    size_t nodeCount = 0, nameBytes = 0;
+    int status = -1;
+
+    // the table holds every directory's children, so the whole tree has to be in memory
+    lazyExpandAll(root);
+
+    entries = malloc(entryCapacity * sizeof(SNAPSHOTENTRY));
+    names = malloc(nameCapacity);
+    nodes = malloc(entryCapacity * sizeof(NODE*));
+    if (entries == NULL || names == NULL || nodes == NULL) goto nomem;
+
+    // the root entry (its name is not stored)
+    memset(&entries[0], 0, sizeof(SNAPSHOTENTRY));
+    entries[0].type = root->type;
+    nodes[0] = root;
+    nodeCount = 1;
+
+    // BFS: each directory taken off the queue appends all of its children, so they end up together
+    for (size_t i = 0; i < nodeCount; i++) {
+        NODE *dir = nodes[i];
+        if (dir->type != 'D') continue;
+        entries[i].firstChild = dir->child ? nodeCount : 0;
+        entries[i].dirs = dir->dirs;
+        entries[i].files = dir->files;
+
+        for (NODE *pCur = dir->child; pCur != NULL; pCur = pCur->sibling) {
+            size_t nameLength = strlen(pCur->name);
+
+            // grow the arrays
+            if (nodeCount == entryCapacity) {
+                SNAPSHOTENTRY *newEntries = realloc(entries, 2 * entryCapacity * sizeof(SNAPSHOTENTRY));
+                if (newEntries == NULL) goto nomem;
+                entries = newEntries;
+                NODE **newNodes = realloc(nodes, 2 * entryCapacity * sizeof(NODE*));
+                if (newNodes == NULL) goto nomem;
+                nodes = newNodes;
+                entryCapacity *= 2;
+            }
+            if (nameBytes + nameLength > nameCapacity) {
+                char *newNames = realloc(names, 2 * nameCapacity);
+                if (newNames == NULL) goto nomem;
+                names = newNames;
+                nameCapacity *= 2;
+            }
+            if (nodeCount > UINT32_MAX || nameBytes + nameLength > UINT32_MAX) {
+                printf("Tree too large for a snapshot!\n");
+                goto done;
+            }
+
+            // add the entry and its name
+            SNAPSHOTENTRY *entry = &entries[nodeCount];
+            memset(entry, 0, sizeof(SNAPSHOTENTRY));
+            entry->parent = i;
+            entry->nameOffset = nameBytes;
+            entry->nameLength = nameLength;
+            entry->type = pCur->type;
+            memcpy(names + nameBytes, pCur->name, nameLength);
+            nameBytes += nameLength;
+            nodes[nodeCount++] = pCur;
+            entries[i].childCount++;
+        }
+    }
+
+    // fill in the header
+    SNAPSHOTHEADER header;
+    memcpy(header.magic, SNAPSHOTMAGIC, sizeof(header.magic));
+    header.version = SNAPSHOTVERSION;
+    header.nodeCount = nodeCount;
+    header.nameBytes = nameBytes;
+    header.checksum = snapshotChecksum(0, entries, nodeCount * sizeof(SNAPSHOTENTRY));
+    header.checksum = snapshotChecksum(header.checksum, names, nameBytes);
+    header.generation = generation;
+
+    // write to "<fileName>.tmp" and rename it into place
+    char *tempFileName = malloc(strlen(fileName) + 5);
+    if (tempFileName == NULL) goto nomem;
+    sprintf(tempFileName, "%s.tmp", fileName);
+
+    FILE *outfile = fopen(tempFileName, "wb");
+    if (outfile == NULL) {
+        printf("Failed to open file: %s\n", tempFileName);
+        free(tempFileName);
+        goto done;
+    }
+    fwrite(&header, sizeof(header), 1, outfile);
+    fwrite(entries, sizeof(SNAPSHOTENTRY), nodeCount, outfile);
+    fwrite(names, 1, nameBytes, outfile);
+    if (ferror(outfile) | fclose(outfile)) {
+        printf("Failed to write file: %s\n", tempFileName);
+        remove(tempFileName);
+    }
+    else if (rename(tempFileName, fileName) != 0) {
+        printf("Failed to write file: %s\n", fileName);
+        remove(tempFileName);
+    }
+    else {
+        status = 0;
+    }
+    free(tempFileName);
+    goto done;
+
+nomem:
+    printf("Error: memory allocation failed!\n");
+done:
+    free(entries);
+    free(names);
+    free(nodes);
+    return status;
+}
+
+// reads a binary snapshot into a new tree. returns its root, or NULL on failure (message printed)
+// the whole file is pulled in with a single read, checked, and then linked straight from the
+// node table - parents always come before their children (in either version), so no path parsing
+// is needed
+NODE *readSnapshot(char *fileName, uint32_t *generation) {
+    // open a file stream
+    FILE *infile = fopen(fileName, "rb");
+
+    // check for file open failure
+    if (infile == NULL) {
+        printf("Failed to open file: %s\n", fileName);
+        return NULL;
+    }
+
+    // read the whole file
+    long fileSize = -1;
+    if (fseek(infile, 0, SEEK_END) == 0) fileSize = ftell(infile);
+    rewind(infile);
+    if (fileSize < (long)sizeof(SNAPSHOTHEADER)) {
+        printf("Not a snapshot file: %s\n", fileName);
+        fclose(infile);
+        return NULL;
+    }
+    char *buffer = malloc(fileSize);
+    if (buffer == NULL) {
+        printf("Error: memory allocation failed!\n");
+        fclose(infile);
+        return NULL;
+    }
+    size_t bytesRead = fread(buffer, 1, fileSize, infile);
+    fclose(infile);
+    if (bytesRead != (size_t)fileSize) {
+        printf("Failed to read file: %s\n", fileName);
+        free(buffer);
+        return NULL;
+    }
+
+    // check the header
+    SNAPSHOTHEADER *header = (SNAPSHOTHEADER*)buffer;
+    if (memcmp(header->magic, SNAPSHOTMAGIC, sizeof(header->magic)) != 0) {
+        printf("Not a snapshot file: %s\n", fileName);
+        free(buffer);
+        return NULL;
+    }
+    if (header->version != 1 && header->version != SNAPSHOTVERSION) {
+        printf("Unsupported snapshot version %u: %s\n", header->version, fileName);
+        free(buffer);
+        return NULL;
+    }
+    // version 1 entries are shorter, but the fields used here are laid out the same
+    size_t entrySize = header->version == 1 ? SNAPSHOTV1ENTRYSIZE : sizeof(SNAPSHOTENTRY);
+    char *table = buffer + sizeof(SNAPSHOTHEADER);
+    char *names = table + (uint64_t)header->nodeCount * entrySize;
+    if (header->nodeCount == 0
+            || (uint64_t)fileSize != sizeof(SNAPSHOTHEADER) + (uint64_t)header->nodeCount * entrySize + header->nameBytes
+            || snapshotChecksum(snapshotChecksum(0, table, header->nodeCount * entrySize), names, header->nameBytes) != header->checksum
+            || ((SNAPSHOTENTRY*)table)->type != 'D') {
+        printf("Corrupt snapshot: %s\n", fileName);
+        free(buffer);
+        return NULL;
+    }
+
+    // node pointer for each entry, and the last child linked under it so far
+    NODE **nodes = malloc(header->nodeCount * sizeof(NODE*));
+    NODE **lastChildren = calloc(header->nodeCount, sizeof(NODE*));
+    NODE *root = newRootNode();
+    if (nodes == NULL || lastChildren == NULL || root == NULL) {
+        printf("Error: memory allocation failed!\n");
+        free(nodes);
+        free(lastChildren);
+        free(root);
+        free(buffer);
+        return NULL;
+    }
+    nodes[0] = root;
+
+    // link every entry under its parent, in order
+    char name[sizeof(root->name)];
+    uint32_t i;
+    for (i = 1; i < header->nodeCount; i++) {
+        SNAPSHOTENTRY *entry = (SNAPSHOTENTRY*)(table + i * entrySize);
+
+        // the checksum only catches accidents, so check everything used for indexing
+        if (entry->parent >= i || nodes[entry->parent]->type != 'D'
+                || (entry->type != 'D' && entry->type != 'F')
+                || entry->nameLength == 0 || entry->nameLength >= sizeof(name)
+                || (uint64_t)entry->nameOffset + entry->nameLength > header->nameBytes) {
+            printf("Corrupt snapshot: %s\n", fileName);
+            break;
+        }
+        memcpy(name, names + entry->nameOffset, entry->nameLength);
+        name[entry->nameLength] = 0;
+
+        // allocate the node
+        NODE *parent = nodes[entry->parent];
+        NODE *node = newNode(parent, name, entry->type);
+        if (node == NULL) {
+            printf("Error: memory allocation failed!\n");
+            break;
+        }
+
+        // append it to its parent's children
+        if (lastChildren[entry->parent] == NULL) parent->child = node;
+        else lastChildren[entry->parent]->sibling = node;
+        lastChildren[entry->parent] = node;
+        nodes[i] = node;
+    }
+
+    // a partial tree is useless - drop it
+    if (i != header->nodeCount) {
+        freeFileTree(root);
+        root = NULL;
+    }
+    else computeAggregates(root);
+
+    if (generation != NULL) *generation = header->generation;
+    free(nodes);
+    free(lastChildren);
+    free(buffer);
+    return root;
+}
+
+// returns 1 if fileName starts with the binary snapshot magic
+int isSnapshotFile(char *fileName) {
+    char magic[4];
+    FILE *infile = fopen(fileName, "rb");
+    if (infile == NULL) return 0;
+    size_t bytesRead = fread(magic, 1, sizeof(magic), infile);
+    fclose(infile);
+    return bytesRead == sizeof(magic) && memcmp(magic, SNAPSHOTMAGIC, sizeof(magic)) == 0;
+}
+
+// FNV-1a hash used as the snapshot checksum. pass the previous result as hash to continue a checksum
+// (0 starts a new one)
+uint32_t snapshotChecksum(uint32_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    if (hash == 0) hash = 2166136261u; // FNV offset basis
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u; // FNV prime
+    }
+    return hash;
+}
@@ -0,0 +1,55 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+#include "node.h"
+
+// binary snapshot file format
+// header | node table (nodeCount entries, root first) | name blob (nameBytes)
+// integers are stored in the host byte order. the checksum covers the node table and the name blob
+// version 2 writes the table breadth first, so every directory's children are one contiguous run of
+// entries (and of names) that its entry points to - a directory's listing is two reads at known
+// offsets, which is what bload -l loads on demand (see lazy.h). version 1 (DFS pre-order, without
+// the directory fields) can still be read
+#define SNAPSHOTMAGIC "FFSB"
+#define SNAPSHOTVERSION 2
+#define SNAPSHOTV1ENTRYSIZE 12  // size of a version 1 entry (the fields up to reserved)
+
+typedef struct snapshotHeader {
+	char     magic[4];      // SNAPSHOTMAGIC
+	uint32_t version;       // SNAPSHOTVERSION
+	uint32_t nodeCount;     // number of entries in the node table (root included)
+	uint32_t nameBytes;     // size of the name blob
+	uint32_t checksum;      // FNV-1a of the node table followed by the name blob
+	uint32_t generation;    // journal generation a checkpoint picks up from (0 for a plain bsave)
+} SNAPSHOTHEADER;
+
+typedef struct snapshotEntry {
+	uint32_t parent;        // index of the parent's entry (always lower, root is its own parent)
+	uint32_t nameOffset;    // offset of the name in the name blob (not null terminated)
+	uint8_t  nameLength;
+	char     type;
+	uint16_t reserved;      // 0
+	// version 2 only
+	uint32_t firstChild;    // (directories) index of the first child's entry (0 if there are none)
+	uint32_t childCount;    // (directories) number of children, whose entries follow firstChild
+	uint32_t dirs, files;   // (directories) subtree aggregates
+} SNAPSHOTENTRY;
+
+
+// main command functions
+void bsave(NODE *root, char *fileName);
+void bload(NODE *root, NODE **cwd, char *fileName);
+void convert(char *fileNames);
+
+// writes the tree to a binary snapshot. returns 0 on success, -1 on failure (message printed)
+int writeSnapshot(NODE *root, char *fileName, uint32_t generation);
+// reads a binary snapshot into a new tree. returns its root, or NULL on failure (message printed)
+// the header's generation is returned through generation (if not NULL)
+NODE *readSnapshot(char *fileName, uint32_t *generation);
+// returns 1 if fileName starts with the binary snapshot magic
+int isSnapshotFile(char *fileName);
+// FNV-1a hash used as the snapshot checksum. pass the previous result as hash to continue a checksum
+uint32_t snapshotChecksum(uint32_t hash, const void *data, size_t length);
+
+#endif /* __SNAPSHOT_H__ */
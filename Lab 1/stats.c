@@ -0,0 +1,145 @@
+#include <time.h>
+#include "stats.h"
+
+static HISTOGRAM commandLatency[STATSMAXCOMMANDS];
+static char *commandNames[STATSMAXCOMMANDS];
+static HISTOGRAM phaseLatency[PHASECOUNT];
+static HISTOGRAM scanLengths;
+static uint64_t counters[COUNTERCOUNT];
+
+static char *phaseNames[PHASECOUNT] = {"(lookup)", "save: write", "save: sync", "reload: load", "reload: checkpoint"};
+static char *counterNames[COUNTERCOUNT] = {"nodes created", "nodes freed", "bytes saved", "bytes loaded"};
+
+
+// the bucket value falls in
+static int bucketOf(uint64_t value) {
+    if (value < STATSSUBBUCKETS) return value;
+    int shift = 63 - __builtin_clzll(value) - STATSSUBBITS;
+    return (shift + 1) * STATSSUBBUCKETS + (int)(value >> shift) - STATSSUBBUCKETS;
+}
+
+// the highest value in a bucket
+static uint64_t bucketTop(int bucket) {
+    if (bucket < STATSSUBBUCKETS) return bucket;
+    int shift = bucket / STATSSUBBUCKETS - 1;
+    uint64_t bottom = (uint64_t)(bucket % STATSSUBBUCKETS + STATSSUBBUCKETS) << shift;
+    return bottom + (1ULL << shift) - 1;
+}
+
+// adds a value to a histogram (not thread safe)
+void histogramRecord(HISTOGRAM *histogram, uint64_t value) {
+    histogram->count++;
+    histogram->total += value;
+    if (value > histogram->max) histogram->max = value;
+    histogram->buckets[bucketOf(value)]++;
+}
+
+// adds every value recorded in from to into (not thread safe)
+void histogramMerge(HISTOGRAM *into, HISTOGRAM *from) {
+    into->count += from->count;
+    into->total += from->total;
+    if (from->max > into->max) into->max = from->max;
+    for (int bucket = 0; bucket < STATSBUCKETS; bucket++) into->buckets[bucket] += from->buckets[bucket];
+}
+
+// the value at or below which a fraction of the recorded values are (within a bucket)
+uint64_t histogramPercentile(HISTOGRAM *histogram, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * histogram->count + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < STATSBUCKETS; bucket++) {
+        seen += histogram->buckets[bucket];
+        if (seen >= rank) {
+            uint64_t top = bucketTop(bucket);
+            return top < histogram->max ? top : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+// writes nanoseconds in the most readable unit
+static char *formatTime(char *buffer, uint64_t nanoseconds) {
+    if (nanoseconds < 10000) sprintf(buffer, "%lu ns", (unsigned long)nanoseconds);
+    else if (nanoseconds < 10000000) sprintf(buffer, "%.1f us", nanoseconds / 1e3);
+    else if (nanoseconds < 10000000000ULL) sprintf(buffer, "%.1f ms", nanoseconds / 1e6);
+    else sprintf(buffer, "%.1f s", nanoseconds / 1e9);
+    return buffer;
+}
+
+static void printLatency(char *name, HISTOGRAM *histogram) {
+    char p50[16], p99[16], max[16], total[16];
+    printf("%-20s %10lu %10s %10s %10s %10s\n", name, (unsigned long)histogram->count,
+        formatTime(p50, histogramPercentile(histogram, 0.5)), formatTime(p99, histogramPercentile(histogram, 0.99)),
+        formatTime(max, histogram->max), formatTime(total, histogram->total));
+}
+
+
+/*
+    stats [reset]
+    Print the count, p50, p99, max and total time of every command run so far (and of the command
+    lookup and the phases of save and reload), then the node and byte counters and how many
+    siblings lookups scanned. reset clears them.
+*/
+void stats(char *args) {
+    if (args != NULL) {
+        if (strcmp(args, "reset") != 0) {
+            printf("Usage: stats [reset]\n");
+            return;
+        }
+        memset(commandLatency, 0, sizeof(commandLatency));
+        memset(phaseLatency, 0, sizeof(phaseLatency));
+        memset(&scanLengths, 0, sizeof(scanLengths));
+        for (int i = 0; i < COUNTERCOUNT; i++) __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+        return;
+    }
+
+    printf("%-20s %10s %10s %10s %10s %10s\n", "command", "count", "p50", "p99", "max", "total");
+    for (int i = 0; i < STATSMAXCOMMANDS; i++) {
+        if (commandLatency[i].count > 0) printLatency(commandNames[i], &commandLatency[i]);
+    }
+    for (int i = 0; i < PHASECOUNT; i++) {
+        if (phaseLatency[i].count > 0) printLatency(phaseNames[i], &phaseLatency[i]);
+    }
+    for (int i = 0; i < COUNTERCOUNT; i++) {
+        printf("%-20s %10lu\n", counterNames[i], (unsigned long)__atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+    }
+    uint64_t scans = __atomic_load_n(&scanLengths.count, __ATOMIC_RELAXED);
+    if (scans > 0) {
+        printf("sibling scans %lu: mean %.1f, p50 %lu, p99 %lu, max %lu\n", (unsigned long)scans,
+            (double)__atomic_load_n(&scanLengths.total, __ATOMIC_RELAXED) / scans, (unsigned long)histogramPercentile(&scanLengths, 0.5),
+            (unsigned long)histogramPercentile(&scanLengths, 0.99), (unsigned long)__atomic_load_n(&scanLengths.max, __ATOMIC_RELAXED));
+    }
+}
+
+// nanoseconds on the monotonic clock
+uint64_t statsNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// records a command's latency (only the command loop's thread runs commands through here)
+void statsCommand(int command, char *name, uint64_t nanoseconds) {
+    if (command < 0 || command >= STATSMAXCOMMANDS) return;
+    commandNames[command] = name;
+    histogramRecord(&commandLatency[command], nanoseconds);
+}
+
+// records the latency of a phase
+void statsPhase(int phase, uint64_t nanoseconds) {
+    histogramRecord(&phaseLatency[phase], nanoseconds);
+}
+
+// adds to a counter (from any thread)
+void statsCount(int counter, uint64_t amount) {
+    __atomic_add_fetch(&counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+// records how many siblings a lookup or insert scanned (from any thread)
+void statsScan(uint64_t siblings) {
+    __atomic_add_fetch(&scanLengths.count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&scanLengths.total, siblings, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&scanLengths.buckets[bucketOf(siblings)], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&scanLengths.max, __ATOMIC_RELAXED);
+    while (siblings > max && !__atomic_compare_exchange_n(&scanLengths.max, &max, siblings, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
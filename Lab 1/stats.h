@@ -0,0 +1,53 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include "node.h"
+
+// latency histograms and counters for finding out which operations a replay spends its time in
+// the command loop times the command lookup and every command with the monotonic clock, and
+// save/reload time their phases. times go into HDR-style histograms: values below
+// STATSSUBBUCKETS get a bucket each, and every power of 2 above that is split into
+// STATSSUBBUCKETS equal buckets, so a percentile is off by at most 1/STATSSUBBUCKETS of its value
+// whatever its size - recording is a count-leading-zeros and three adds, with no allocation
+// the counters (nodes, bytes, sibling scans) are bumped from any thread, so they are atomic
+#define STATSSUBBITS 5
+#define STATSSUBBUCKETS (1 << STATSSUBBITS)
+#define STATSBUCKETS ((64 - STATSSUBBITS + 1) * STATSSUBBUCKETS)   // enough for any uint64_t
+#define STATSMAXCOMMANDS 64
+
+typedef struct histogram {
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint64_t buckets[STATSBUCKETS];
+} HISTOGRAM;
+
+// the timed phases of save and reload
+enum statsPhase { PHASEDISPATCH, PHASESAVEWRITE, PHASESAVESYNC, PHASERELOADLOAD, PHASERELOADCHECKPOINT, PHASECOUNT };
+
+// the counters
+enum statsCounter { COUNTNODESCREATED, COUNTNODESFREED, COUNTBYTESSAVED, COUNTBYTESLOADED, COUNTERCOUNT };
+
+
+// main command function. runs "stats [reset]"
+void stats(char *args);
+
+// nanoseconds on the monotonic clock
+uint64_t statsNow();
+// records a command's latency (command is its index in the command table, name its name)
+void statsCommand(int command, char *name, uint64_t nanoseconds);
+// records the latency of a phase
+void statsPhase(int phase, uint64_t nanoseconds);
+// adds to a counter
+void statsCount(int counter, uint64_t amount);
+// records how many siblings a lookup or insert scanned
+void statsScan(uint64_t siblings);
+// adds a value to a histogram (not thread safe)
+void histogramRecord(HISTOGRAM *histogram, uint64_t value);
+// adds every value recorded in from to into (not thread safe)
+void histogramMerge(HISTOGRAM *into, HISTOGRAM *from);
+// the value at or below which a fraction of the recorded values are (to within a bucket)
+uint64_t histogramPercentile(HISTOGRAM *histogram, double fraction);
+
+#endif /* __STATS_H__ */
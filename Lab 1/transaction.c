@@ -0,0 +1,462 @@
+#include "transaction.h"
+#include "cow.h"
+#include "dirindex.h"
+#include "journal.h"
+#include "pathindex.h"
+#include "lazy.h"
+#include "trigram.h"
+
+// a queued command
+typedef struct transactionOp {
+    char op;            // D (mkdir), F (creat), d (rmdir), f (rm) - the journal's letters
+    char *path;         // absolute, without ".", ".." or extra slashes
+} TRANSACTIONOP;
+
+// what commit knows about one path: what it held before the transaction and what it holds now
+typedef struct pathState {
+    char *path;         // NULL for an empty slot ("" is root)
+    size_t length;
+    uint64_t hash;
+    NODE *node;         // the node at the path (the new one once it is created)
+    char original;      // type before the transaction (0 if there was nothing)
+    char final;         // type after the commands checked so far (0 if there is nothing)
+    char replaced;      // removed, then created again
+    long children;      // (directories) children before the transaction (-1 until counted)
+    long childDelta;    // children created minus children removed
+} PATHSTATE;
+
+// the states of every path the queue touches (open addressing, sized up front so it never grows)
+typedef struct stateTable {
+    PATHSTATE *states;
+    size_t capacity;
+} STATETABLE;
+
+static TRANSACTIONOP *queued = NULL;
+static int queuedCount = 0, queuedCapacity = 0;
+static int transactionIsOpen = 0;
+
+
+// the state of the first length bytes of path, looked up in the tree the first time
+// returns NULL if allocation failed
+static PATHSTATE *stateOf(STATETABLE *table, NODE *root, char *path, size_t length) {
+    uint64_t hash = PATHHASHBASIS;
+    for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)path[i]) * PATHHASHPRIME;
+    size_t slot = (hash * 0x9e3779b97f4a7c15ULL >> 32) & (table->capacity - 1);
+    while (table->states[slot].path != NULL) {
+        PATHSTATE *state = &table->states[slot];
+        if (state->hash == hash && state->length == length && memcmp(state->path, path, length) == 0) return state;
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+
+    // first time - as it is in the tree
+    char *copy = malloc(length + 1);
+    if (copy == NULL) return NULL;
+    memcpy(copy, path, length);
+    copy[length] = 0;
+    PATHSTATE *state = &table->states[slot];
+    state->path = copy;
+    state->length = length;
+    state->hash = hash;
+    state->node = length == 0 ? root : findNode(root, copy);
+    state->original = state->final = state->node ? state->node->type : 0;
+    state->replaced = 0;
+    state->children = -1;
+    state->childDelta = 0;
+    return state;
+}
+
+// the children a directory's state has after the commands checked so far
+static long childrenOf(PATHSTATE *state) {
+    if (state->children < 0) {
+        state->children = 0;
+        if (state->original == 'D') {
+            lazyExpand(state->node);
+            for (NODE *pCur = state->node->child; pCur != NULL; pCur = pCur->sibling) state->children++;
+        }
+    }
+    return state->children + state->childDelta;
+}
+
+// checks one command against the states, and applies it to them. returns -1 (after printing the
+// error the command would have printed) if it would fail
+static int checkOp(STATETABLE *table, NODE *root, NODE *cwd, char op, char *path) {
+    size_t parentLength = strrchr(path, '/') - path;
+    PATHSTATE *parent = stateOf(table, root, path, parentLength);
+    PATHSTATE *target = parent ? stateOf(table, root, path, strlen(path)) : NULL;
+    if (target == NULL) {
+        printf("Error: memory allocation failed!\n");
+        return -1;
+    }
+    char *name = path + parentLength + 1;
+
+    if (op == 'D' || op == 'F') {
+        if (parent->final != 'D') {
+            printf("Path does not exist!\n");
+            return -1;
+        }
+        if (target->final != 0) {
+            if (op == 'D') printf("DIR %s already exists!\n", name);
+            if (op == 'F') printf("File %s already exists!\n", name);
+            return -1;
+        }
+        if (target->original != 0) target->replaced = 1; // removed earlier in the transaction
+        target->final = op;
+        parent->childDelta++;
+        return 0;
+    }
+
+    // the same checks as removeFile
+    char type = (op == 'd') ? 'D' : 'F';
+    if (target->final == 0) {
+        if (type == 'D') printf("DIR %s does not exist!\n", name);
+        if (type == 'F') printf("File %s does not exist!\n", name);
+        return -1;
+    }
+    if (type == 'D' && target->final == 'D' && childrenOf(target) > 0) {
+        printf("Cannot remove DIR %s (not empty)!\n", name);
+        return -1;
+    }
+    if (target->final != type) {
+        if (type == 'D') printf("Cannot remove %s (not a directory)!\n", name);
+        if (type == 'F') printf("Cannot remove %s (not a file)!\n", name);
+        return -1;
+    }
+    if (type == 'D' && !target->replaced) {
+        for (NODE *pCur = cwd; pCur->parent != pCur; pCur = pCur->parent) {
+            if (pCur == target->node) {
+                printf("Cannot remove %s (contains the CWD)!\n", name);
+                return -1;
+            }
+        }
+    }
+    target->final = 0;
+    parent->childDelta--;
+    return 0;
+}
+
+// orders states by parent path, then by name (so siblings are together, and a directory's own
+// group comes after the group it is created in)
+static int compareStates(const void *a, const void *b) {
+    PATHSTATE *first = *(PATHSTATE**)a, *second = *(PATHSTATE**)b;
+    size_t firstParent = strrchr(first->path, '/') - first->path;
+    size_t secondParent = strrchr(second->path, '/') - second->path;
+    size_t common = firstParent < secondParent ? firstParent : secondParent;
+    int result = memcmp(first->path, second->path, common);
+    if (result != 0) return result;
+    if (firstParent != secondParent) return firstParent < secondParent ? -1 : 1;
+    return strcmp(first->path + firstParent + 1, second->path + secondParent + 1);
+}
+
+static int compareDescending(const void *a, const void *b) {
+    return compareStates(b, a);
+}
+
+static int comparePointers(const void *a, const void *b) {
+    uintptr_t first = (uintptr_t)*(NODE**)a, second = (uintptr_t)*(NODE**)b;
+    return (first > second) - (first < second);
+}
+
+// appends "Xpath\0" to the journal payload. returns -1 if allocation failed
+static int addToPayload(char **payload, size_t *length, size_t *capacity, char op, char *path) {
+    size_t pathLength = strlen(path);
+    if (*length + pathLength + 2 > *capacity) {
+        size_t newCapacity = *capacity ? *capacity : 4096;
+        while (*length + pathLength + 2 > newCapacity) newCapacity *= 2;
+        char *newPayload = realloc(*payload, newCapacity);
+        if (newPayload == NULL) return -1;
+        *payload = newPayload;
+        *capacity = newCapacity;
+    }
+    (*payload)[(*length)++] = op;
+    memcpy(*payload + *length, path, pathLength + 1);
+    *length += pathLength + 1;
+    return 0;
+}
+
+// checks ops against the tree at root and, if every one of them would succeed, applies their net
+// effect and journals it as one transaction. returns 0 on success
+static int applyOps(NODE *root, NODE *cwd, TRANSACTIONOP *ops, int count) {
+    if (count == 0) return 0;
+    STATETABLE table = {NULL, 64};
+    while (table.capacity < 4 * (size_t)count) table.capacity *= 2;
+    table.states = calloc(table.capacity, sizeof(PATHSTATE));
+    PATHSTATE **removals = malloc(count * sizeof(PATHSTATE*));
+    PATHSTATE **creations = malloc(count * sizeof(PATHSTATE*));
+    NODE **group = malloc(count * sizeof(NODE*));
+    char *payload = NULL;
+    size_t payloadLength = 0, payloadCapacity = 0;
+    int status = -1;
+    if (table.states == NULL || removals == NULL || creations == NULL || group == NULL) {
+        printf("Error: memory allocation failed!\n");
+        goto done;
+    }
+
+    // check every command, in order
+    for (int i = 0; i < count; i++) {
+        if (checkOp(&table, root, cwd, ops[i].op, ops[i].path) < 0) {
+            printf("Transaction aborted at command %d of %d - nothing was changed\n", i + 1, count);
+            goto done;
+        }
+    }
+
+    // the net changes: nodes that go (and come back new), and nodes that are new
+    int removalCount = 0, creationCount = 0;
+    for (size_t slot = 0; slot < table.capacity; slot++) {
+        PATHSTATE *state = &table.states[slot];
+        if (state->path == NULL || state->length == 0) continue;
+        if (state->original != 0 && (state->final == 0 || state->replaced)) removals[removalCount++] = state;
+        if (state->final != 0 && (state->original == 0 || state->replaced)) creations[creationCount++] = state;
+    }
+    qsort(removals, removalCount, sizeof(PATHSTATE*), compareDescending);
+    qsort(creations, creationCount, sizeof(PATHSTATE*), compareStates);
+
+    // the journal record, in the order the changes are made - built and checked before anything
+    // changes, so a transaction that can't be journaled isn't applied either
+    for (int i = 0; i < removalCount; i++) {
+        if (addToPayload(&payload, &payloadLength, &payloadCapacity, removals[i]->original == 'D' ? 'd' : 'f', removals[i]->path) < 0) {
+            printf("Error: memory allocation failed!\n");
+            printf("Transaction aborted - nothing was changed\n");
+            goto done;
+        }
+    }
+    for (int i = 0; i < creationCount; i++) {
+        if (addToPayload(&payload, &payloadLength, &payloadCapacity, creations[i]->final, creations[i]->path) < 0) {
+            printf("Error: memory allocation failed!\n");
+            printf("Transaction aborted - nothing was changed\n");
+            goto done;
+        }
+    }
+    if (!journalTransactionFits(root, payload, payloadLength)) {
+        printf("Path too long to journal!\n");
+        printf("Transaction aborted - nothing was changed\n");
+        goto done;
+    }
+
+    // allocate every new node before changing anything (parents sort before their children)
+    NODE **oldNodes = (NODE**)group; // reused: the nodes being removed, before node is overwritten
+    for (int i = 0; i < removalCount; i++) oldNodes[i] = removals[i]->node;
+    for (int i = 0; i < creationCount; i++) {
+        PATHSTATE *state = creations[i];
+        size_t parentLength = strrchr(state->path, '/') - state->path;
+        PATHSTATE *parent = stateOf(&table, root, state->path, parentLength);
+        NODE *node = newNode(parent->node, state->path + parentLength + 1, state->final);
+        if (node == NULL) {
+            for (int j = 0; j < i; j++) freeNode(creations[j]->node);
+            printf("Error: memory allocation failed!\n");
+            printf("Transaction aborted - nothing was changed\n");
+            goto done;
+        }
+        state->node = node;
+    }
+
+    // removals, deepest parents first (a directory empties before its own removal). each parent's
+    // list is scanned once for all of its removed children
+    for (int i = 0; i < removalCount; ) {
+        NODE *parent = oldNodes[i]->parent;
+        int end = i;
+        while (end < removalCount && oldNodes[end]->parent == parent) end++;
+        qsort(oldNodes + i, end - i, sizeof(NODE*), comparePointers);
+
+        long dirs = 0, files = 0;
+        long long size = 0;
+        NODE *pPrev = NULL, *next;
+        for (NODE *pCur = parent->child; pCur != NULL; pCur = next) {
+            next = pCur->sibling;
+            if (bsearch(&pCur, oldNodes + i, end - i, sizeof(NODE*), comparePointers) == NULL) {
+                pPrev = pCur;
+                continue;
+            }
+            if (pathIndexCovers(parent)) pathIndexDelete(pCur);
+            if (trigramCovers(parent)) trigramDelete(pCur);
+            preserveLinks(pPrev ? pPrev : parent);
+            if (pPrev == NULL) parent->child = next;
+            else pPrev->sibling = next;
+            indexRemove(parent, pCur);
+            dirs -= (pCur->type == 'D');
+            files -= (pCur->type == 'F');
+            size -= pCur->size;
+            releaseNode(pCur);
+        }
+        updateAggregates(parent, dirs, files, size);
+        i = end;
+    }
+
+    // creations, parents first. each parent's list is scanned once, for its last child
+    for (int i = 0; i < creationCount; ) {
+        NODE *parent = creations[i]->node->parent;
+        NODE *last = lastChildOf(parent);
+        preserveLinks(last ? last : parent);
+        long dirs = 0, files = 0;
+        for (; i < creationCount && creations[i]->node->parent == parent; i++) {
+            NODE *node = creations[i]->node;
+            if (last == NULL) parent->child = node;
+            else last->sibling = node;
+            last = node;
+            indexInsert(parent, node);
+            if (pathIndexCovers(parent)) pathIndexAdd(node);
+            if (trigramCovers(parent)) trigramAdd(node);
+            dirs += (node->type == 'D');
+            files += (node->type == 'F');
+        }
+        updateAggregates(parent, dirs, files, 0);
+    }
+
+    if (payloadLength > 0) journalTransaction(root, payload, payloadLength);
+    status = 0;
+
+done:
+    for (size_t slot = 0; table.states != NULL && slot < table.capacity; slot++) free(table.states[slot].path);
+    free(table.states);
+    free(removals);
+    free(creations);
+    free(group);
+    free(payload);
+    return status;
+}
+
+// drops the queued commands
+static void clearQueue() {
+    for (int i = 0; i < queuedCount; i++) free(queued[i].path);
+    queuedCount = 0;
+}
+
+
+/*
+    begin
+    Start a transaction: mkdir, creat, rmdir and rm are queued until commit (or abort).
+*/
+void begin() {
+    if (transactionIsOpen) {
+        printf("Transaction already open!\n");
+        return;
+    }
+    transactionIsOpen = 1;
+}
+
+/*
+    commit
+    Apply the commands queued since begin as one change. If any of them would fail, its error is
+    printed and none of them are applied.
+*/
+void commit(NODE *root, NODE *cwd) {
+    if (!transactionIsOpen) {
+        printf("No open transaction!\n");
+        return;
+    }
+    applyOps(root, cwd, queued, queuedCount);
+    clearQueue();
+    transactionIsOpen = 0;
+}
+
+/*
+    abort
+    Drop the commands queued since begin.
+*/
+void abortTransaction() {
+    if (!transactionIsOpen) {
+        printf("No open transaction!\n");
+        return;
+    }
+    clearQueue();
+    transactionIsOpen = 0;
+}
+
+// 1 between begin and commit/abort
+int transactionOpen() {
+    return transactionIsOpen;
+}
+
+// queues a command (op is D for mkdir, F for creat, d for rmdir, f for rm) on pathName
+void transactionAdd(NODE *cwd, char op, char *pathName) {
+    if (pathName == NULL) {
+        printf("Too few arguments!\n");
+        return;
+    }
+
+    // make the path absolute: the CWD's path (built backwards from the parent links), then pathName
+    size_t cwdLength = 0;
+    for (NODE *pCur = cwd; pCur->parent != pCur; pCur = pCur->parent) cwdLength += strlen(pCur->name) + 1;
+    size_t pathLength = strlen(pathName);
+    char *path = malloc(cwdLength + pathLength + 2);
+    if (path == NULL) {
+        printf("Error: memory allocation failed!\n");
+        return;
+    }
+    size_t length = 0;
+    if (pathName[0] != '/') {
+        char *start = path + cwdLength;
+        for (NODE *pCur = cwd; pCur->parent != pCur; pCur = pCur->parent) {
+            size_t nameLength = strlen(pCur->name);
+            start -= nameLength;
+            memcpy(start, pCur->name, nameLength);
+            *--start = '/';
+        }
+        length = cwdLength;
+    }
+
+    // append pathName's names, dropping "." and extra slashes and resolving ".."
+    char *name = pathName;
+    while (*name != 0) {
+        while (*name == '/') name++;
+        size_t nameLength = strcspn(name, "/");
+        if (nameLength == 0) break;
+        if (nameLength == 1 && name[0] == '.') {
+            // stay here
+        }
+        else if (nameLength == 2 && name[0] == '.' && name[1] == '.') {
+            while (length > 0 && path[--length] != '/');
+        }
+        else if (nameLength >= sizeof(cwd->name)) {
+            printf("Name too long: %.*s\n", (int)nameLength, name);
+            free(path);
+            return;
+        }
+        else {
+            path[length++] = '/';
+            memcpy(path + length, name, nameLength);
+            length += nameLength;
+        }
+        name += nameLength;
+    }
+    path[length] = 0;
+    if (length == 0) {
+        printf("Invalid name: %s\n", pathName); // (that's /)
+        free(path);
+        return;
+    }
+
+    // queue it
+    if (queuedCount == queuedCapacity) {
+        int newCapacity = queuedCapacity ? 2 * queuedCapacity : 64;
+        TRANSACTIONOP *newQueued = realloc(queued, newCapacity * sizeof(TRANSACTIONOP));
+        if (newQueued == NULL) {
+            printf("Error: memory allocation failed!\n");
+            free(path);
+            return;
+        }
+        queued = newQueued;
+        queuedCapacity = newCapacity;
+    }
+    queued[queuedCount].op = op;
+    queued[queuedCount++].path = path;
+}
+
+// journal replay: applies a transaction record's operations ("Xpath\0" for each). returns 0 on success
+int transactionReplay(NODE *root, char *ops, size_t length) {
+    // split the record into ops (the paths are already absolute)
+    int count = 0;
+    for (size_t i = 0; i < length; i++) count += (ops[i] == 0);
+    TRANSACTIONOP *replayed = malloc((count ? count : 1) * sizeof(TRANSACTIONOP));
+    if (replayed == NULL) {
+        printf("Error: memory allocation failed!\n");
+        return -1;
+    }
+    count = 0;
+    for (size_t i = 0; i < length; i += strlen(ops + i) + 1) {
+        replayed[count].op = ops[i];
+        replayed[count++].path = ops + i + 1;
+    }
+    int status = applyOps(root, root, replayed, count);
+    free(replayed);
+    return status;
+}
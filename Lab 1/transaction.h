@@ -0,0 +1,32 @@
+#ifndef __TRANSACTION_H__
+#define __TRANSACTION_H__
+
+#include "node.h"
+
+// begin ... commit groups mkdir, creat, rmdir and rm into one atomic change. between them those
+// commands are only queued (with their paths made absolute). commit checks the whole queue against
+// the tree first, in order, tracking what each path holds after every step - if any command would
+// fail, nothing is applied. otherwise only the net changes are made, sorted by parent: every
+// directory's child list is scanned once for all of its removals and once to append all of its
+// creations, and its aggregates are updated once. the journal gets a single record for the whole
+// transaction (split into parts ending in one commit record if it is too big for one)
+#define TRANSACTIONRECORDBYTES 60000    // max bytes of operations per journal record
+
+
+// main command functions
+// begin - start queueing mkdir, creat, rmdir and rm
+void begin();
+// commit - apply the queued commands, all or nothing
+void commit(NODE *root, NODE *cwd);
+// abort - drop the queued commands (named so it doesn't clash with abort() in <stdlib.h>)
+void abortTransaction();
+
+// 1 between begin and commit/abort
+int transactionOpen();
+// queues a command (op is D for mkdir, F for creat, d for rmdir, f for rm) on pathName
+void transactionAdd(NODE *cwd, char op, char *pathName);
+// journal replay: applies a transaction record's operations ("Xpath\0" for each, ops as above)
+// returns 0 on success
+int transactionReplay(NODE *root, char *ops, size_t length);
+
+#endif /* __TRANSACTION_H__ */
@@ -0,0 +1,521 @@
+#include <fnmatch.h>
+#include <pthread.h>
+#include <time.h>
+#include "trigram.h"
+#include "lazy.h"
+
+// the ids of the nodes whose names have one trigram, in increasing order
+typedef struct posting {
+    uint32_t trigram;               // 0 for an empty slot (names never hold a 0 byte)
+    uint32_t count, capacity;
+    uint32_t *ids;
+} POSTING;
+
+static NODE *indexRoot = NULL;      // the root of the indexed tree (NULL while the index is off)
+static NODE **nodes = NULL;         // the node of each id (NULL once it is removed). id 0 is unused
+static uint32_t nodeCount = 0, nodeCapacity = 0;
+static uint32_t deadCount = 0;      // ids whose node was removed
+static POSTING *lists = NULL;       // open addressing table of posting lists by trigram
+static size_t listCapacity = 0, listCount = 0;
+static int listShift = 32;          // 32 - log2(listCapacity)
+static size_t postingBytes = 0;     // allocated for ids in the lists
+
+// sessions add and remove from many threads
+static pthread_mutex_t trigramLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// the slot a trigram starts probing at (Fibonacci hashing)
+static size_t homeSlot(uint32_t trigram) {
+    return (uint32_t)(trigram * 2654435769u) >> listShift;
+}
+
+// the list of trigram, or NULL if there is none
+static POSTING *findList(uint32_t trigram) {
+    for (size_t slot = homeSlot(trigram); lists[slot].trigram != 0; slot = (slot + 1) & (listCapacity - 1)) {
+        if (lists[slot].trigram == trigram) return &lists[slot];
+    }
+    return NULL;
+}
+
+// sizes the list table to capacity slots (a power of 2), moving the lists over. returns -1 if
+// allocation failed
+static int resizeLists(size_t capacity) {
+    POSTING *newLists = calloc(capacity, sizeof(POSTING));
+    if (newLists == NULL) return -1;
+    POSTING *oldLists = lists;
+    size_t oldCapacity = listCapacity;
+    lists = newLists;
+    listCapacity = capacity;
+    listShift = 32 - __builtin_ctzll(capacity);
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (oldLists[i].trigram == 0) continue;
+        size_t slot = homeSlot(oldLists[i].trigram);
+        while (lists[slot].trigram != 0) slot = (slot + 1) & (listCapacity - 1);
+        lists[slot] = oldLists[i];
+    }
+    free(oldLists);
+    return 0;
+}
+
+// the list of trigram, added empty if there is none. returns NULL if allocation failed
+static POSTING *addList(uint32_t trigram) {
+    POSTING *list = findList(trigram);
+    if (list != NULL) return list;
+    if (2 * (listCount + 1) > listCapacity && resizeLists(2 * listCapacity) < 0) return NULL;
+    size_t slot = homeSlot(trigram);
+    while (lists[slot].trigram != 0) slot = (slot + 1) & (listCapacity - 1);
+    lists[slot].trigram = trigram;
+    listCount++;
+    return &lists[slot];
+}
+
+// the trigrams of a name framed by TRIGRAMSTART and TRIGRAMEND. returns how many (the length of the name)
+static int nameTrigrams(char *name, uint32_t *trigrams) {
+    unsigned char framed[sizeof(((NODE*)0)->name) + 2];
+    size_t length = strlen(name);
+    framed[0] = TRIGRAMSTART;
+    memcpy(framed + 1, name, length);
+    framed[length + 1] = TRIGRAMEND;
+    for (size_t i = 0; i < length; i++) trigrams[i] = framed[i] << 16 | framed[i + 1] << 8 | framed[i + 2];
+    return length;
+}
+
+// gives node the next id and adds it to the lists of its trigrams. returns -1 if allocation failed
+static int addNode(NODE *node) {
+    if (nodeCount == nodeCapacity) {
+        uint32_t newCapacity = 2 * nodeCapacity;
+        NODE **newNodes = realloc(nodes, newCapacity * sizeof(NODE*));
+        if (newNodes == NULL) return -1;
+        nodes = newNodes;
+        nodeCapacity = newCapacity;
+    }
+    uint32_t id = nodeCount++;
+    nodes[id] = node;
+    node->nameId = id;
+
+    uint32_t trigrams[sizeof(node->name)];
+    int count = nameTrigrams(node->name, trigrams);
+    for (int i = 0; i < count; i++) {
+        POSTING *list = addList(trigrams[i]);
+        if (list == NULL) return -1;
+        if (list->count > 0 && list->ids[list->count - 1] == id) continue; // a trigram the name has twice
+        if (list->count == list->capacity) {
+            uint32_t newCapacity = list->capacity ? 2 * list->capacity : 4;
+            uint32_t *newIds = realloc(list->ids, newCapacity * sizeof(uint32_t));
+            if (newIds == NULL) return -1;
+            postingBytes += (newCapacity - list->capacity) * sizeof(uint32_t);
+            list->ids = newIds;
+            list->capacity = newCapacity;
+        }
+        list->ids[list->count++] = id;
+    }
+    return 0;
+}
+
+// clears node's id (its entries in the lists are skipped from then on, and go with the next fill)
+static void deleteNode(NODE *node) {
+    uint32_t id = node->nameId;
+    if (id == 0 || id >= nodeCount || nodes[id] != node) return;
+    nodes[id] = NULL;
+    node->nameId = 0;
+    deadCount++;
+}
+
+// frees the lists and the id table (the index is off)
+static void dropIndex() {
+    for (size_t i = 0; i < listCapacity; i++) free(lists[i].ids);
+    free(lists);
+    free(nodes);
+    lists = NULL;
+    nodes = NULL;
+    listCapacity = listCount = postingBytes = 0;
+    nodeCount = nodeCapacity = deadCount = 0;
+    indexRoot = NULL;
+}
+
+// empties the index and adds every node below root in DFS order. returns -1 if allocation failed
+// (the index is then off)
+static int fillIndex(NODE *root) {
+    NODE *indexed = root;
+    dropIndex();
+    indexRoot = indexed;
+    nodeCapacity = 1024;
+    nodes = malloc(nodeCapacity * sizeof(NODE*));
+    if (nodes == NULL || resizeLists(TRIGRAMMINSLOTS) < 0) {
+        dropIndex();
+        return -1;
+    }
+    nodes[0] = NULL;
+    nodeCount = 1;
+
+    NODE *pCur = root->child;
+    while (pCur != NULL) {
+        if (addNode(pCur) < 0) {
+            dropIndex();
+            return -1;
+        }
+        // go to child
+        if (pCur->child != NULL) {
+            pCur = pCur->child;
+            continue;
+        }
+        // go to the next sibling, or climb until there is one
+        while (pCur->sibling == NULL && pCur->parent != root) pCur = pCur->parent;
+        pCur = pCur->sibling;
+    }
+    return 0;
+}
+
+// where the bracket expression starting at c ends (its ']'), or NULL if it doesn't (the '[' is then literal)
+static char *bracketEnd(char *c) {
+    char *p = c + 1;
+    if (*p == '!' || *p == '^') p++;
+    if (*p == ']') p++; // a ']' first is part of the set
+    while (*p != 0 && *p != ']') {
+        if (p[0] == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            // a class like [:alpha:] - skip to its closing ":]"
+            char *close = strchr(p + 2, p[1]);
+            while (close != NULL && close[1] != ']') close = strchr(close + 1, p[1]);
+            if (close == NULL) return NULL;
+            p = close + 2;
+        }
+        else if (p[0] == '\\' && p[1] != 0) p += 2;
+        else p++;
+    }
+    return *p == ']' ? p : NULL;
+}
+
+// the trigrams every name matching pattern has: those of each run of literal characters, with
+// TRIGRAMSTART in front of a run that starts the pattern and TRIGRAMEND after one that ends it
+// returns how many (trigrams needs room for MAXLINELENGTH + 2)
+static int patternTrigrams(char *pattern, uint32_t *trigrams) {
+    unsigned char run[MAXLINELENGTH + 2];
+    int runLength = 0, count = 0;
+    run[runLength++] = TRIGRAMSTART;
+    for (char *c = pattern; ; c++) {
+        int literal;
+        if (*c == 0) literal = TRIGRAMEND;
+        else if (*c == '\\' && c[1] != 0) literal = (unsigned char)*++c;
+        else if (*c == '*' || *c == '?') literal = -1;
+        else if (*c == '[' && bracketEnd(c) != NULL) {
+            c = bracketEnd(c);
+            literal = -1;
+        }
+        else literal = (unsigned char)*c;
+
+        // a wildcard ends the run
+        if (literal >= 0 && runLength < (int)sizeof(run)) {
+            run[runLength++] = literal;
+            if (runLength >= 3 && count < MAXLINELENGTH + 2) {
+                trigrams[count++] = run[runLength - 3] << 16 | run[runLength - 2] << 8 | run[runLength - 1];
+            }
+        }
+        else runLength = 0;
+        if (*c == 0) break;
+    }
+    return count;
+}
+
+// the first index in ids[from, to) whose id isn't below id
+static size_t lowerBound(uint32_t *ids, size_t from, size_t to, uint32_t id) {
+    while (from < to) {
+        size_t middle = from + (to - from) / 2;
+        if (ids[middle] < id) from = middle + 1;
+        else to = middle;
+    }
+    return from;
+}
+
+// keeps the candidates that are in list. returns how many are left
+// both are sorted, so each candidate is found by galloping forward from the last one
+static size_t intersect(uint32_t *candidates, size_t count, POSTING *list) {
+    size_t kept = 0, j = 0;
+    for (size_t i = 0; i < count && j < list->count; i++) {
+        uint32_t id = candidates[i];
+        size_t bound = 1;
+        while (j + bound < list->count && list->ids[j + bound] < id) bound *= 2;
+        j = lowerBound(list->ids, j, j + bound + 1 < list->count ? j + bound + 1 : list->count, id);
+        if (j < list->count && list->ids[j] == id) candidates[kept++] = id;
+    }
+    return kept;
+}
+
+// adds the absolute path of node and a newline to an output buffer of LSBUFFERSIZE bytes,
+// writing the buffer out first if it is full (like writeAbsolutePath, but without a stdio call
+// per line - a path longer than the whole buffer goes straight to writeAbsolutePath)
+static void addPath(char *buffer, size_t *used, NODE *node) {
+    size_t length = absolutePathLength(node);
+    if (*used + length + 1 > LSBUFFERSIZE) {
+        fwrite(buffer, 1, *used, stdout);
+        *used = 0;
+    }
+    if (length + 1 > LSBUFFERSIZE) {
+        writeAbsolutePath(stdout, node);
+        return;
+    }
+    buildAbsolutePath(node, buffer + *used, length);
+    buffer[*used + length] = '\n';
+    *used += length + 1;
+}
+
+// the nodes below start whose names match pattern, printed if print is set. returns how many,
+// or -1 if the pattern has no trigrams (index lock held)
+static long query(NODE *start, char *pattern, int print) {
+    uint32_t trigrams[MAXLINELENGTH + 2];
+    int trigramCount = patternTrigrams(pattern, trigrams);
+    if (trigramCount == 0) return -1;
+
+    // the lists, shortest first (any missing one means no name has the trigram)
+    POSTING *found[MAXLINELENGTH + 2];
+    for (int i = 0; i < trigramCount; i++) {
+        found[i] = findList(trigrams[i]);
+        if (found[i] == NULL) return 0;
+        for (int j = i; j > 0 && found[j]->count < found[j - 1]->count; j--) {
+            POSTING *swap = found[j];
+            found[j] = found[j - 1];
+            found[j - 1] = swap;
+        }
+    }
+
+    // intersect them
+    uint32_t *candidates = malloc((found[0]->count + 1) * sizeof(uint32_t));
+    char *buffer = print ? malloc(LSBUFFERSIZE) : NULL;
+    if (candidates == NULL || (print && buffer == NULL)) {
+        printf("Error: memory allocation failed!\n");
+        free(candidates);
+        free(buffer);
+        return 0;
+    }
+    memcpy(candidates, found[0]->ids, found[0]->count * sizeof(uint32_t));
+    size_t count = found[0]->count;
+    for (int i = 1; i < trigramCount && count > 0; i++) {
+        if (found[i] != found[i - 1]) count = intersect(candidates, count, found[i]);
+    }
+
+    // check the candidates that are still alive against the whole pattern, and against start
+    long matches = 0;
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        NODE *node = nodes[candidates[i]];
+        if (node == NULL || fnmatch(pattern, node->name, 0) != 0) continue;
+        if (start != indexRoot) {
+            NODE *pCur = node->parent;
+            while (pCur != start && pCur->parent != pCur) pCur = pCur->parent;
+            if (pCur != start) continue;
+        }
+        if (print) addPath(buffer, &used, node);
+        matches++;
+    }
+    if (print) fwrite(buffer, 1, used, stdout);
+    free(candidates);
+    free(buffer);
+    return matches;
+}
+
+
+// helper for find. prints the path of every node below start whose name matches pattern, and
+// returns 1 - or returns 0 without printing anything if the index is off or pattern has no trigrams
+// the matches come in the order their nodes were indexed, not in DFS order
+int trigramFind(NODE *start, char *pattern) {
+    if (indexRoot == NULL || pattern == NULL) return 0;
+    pthread_mutex_lock(&trigramLock);
+
+    // the index covers the live tree only
+    NODE *top = start;
+    while (top->parent != top) top = top->parent;
+    if (top != indexRoot) {
+        pthread_mutex_unlock(&trigramLock);
+        return 0;
+    }
+
+    // drop the dead ids once they are most of the index
+    if (2 * deadCount > nodeCount && fillIndex(indexRoot) < 0) {
+        printf("Error: memory allocation failed! Trigram index off\n");
+        pthread_mutex_unlock(&trigramLock);
+        return 0;
+    }
+    long matches = query(start, pattern, 1);
+    pthread_mutex_unlock(&trigramLock);
+    return matches >= 0;
+}
+
+// whether nodes linked or unlinked under dir have to be added to or deleted from the index
+// (like pathIndexCovers, by walking up to dir's root - scratch trees aren't indexed)
+int trigramCovers(NODE *dir) {
+    if (indexRoot == NULL) return 0;
+    while (dir->parent != dir) dir = dir->parent;
+    return dir == indexRoot;
+}
+
+// call after linking node into the live tree, or renaming it (a no-op while the index is off)
+void trigramAdd(NODE *node) {
+    if (indexRoot == NULL) return;
+    pthread_mutex_lock(&trigramLock);
+    if (addNode(node) < 0) {
+        printf("Error: memory allocation failed! Trigram index off\n");
+        dropIndex();
+    }
+    pthread_mutex_unlock(&trigramLock);
+}
+
+// call before unlinking node from the live tree, or renaming it (a no-op while the index is off)
+void trigramDelete(NODE *node) {
+    if (indexRoot == NULL) return;
+    pthread_mutex_lock(&trigramLock);
+    deleteNode(node);
+    pthread_mutex_unlock(&trigramLock);
+}
+
+// call after linking node and everything under it (import)
+void trigramAddSubtree(NODE *node) {
+    if (indexRoot == NULL) return;
+    pthread_mutex_lock(&trigramLock);
+    int status = addNode(node);
+    NODE *pCur = node->child;
+    while (pCur != NULL && status == 0) {
+        status = addNode(pCur);
+        if (pCur->child != NULL) {
+            pCur = pCur->child;
+            continue;
+        }
+        while (pCur->sibling == NULL && pCur->parent != node) pCur = pCur->parent;
+        pCur = pCur->sibling;
+    }
+    if (status < 0) {
+        printf("Error: memory allocation failed! Trigram index off\n");
+        dropIndex();
+    }
+    pthread_mutex_unlock(&trigramLock);
+}
+
+// call before unlinking node and everything under it (rm -r)
+void trigramDeleteSubtree(NODE *node) {
+    if (indexRoot == NULL) return;
+    pthread_mutex_lock(&trigramLock);
+    deleteNode(node);
+    NODE *pCur = node->child;
+    while (pCur != NULL) {
+        deleteNode(pCur);
+        if (pCur->child != NULL) {
+            pCur = pCur->child;
+            continue;
+        }
+        while (pCur->sibling == NULL && pCur->parent != node) pCur = pCur->parent;
+        pCur = pCur->sibling;
+    }
+    pthread_mutex_unlock(&trigramLock);
+}
+
+// call after a whole-tree change under root (does nothing unless root is the indexed tree)
+void trigramRebuild(NODE *root) {
+    if (indexRoot == NULL || root != indexRoot) return;
+    pthread_mutex_lock(&trigramLock);
+    if (fillIndex(root) < 0) printf("Error: memory allocation failed! Trigram index off\n");
+    pthread_mutex_unlock(&trigramLock);
+}
+
+
+static double elapsedSeconds(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// counts the names matching pattern in the whole tree, walking it and through the index
+static void benchQuery(NODE *root, char *pattern) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long walked = 0;
+    NODE *pCur = root->child;
+    while (pCur != NULL) {
+        walked += fnmatch(pattern, pCur->name, 0) == 0;
+        if (pCur->child != NULL) {
+            pCur = pCur->child;
+            continue;
+        }
+        while (pCur->sibling == NULL && pCur->parent != root) pCur = pCur->parent;
+        pCur = pCur->sibling;
+    }
+    double walking = elapsedSeconds(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&trigramLock);
+    long matches = query(root, pattern, 0);
+    pthread_mutex_unlock(&trigramLock);
+    double indexed = elapsedSeconds(&start);
+
+    if (matches < 0) {
+        printf("%ld matches: %.1f ms walking (%s has no trigrams to look up)\n", walked, walking * 1e3, pattern);
+        return;
+    }
+    printf("%ld matches: %.1f ms walking, %.3f ms with the index\n", matches, walking * 1e3, indexed * 1e3);
+    if (matches != walked) printf("The index found %ld, the walk %ld!\n", matches, walked);
+}
+
+
+/*
+    trigrams [on | off | bench pattern]
+    on builds the index of the trigrams of every name in the tree, and find -name uses it from
+    then on for patterns with 3 or more characters in a row. off frees it. bench counts the names
+    matching pattern, walking and with the index. with no argument, prints whether it is on.
+*/
+void trigrams(NODE *root, char *args) {
+    char *command = args ? strtok(args, " ") : NULL;
+    char *arg = command ? strtok(NULL, "") : NULL;
+
+    if (command == NULL) {
+        if (indexRoot == NULL) printf("Trigram index off\n");
+        else printf("Trigram index on: %u names, %zu trigrams, %zu KiB\n", nodeCount - 1 - deadCount, listCount,
+            (nodeCapacity * sizeof(NODE*) + listCapacity * sizeof(POSTING) + postingBytes) / 1024);
+        return;
+    }
+
+    if (strcmp(command, "on") == 0) {
+        lazyExpandAll(root);
+        pthread_mutex_lock(&trigramLock);
+        int status = fillIndex(root);
+        pthread_mutex_unlock(&trigramLock);
+        if (status < 0) {
+            printf("Error: memory allocation failed!\n");
+            return;
+        }
+        printf("Trigram index on: %u names, %zu trigrams, %zu KiB\n", nodeCount - 1, listCount,
+            (nodeCapacity * sizeof(NODE*) + listCapacity * sizeof(POSTING) + postingBytes) / 1024);
+        return;
+    }
+
+    if (strcmp(command, "off") == 0) {
+        pthread_mutex_lock(&trigramLock);
+        dropIndex();
+        pthread_mutex_unlock(&trigramLock);
+        return;
+    }
+
+    if (strcmp(command, "bench") == 0) {
+        if (arg == NULL) {
+            printf("Too few arguments!\n");
+            return;
+        }
+        // the index is only built for the benchmark if it is off
+        int wasOn = (indexRoot != NULL);
+        lazyExpandAll(root);
+        if (!wasOn || 2 * deadCount > nodeCount) {
+            pthread_mutex_lock(&trigramLock);
+            int status = fillIndex(root);
+            pthread_mutex_unlock(&trigramLock);
+            if (status < 0) {
+                printf("Error: memory allocation failed!\n");
+                return;
+            }
+        }
+        benchQuery(root, arg);
+        if (!wasOn) {
+            pthread_mutex_lock(&trigramLock);
+            dropIndex();
+            pthread_mutex_unlock(&trigramLock);
+        }
+        return;
+    }
+
+    printf("Usage: trigrams [on | off | bench pattern]\n");
+}
@@ -0,0 +1,42 @@
+#ifndef __TRIGRAM_H__
+#define __TRIGRAM_H__
+
+#include "node.h"
+
+// an optional inverted index from the trigrams of names to the nodes that have them, so
+// find -name pattern only looks at nodes that can match instead of walking the whole tree
+// each node in the live tree gets an id (nameId, in creation order), and every trigram of its name
+// (framed by TRIGRAMSTART and TRIGRAMEND, so "ab" has 2 and prefixes and suffixes are selective)
+// has a posting list of ids. ids only grow, so every list is sorted and lists are intersected by
+// merging. a pattern's literal runs (the text between *, ? and [...]) give the trigrams every
+// match must have; the intersection of their lists is checked with fnmatch, and each match's path
+// is built up its parent chain. a pattern with no run of 3 (like "*.c" or "a*") walks instead
+// creates add a node's trigrams under one lock (sessions add from many threads). a remove only
+// clears the node's slot in the id table, and the lists are rebuilt by the next find once more
+// than half of the ids are dead. a rename is a remove and an add. whole-tree changes (reload,
+// bload, compact) rebuild it
+#define TRIGRAMSTART '\001'
+#define TRIGRAMEND '\002'
+#define TRIGRAMMINSLOTS 1024    // trigram hash table slots to start with
+
+
+// main command function. runs "trigrams [on | off | bench pattern]"
+void trigrams(NODE *root, char *args);
+
+// helper for find. prints the path of every node below start whose name matches pattern, and
+// returns 1 - or returns 0 without printing anything if the index is off or pattern has no trigrams
+int trigramFind(NODE *start, char *pattern);
+// whether nodes linked or unlinked under dir have to be added to or deleted from the index
+int trigramCovers(NODE *dir);
+// call after linking node into the live tree, or renaming it
+void trigramAdd(NODE *node);
+// call before unlinking node from the live tree, or renaming it
+void trigramDelete(NODE *node);
+// call after linking node and everything under it (import)
+void trigramAddSubtree(NODE *node);
+// call before unlinking node and everything under it (rm -r)
+void trigramDeleteSubtree(NODE *node);
+// call after a whole-tree change under root (does nothing unless root is the indexed tree)
+void trigramRebuild(NODE *root);
+
+#endif /* __TRIGRAM_H__ */